@@ -0,0 +1,102 @@
+#include <cstdlib>
+#include <cstring>  // memcpy
+#include <new>
+
+#include "arena.h"
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Chunks of this size are cached per thread; larger allocations get a
+// chunk of their own, which is freed with the arena.
+const size_t kChunkSize = 16 << 10;
+const size_t kMaxCachedChunks = 8;
+
+// Freed standard-size chunks, linked through their first word.
+struct ChunkCache {
+    ChunkCache() : head{nullptr}, count{0} {}
+    ~ChunkCache() {
+        while (head) {
+            void *next = *static_cast<void **>(head);
+            free(head);
+            head = next;
+        }
+    }
+
+    void *head;
+    size_t count;
+};
+
+thread_local ChunkCache chunk_cache;
+
+void *new_chunk(size_t size) {
+    if (size == kChunkSize && chunk_cache.head) {
+        void *chunk = chunk_cache.head;
+        chunk_cache.head = *static_cast<void **>(chunk);
+        chunk_cache.count--;
+        return chunk;
+    }
+    void *chunk = malloc(size);
+    if (!chunk) {
+        throw std::bad_alloc{};
+    }
+    return chunk;
+}
+
+void free_chunk(void *chunk, size_t size) {
+    if (size == kChunkSize && chunk_cache.count < kMaxCachedChunks) {
+        *static_cast<void **>(chunk) = chunk_cache.head;
+        chunk_cache.head = chunk;
+        chunk_cache.count++;
+    } else {
+        free(chunk);
+    }
+}
+
+}  // anonymous namespace
+
+Arena::~Arena() {
+    while (chunks_) {
+        Chunk *next = chunks_->next;
+        free_chunk(chunks_, chunks_->size);
+        chunks_ = next;
+    }
+}
+
+const char *Arena::copy(const char *data, size_t size) {
+    if (size == 0) {
+        return "";
+    }
+    char *result = static_cast<char *>(allocate(size));
+    memcpy(result, data, size);
+    return result;
+}
+
+void *Arena::allocate_slow(size_t size) {
+    const size_t header_size = (sizeof(Chunk) + kAlign - 1) & ~(kAlign - 1);
+
+    // Big allocations get their own chunk, leaving the current one in use.
+    if (header_size + size > kChunkSize / 4) {
+        size_t chunk_size = header_size + size;
+        auto chunk = static_cast<Chunk *>(new_chunk(chunk_size));
+        chunk->size = chunk_size;
+        if (chunks_) {
+            chunk->next = chunks_->next;
+            chunks_->next = chunk;
+        } else {
+            chunk->next = nullptr;
+            chunks_ = chunk;
+        }
+        return reinterpret_cast<char *>(chunk) + header_size;
+    }
+
+    auto chunk = static_cast<Chunk *>(new_chunk(kChunkSize));
+    chunk->size = kChunkSize;
+    chunk->next = chunks_;
+    chunks_ = chunk;
+    pos_ = reinterpret_cast<char *>(chunk) + header_size + size;
+    end_ = reinterpret_cast<char *>(chunk) + kChunkSize;
+    return reinterpret_cast<char *>(chunk) + header_size;
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,93 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace slapo_py_update_hook {
+
+// A bump allocator for the memory of a single operation, all of which is
+// freed at once when the arena is destroyed. Chunks are recycled through a
+// per-thread cache, so an operation normally doesn't call malloc at all.
+class Arena {
+  public:
+    Arena() : chunks_{nullptr}, pos_{nullptr}, end_{nullptr} {}
+    Arena(const Arena &) = delete;
+    ~Arena();
+    void operator=(const Arena &) = delete;
+
+    void *allocate(size_t size) {
+        size = (size + kAlign - 1) & ~(kAlign - 1);
+        if (static_cast<size_t>(end_ - pos_) < size) {
+            return allocate_slow(size);
+        }
+        void *result = pos_;
+        pos_ += size;
+        return result;
+    }
+
+    // Returns a copy of data in the arena.
+    const char *copy(const char *data, size_t size);
+
+  private:
+    static const size_t kAlign = alignof(std::max_align_t);
+
+    struct Chunk {
+        Chunk *next;
+        size_t size;  // including this header
+    };
+
+    void *allocate_slow(size_t size);
+
+    Chunk *chunks_;
+    char *pos_;
+    char *end_;
+};
+
+// Lets standard containers allocate from an Arena. Deallocation is a no-op,
+// so containers in an arena should be reserved up front where possible.
+template <class T>
+class ArenaAllocator {
+  public:
+    typedef T value_type;
+
+    // Without an arena, allocates from the heap.
+    ArenaAllocator() : arena_{nullptr} {}
+    explicit ArenaAllocator(Arena &arena) : arena_{&arena} {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena_{other.arena()} {}
+
+    T *allocate(size_t n) {
+        size_t size = n * sizeof(T);
+        return static_cast<T *>(arena_ ? arena_->allocate(size)
+                                       : ::operator new(size));
+    }
+    void deallocate(T *ptr, size_t) {
+        if (!arena_) {
+            ::operator delete(ptr);
+        }
+    }
+
+    Arena *arena() const { return arena_; }
+
+  private:
+    Arena *arena_;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena() == b.arena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena() != b.arena();
+}
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}  // namespace slapo_py_update_hook
+
+#endif  // ARENA_H_
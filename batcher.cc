@@ -0,0 +1,179 @@
+#include <algorithm>  // min
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "batcher.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+class Batcher : public InstanceInfo {
+  public:
+    Batcher(unique_ptr<InstanceInfo> inner, const BatchConfig &config)
+        : inner_{std::move(inner)}, config_(config), leading_{false} {}
+    Batcher(const Batcher &) = delete;
+    void operator=(const Batcher &) = delete;
+
+    void set_filename(const string &name) override {
+        inner_->set_filename(name);
+    }
+    void set_function_name(const string &name) override {
+        inner_->set_function_name(name);
+    }
+    void add_function_name(const string &name) override {
+        inner_->add_function_name(name);
+    }
+    void add_file(const string &filename,
+                  const string &function_name) override {
+        inner_->add_file(filename, function_name);
+    }
+    void set_zero_copy(bool zero_copy) override {
+        inner_->set_zero_copy(zero_copy);
+    }
+    void set_interpreters(unsigned interpreters) override {
+        inner_->set_interpreters(interpreters);
+    }
+    void set_entry_cache_size(size_t size) override {
+        inner_->set_entry_cache_size(size);
+    }
+    void set_value_set_threshold(size_t threshold) override {
+        inner_->set_value_set_threshold(threshold);
+    }
+    void set_bytecode_cache(const string &dir) override {
+        inner_->set_bytecode_cache(dir);
+    }
+    void set_share_module(bool share) override {
+        inner_->set_share_module(share);
+    }
+    void set_timeout(unsigned long ms) override { inner_->set_timeout(ms); }
+    void set_timeout_status(int status) override {
+        inner_->set_timeout_status(status);
+    }
+    void set_profile(const string &path, unsigned hz) override {
+        inner_->set_profile(path, hz);
+    }
+    void open() override { inner_->open(); }
+    bool reload(string &error) override { return inner_->reload(error); }
+    int update(ModificationOp &op, string &error) override {
+        return enqueue(nullptr, op, error);
+    }
+    int update(const string &function_name, ModificationOp &op,
+               string &error) override {
+        return enqueue(&function_name, op, error);
+    }
+    void update_batch(vector<BatchItem> &items) override {
+        inner_->update_batch(items);
+    }
+    void get_counters(vector<NamedCounter> &counters) const override {
+        inner_->get_counters(counters);
+    }
+
+  private:
+    // An update waiting in the queue, on its caller's stack.
+    struct Waiter {
+        BatchItem item;
+        bool done;
+    };
+
+    int enqueue(const string *function_name, ModificationOp &op,
+                string &error);
+    // Takes a batch off the queue and runs it; called with mu_ held, by the
+    // thread which set leading_.
+    void lead(std::unique_lock<std::mutex> &lock);
+
+    unique_ptr<InstanceInfo> inner_;
+    const BatchConfig config_;
+
+    std::mutex mu_;
+    std::deque<Waiter *> queue_;
+    // Set while a thread is gathering or running a batch.
+    bool leading_;
+    // Signalled when a batch completes.
+    std::condition_variable done_cv_;
+    // Signalled when the queue fills up during the leader's window.
+    std::condition_variable full_cv_;
+};
+
+int Batcher::enqueue(const string *function_name, ModificationOp &op,
+                     string &error) {
+    Waiter waiter{BatchItem{function_name, &op, UpdateResult{0, false, ""}},
+                  false};
+
+    std::unique_lock<std::mutex> lock{mu_};
+    queue_.push_back(&waiter);
+    if (queue_.size() >= config_.max_size) {
+        full_cv_.notify_one();
+    }
+    // Whoever finds nobody leading runs the next batch, which includes
+    // their own update unless the queue is longer than a batch.
+    while (!waiter.done) {
+        if (leading_) {
+            done_cv_.wait(lock);
+        } else {
+            lead(lock);
+        }
+    }
+    lock.unlock();
+
+    const UpdateResult &result = waiter.item.result;
+    if (result.exception) {
+        throw PyError{result.error};
+    } else if (result.status != 0) {  // LDAP_SUCCESS
+        error = result.error;
+    }
+    return result.status;
+}
+
+void Batcher::lead(std::unique_lock<std::mutex> &lock) {
+    leading_ = true;
+    if (config_.window_us > 0) {
+        full_cv_.wait_for(lock, std::chrono::microseconds{config_.window_us},
+                          [this] { return queue_.size() >= config_.max_size; });
+    }
+
+    size_t size = std::min<size_t>(queue_.size(), config_.max_size);
+    vector<Waiter *> batch(queue_.begin(), queue_.begin() + size);
+    queue_.erase(queue_.begin(), queue_.begin() + size);
+    lock.unlock();
+
+    vector<BatchItem> items;
+    items.reserve(size);
+    for (Waiter *waiter : batch) {
+        items.push_back(waiter->item);
+    }
+    try {
+        inner_->update_batch(items);
+    } catch (PyError &exc) {
+        for (BatchItem &item : items) {
+            item.result = UpdateResult{0, true, exc.what()};
+        }
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < size; i++) {
+        batch[i]->item.result = std::move(items[i].result);
+        batch[i]->done = true;
+    }
+    leading_ = false;
+    done_cv_.notify_all();
+}
+
+}  // anonymous namespace
+
+InstanceInfo *create_batcher(unique_ptr<InstanceInfo> inner,
+                             const BatchConfig &config) {
+    return new Batcher{std::move(inner), config};
+}
+
+}  // namespace slapo_py_update_hook
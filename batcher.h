@@ -0,0 +1,28 @@
+#ifndef BATCHER_H_
+#define BATCHER_H_
+
+#include <memory>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+struct BatchConfig {
+    // Largest number of updates handed to inner at once. Batching is only
+    // enabled if this is more than 1.
+    unsigned max_size = 0;
+    // How long a batch waits for more updates to join it before it runs.
+    // Even with no window, updates which arrive while a batch is running
+    // form the next one.
+    unsigned window_us = 0;
+};
+
+// Creates an InstanceInfo which queues concurrent updates and hands them to
+// inner's update_batch together, from whichever of the waiting threads
+// gets there first.
+InstanceInfo *create_batcher(std::unique_ptr<InstanceInfo> inner,
+                             const BatchConfig &config);
+
+}  // namespace slapo_py_update_hook
+
+#endif  // BATCHER_H_
@@ -0,0 +1,735 @@
+// Drives InstanceInfo with synthetic ModificationOps, or those of a capture
+// log, from several threads, without slapd, and reports throughput and
+// latency. See README.md.
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>  // memcmp, memcpy, strlen
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "batcher.h"
+#include "capture.h"
+#include "memo_cache.h"
+#include "post_queue.h"
+#include "mod_op_codec.h"
+#include "stats.h"
+#include "worker_pool.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace slapo_py_update_hook {
+
+// What side_ldap.cc would otherwise provide, with slapd's values.
+const std::map<string, int> py_consts{
+    {"SLAP_MOD_INTERNAL", 0x01},
+    {"SLAP_MOD_MANAGING", 0x02},
+    {"LDAP_MOD_ADD", 0},
+    {"LDAP_MOD_DELETE", 1},
+    {"LDAP_MOD_REPLACE", 2},
+};
+
+void log_error(const string &message) {
+    fprintf(stderr, "%s\n", message.c_str());
+}
+
+// Without slapd's schema, values and DNs are compared as they are.
+bool normalize_value(ValueRef name, const void *desc, ValueRef value,
+                     string &out, string &error) {
+    out.assign(value.data, value.size);
+    return true;
+}
+
+bool equality_match(ValueRef name, const void *desc, ValueRef a, ValueRef b,
+                    bool &match, string &error) {
+    match = a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+    return true;
+}
+
+bool dn_normalize(ValueRef dn, string &out, string &error) {
+    out.assign(dn.data, dn.size);
+    return true;
+}
+
+bool dn_is_descendant(ValueRef dn, ValueRef base, bool &descendant,
+                      string &error) {
+    size_t offset = dn.size - base.size;
+    descendant =
+        dn.size > base.size &&
+        (base.size == 0 || dn.data[offset - 1] == ',') &&
+        memcmp(dn.data + offset, base.data, base.size) == 0;
+    return true;
+}
+
+namespace {
+
+const int kLdapOther = 0x50;  // LDAP_OTHER
+const char kEntryCsn[] = "20261017000000.000000Z#000000#000#000000";
+
+struct Options {
+    string filename;
+    // Files after the first, whose update functions form a pipeline.
+    vector<string> pipeline;
+    string function_name;
+    unsigned threads = 1;
+    unsigned ops = 10000;  // per thread
+    unsigned entry_attrs = 10;
+    unsigned entry_values = 1;
+    unsigned mods = 1;
+    unsigned mod_values = 1;
+    unsigned value_size = 16;
+    unsigned distinct_dns = 0;  // 0 means every op has its own
+    bool zero_copy = false;
+    unsigned interpreters = 0;
+    unsigned entry_cache = 0;
+    unsigned value_set_threshold = 0;
+    string bytecode_cache;
+    bool share_module = false;
+    unsigned databases = 1;
+    unsigned reload_ms = 0;
+    unsigned timeout_ms = 0;
+    string profile_path;
+    bool pure = false;
+    bool stats = false;
+    string capture_path;
+    string replay_path;
+    bool paced = false;
+    WorkerPoolConfig worker_pool;
+    BatchConfig batch;
+    PostConfig post;
+};
+
+const char usage[] =
+    "usage: %s [options] hook.py [hook.py ...]\n"
+    "  -f NAME   function to call (default update)\n"
+    "  -t N      threads (default 1)\n"
+    "  -n N      ops per thread (default 10000)\n"
+    "  -a N      entry attributes (default 10)\n"
+    "  -e N      values per entry attribute (default 1)\n"
+    "  -m N      modifications per op (default 1)\n"
+    "  -c N      values per modification (default 1)\n"
+    "  -s BYTES  size of each value (default 16)\n"
+    "  -u N      cycle through N distinct DNs (default: all distinct)\n"
+    "  -z        py_zero_copy on\n"
+    "  -p        py_pure (dn and mods)\n"
+    "  -i N      py_interpreters N\n"
+    "  -E N      py_entry_cache N\n"
+    "  -V N      py_value_set_threshold N\n"
+    "  -B DIR    py_bytecode_cache DIR\n"
+    "  -M        py_share_module on\n"
+    "  -D N      open the hook for N databases, as slapd would\n"
+    "  -r MS     reload the hook files every MS ms while the ops run, as\n"
+    "            py_reload would whenever they changed\n"
+    "  -T MS     py_timeout MS\n"
+    "  -F FILE   py_profile FILE\n"
+    "  -w N      py_workers N\n"
+    "  -b N      py_batch_size N\n"
+    "  -W USEC   py_batch_window USEC\n"
+    "  -O NAME   py_post_function NAME, queued after each successful op\n"
+    "  -Q N      py_post_queue_size N\n"
+    "  -q BYTES  py_post_queue_bytes BYTES\n"
+    "  -G        py_post_coalesce on\n"
+    "  -S        report per-phase latency as well\n"
+    "  -C FILE   capture the operations to FILE, as py_capture would\n"
+    "  -R FILE   replay the operations captured in FILE instead; -n and the\n"
+    "            options describing operations are ignored\n"
+    "  -P        replay at the pace the operations were captured\n";
+
+bool parse_options(int argc, char **argv, Options &options) {
+    int opt;
+    const char *optstring =
+        "f:t:n:a:e:m:c:s:u:zi:E:V:B:MD:r:T:F:pw:b:W:O:Q:q:GSC:R:P";
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
+        unsigned value = optarg ? strtoul(optarg, nullptr, 10) : 0;
+        switch (opt) {
+        case 'f':
+            options.function_name = optarg;
+            break;
+        case 't':
+            options.threads = std::max(value, 1u);
+            break;
+        case 'n':
+            options.ops = value;
+            break;
+        case 'a':
+            options.entry_attrs = value;
+            break;
+        case 'e':
+            options.entry_values = value;
+            break;
+        case 'm':
+            options.mods = value;
+            break;
+        case 'c':
+            options.mod_values = value;
+            break;
+        case 's':
+            options.value_size = value;
+            break;
+        case 'u':
+            options.distinct_dns = value;
+            break;
+        case 'z':
+            options.zero_copy = true;
+            break;
+        case 'i':
+            options.interpreters = value;
+            break;
+        case 'E':
+            options.entry_cache = value;
+            break;
+        case 'V':
+            options.value_set_threshold = value;
+            break;
+        case 'B':
+            options.bytecode_cache = optarg;
+            break;
+        case 'M':
+            options.share_module = true;
+            break;
+        case 'D':
+            options.databases = std::max(value, 1u);
+            break;
+        case 'r':
+            options.reload_ms = value;
+            break;
+        case 'T':
+            options.timeout_ms = value;
+            break;
+        case 'F':
+            options.profile_path = optarg;
+            break;
+        case 'p':
+            options.pure = true;
+            break;
+        case 'w':
+            options.worker_pool.workers = value;
+            break;
+        case 'b':
+            options.batch.max_size = value;
+            break;
+        case 'W':
+            options.batch.window_us = value;
+            break;
+        case 'O':
+            options.post.function_name = optarg;
+            break;
+        case 'Q':
+            options.post.max_queued = std::max(value, 1u);
+            break;
+        case 'q':
+            options.post.max_queued_bytes = std::max(value, 1u);
+            break;
+        case 'G':
+            options.post.coalesce = true;
+            break;
+        case 'S':
+            options.stats = true;
+            break;
+        case 'C':
+            options.capture_path = optarg;
+            break;
+        case 'R':
+            options.replay_path = optarg;
+            break;
+        case 'P':
+            options.paced = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (optind >= argc) {
+        return false;
+    } else if (options.worker_pool.workers > kMaxWorkers) {
+        fprintf(stderr, "-w must be at most %u\n", kMaxWorkers);
+        return false;
+    } else if (options.interpreters > 0 && options.worker_pool.workers > 0) {
+        fprintf(stderr, "-i can't be combined with -w\n");
+        return false;
+    } else if (options.interpreters > 0 && options.batch.max_size > 1) {
+        fprintf(stderr, "-b can't be combined with -i\n");
+        return false;
+    } else if ((options.timeout_ms > 0 || !options.profile_path.empty()) &&
+               options.worker_pool.workers > 0) {
+        fprintf(stderr, "-T and -F can't be combined with -w\n");
+        return false;
+    }
+    options.filename = argv[optind];
+    options.pipeline.assign(argv + optind + 1, argv + argc);
+    return true;
+}
+
+string make_value(size_t size, unsigned seed) {
+    string value(size, 'a');
+    for (size_t i = 0; i < size; i++) {
+        value[i] = 'a' + (seed + i * 7) % 26;
+    }
+    return value;
+}
+
+// The synthetic data shared by every op of a thread. Values are borrowed
+// from here, as they would be from slapd.
+struct OpTemplate {
+    OpTemplate(const Options &options, unsigned thread) {
+        auth_dn = "cn=bench" + std::to_string(thread) + ",dc=example";
+        value = make_value(options.value_size, thread);
+        // An attribute's values are distinct, as they are in slapd: each
+        // ends in its index, where it fits.
+        for (unsigned j = 0; j < options.entry_values; j++) {
+            string suffix = std::to_string(j);
+            entry_values.push_back(value);
+            if (suffix.size() <= value.size()) {
+                entry_values.back().replace(value.size() - suffix.size(),
+                                            suffix.size(), suffix);
+            }
+        }
+
+        for (unsigned i = 0; i < options.entry_attrs; i++) {
+            entry_names.push_back("attr" + std::to_string(i));
+        }
+        std::sort(entry_names.begin(), entry_names.end(),
+                  [](const string &a, const string &b) {
+                      return name_less(ValueRef{a.data(), a.size()},
+                                       ValueRef{b.data(), b.size()});
+                  });
+        for (const string &name : entry_names) {
+            FlatEntryView::Attribute attr;
+            attr.name = ValueRef{name.data(), name.size()};
+            attr.first_value = entry.values.size();
+            attr.num_values = options.entry_values;
+            for (const string &entry_value : entry_values) {
+                entry.values.push_back(
+                    ValueRef{entry_value.data(), entry_value.size()});
+            }
+            entry.attrs.push_back(attr);
+        }
+        // The entries never change.
+        entry.entry_version = ValueRef{kEntryCsn, strlen(kEntryCsn)};
+
+        for (unsigned i = 0; i < options.mods; i++) {
+            mod_names.push_back("mod" + std::to_string(i));
+        }
+    }
+
+    string auth_dn;
+    string value;
+    vector<string> entry_values;
+    vector<string> entry_names;
+    FlatEntryView entry;
+    vector<string> mod_names;
+};
+
+void fill_op(const Options &options, const OpTemplate &tmpl,
+             const string &dn, ModificationOp &op) {
+    op.dn = ValueRef{dn.data(), dn.size()};
+    op.auth_dn = ValueRef{tmpl.auth_dn.data(), tmpl.auth_dn.size()};
+    op.entry = &tmpl.entry;
+    op.mods.reserve(options.mods);
+    for (unsigned i = 0; i < options.mods; i++) {
+        Modification mod{op.arena};
+        const string &name = tmpl.mod_names[i];
+        mod.name = ValueRef{name.data(), name.size()};
+        mod.desc = &name;  // stands in for slapd's AttributeDescription
+        mod.values.reserve(options.mod_values);
+        for (unsigned j = 0; j < options.mod_values; j++) {
+            mod.values.push_back(Value::borrow(
+                ValueRef{tmpl.value.data(), tmpl.value.size()}));
+        }
+        mod.op = 2;  // LDAP_MOD_REPLACE
+        mod.origin = i;
+        op.mods.push_back(std::move(mod));
+    }
+}
+
+struct ThreadResult {
+    vector<uint64_t> latencies_ns;
+    unsigned errors = 0;
+    // Replayed updates whose outcome differs from the captured one.
+    unsigned mismatches = 0;
+};
+
+// Runs an update as modify_hook would, and returns its outcome.
+UpdateResult run_update(InstanceInfo *info, CaptureWriter &capture,
+                        PostQueue &post, const string &function_name,
+                        ModificationOp &op) {
+    Stats::Timer total_timer{Stats::kTotal};
+    Stats::add(Stats::kCalls);
+    CaptureWriter::Record record;
+    bool capturing = capture.begin(function_name, op, record);
+    UpdateResult result{0, false, ""};
+    try {
+        result.status = function_name.empty()
+                            ? info->update(op, result.error)
+                            : info->update(function_name, op, result.error);
+        if (result.status != 0) {
+            Stats::add(Stats::kRejections);
+        }
+    } catch (PyError &exc) {
+        Stats::add(Stats::kExceptions);
+        result = UpdateResult{kLdapOther, true, exc.what()};
+    }
+    if (capturing) {
+        capture.finish(record, result, op);
+    }
+    // As if slapd had committed it.
+    if (result.status == 0 && post.is_open()) {
+        post.push(op);
+    }
+    return result;
+}
+
+void note_result(const UpdateResult &result, ThreadResult &thread_result) {
+    if (result.status != 0 && thread_result.errors++ == 0) {
+        fprintf(stderr, "%s\n", result.error.c_str());
+    }
+}
+
+uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+void run_thread(const Options &options, InstanceInfo *info,
+                CaptureWriter *capture, PostQueue *post, Stats *stats,
+                unsigned thread, ThreadResult &result) {
+    Stats::Scope scope{stats};
+    OpTemplate tmpl{options, thread};
+    result.latencies_ns.reserve(options.ops);
+    for (unsigned i = 0; i < options.ops; i++) {
+        unsigned n = options.distinct_dns ? i % options.distinct_dns
+                                          : thread * options.ops + i;
+        string dn = "cn=user" + std::to_string(n) + ",dc=example";
+        auto start = std::chrono::steady_clock::now();
+        {
+            ModificationOp op;
+            fill_op(options, tmpl, dn, op);
+            note_result(run_update(info, *capture, *post,
+                                   options.function_name, op),
+                        result);
+        }
+        result.latencies_ns.push_back(elapsed_ns(start));
+    }
+}
+
+// Replays every threads'th record, starting with the thread'th.
+void replay_thread(const Options &options, InstanceInfo *info,
+                   CaptureWriter *capture, PostQueue *post, Stats *stats,
+                   const vector<CapturedUpdate> *records, unsigned thread,
+                   std::chrono::steady_clock::time_point run_start,
+                   ThreadResult &result) {
+    Stats::Scope scope{stats};
+    uint64_t first_ns = records->empty() ? 0 : (*records)[0].start_ns;
+    string function_name;
+    string encoded;
+    for (size_t i = thread; i < records->size(); i += options.threads) {
+        const CapturedUpdate &record = (*records)[i];
+        if (options.paced && record.start_ns > first_ns) {
+            std::this_thread::sleep_until(
+                run_start + std::chrono::nanoseconds(record.start_ns -
+                                                     first_ns));
+        }
+        auto start = std::chrono::steady_clock::now();
+        {
+            ModificationOp op;
+            FlatEntryView entry{op.arena};
+            if (!decode_request(record.request, record.request_size, true,
+                                function_name, op, entry)) {
+                if (result.errors++ == 0) {
+                    fprintf(stderr, "Invalid request in record %zu\n", i);
+                }
+                continue;
+            }
+            UpdateResult update_result =
+                run_update(info, *capture, *post, function_name, op);
+            note_result(update_result, result);
+
+            // Outcomes are compared in their encoded form.
+            encoded.resize(record.result_size);
+            size_t size = encode_result(update_result, op, &encoded[0],
+                                        encoded.size());
+            if (size != record.result_size ||
+                encoded.compare(0, size, record.result, size) != 0) {
+                result.mismatches++;
+            }
+        }
+        result.latencies_ns.push_back(elapsed_ns(start));
+    }
+}
+
+uint64_t quantile(const vector<uint64_t> &sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+void report_stats(const Stats &stats) {
+    Stats::PhaseSummary phases[Stats::kNumPhases];
+    uint64_t counts[Stats::kNumCounts];
+    stats.read(phases, counts);
+    printf("%-17s %10s %10s %10s %10s\n", "phase", "count", "avg_ns",
+           "p50_ns<=", "p99_ns<=");
+    for (size_t p = 0; p < Stats::kNumPhases; p++) {
+        const Stats::PhaseSummary &summary = phases[p];
+        if (summary.count == 0) {
+            continue;
+        }
+        printf("%-17s %10llu %10llu %10llu %10llu\n",
+               Stats::phase_name(static_cast<Stats::Phase>(p)),
+               static_cast<unsigned long long>(summary.count),
+               static_cast<unsigned long long>(summary.sum_ns /
+                                               summary.count),
+               static_cast<unsigned long long>(summary.quantile_ns(0.5)),
+               static_cast<unsigned long long>(summary.quantile_ns(0.99)));
+    }
+    for (size_t c = 0; c < Stats::kNumCounts; c++) {
+        printf("%s %llu\n", Stats::count_name(static_cast<Stats::Count>(c)),
+               static_cast<unsigned long long>(counts[c]));
+    }
+}
+
+void print_latencies(const char *label, vector<uint64_t> &latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    printf("%s p50 %.1f p99 %.1f p999 %.1f max %.1f\n", label,
+           quantile(latencies, 0.5) / 1e3, quantile(latencies, 0.99) / 1e3,
+           quantile(latencies, 0.999) / 1e3, quantile(latencies, 1) / 1e3);
+}
+
+// Creates an InstanceInfo as open_hook would, without opening it.
+unique_ptr<InstanceInfo> create_info(const Options &options,
+                                     const std::set<string> &function_names,
+                                     InstanceInfo **post_info) {
+    unique_ptr<InstanceInfo> info{InstanceInfo::create()};
+    info->set_filename(options.filename);
+    if (!options.function_name.empty()) {
+        info->set_function_name(options.function_name);
+    }
+    for (const string &function_name : function_names) {
+        info->add_function_name(function_name);
+    }
+    if (!options.post.function_name.empty()) {
+        info->add_function_name(options.post.function_name);
+    }
+    for (const string &filename : options.pipeline) {
+        info->add_file(filename, "update");
+    }
+    info->set_zero_copy(options.zero_copy);
+    info->set_interpreters(options.interpreters);
+    info->set_entry_cache_size(options.entry_cache);
+    info->set_value_set_threshold(options.value_set_threshold);
+    info->set_bytecode_cache(options.bytecode_cache);
+    info->set_share_module(options.share_module);
+    info->set_timeout(options.timeout_ms);
+    info->set_profile(options.profile_path, 100);
+    if (options.batch.max_size > 1) {
+        info.reset(create_batcher(std::move(info), options.batch));
+    }
+    if (options.worker_pool.workers > 0) {
+        info.reset(create_worker_pool(std::move(info), options.worker_pool));
+    }
+    // As in open_hook, post-commit functions are never memoized.
+    *post_info = info.get();
+    if (options.pure) {
+        MemoConfig memo;
+        memo.inputs = MemoConfig::kDn | MemoConfig::kMods;
+        info.reset(create_memo_cache(std::move(info), memo));
+    }
+    return info;
+}
+
+int run(const Options &options) {
+    CaptureReader reader;
+    vector<CapturedUpdate> records;
+    std::set<string> function_names;
+    if (!options.replay_path.empty()) {
+        string error;
+        if (!reader.open(options.replay_path, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        CapturedUpdate record;
+        while (reader.next(record)) {
+            records.push_back(record);
+            // The function name is the first field of a request.
+            uint32_t size;
+            if (record.request_size >= sizeof(size)) {
+                memcpy(&size, record.request, sizeof(size));
+                if (size > 0 && size <= record.request_size - sizeof(size)) {
+                    function_names.emplace(record.request + sizeof(size),
+                                           size);
+                }
+            }
+        }
+        if (reader.truncated()) {
+            fprintf(stderr, "%s ends with a truncated record\n",
+                    options.replay_path.c_str());
+        }
+    }
+
+    // The other databases only exist to be opened.
+    auto open_start = std::chrono::steady_clock::now();
+    vector<unique_ptr<InstanceInfo>> other_databases;
+    InstanceInfo *post_info;
+    for (unsigned i = 1; i < options.databases; i++) {
+        other_databases.push_back(
+            create_info(options, function_names, &post_info));
+        other_databases.back()->open();
+    }
+    unique_ptr<InstanceInfo> info =
+        create_info(options, function_names, &post_info);
+    info->open();
+    double open_seconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - open_start)
+                              .count();
+
+    CaptureWriter capture;
+    if (!options.capture_path.empty()) {
+        string error;
+        if (!capture.open(options.capture_path, size_t{1} << 30, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+    }
+
+    PostQueue post;
+    if (!options.post.function_name.empty()) {
+        post.open(post_info, options.post);
+    }
+
+    Stats stats;
+    vector<ThreadResult> results(options.threads);
+    vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < options.threads; t++) {
+        Stats *thread_stats = options.stats ? &stats : nullptr;
+        if (options.replay_path.empty()) {
+            threads.emplace_back(run_thread, std::cref(options), info.get(),
+                                 &capture, &post, thread_stats, t,
+                                 std::ref(results[t]));
+        } else {
+            threads.emplace_back(replay_thread, std::cref(options),
+                                 info.get(), &capture, &post, thread_stats,
+                                 &records, t, start, std::ref(results[t]));
+        }
+    }
+
+    // Reloads until the ops are done, so that its effect on their latency
+    // shows.
+    std::mutex reload_mutex;
+    std::condition_variable reload_cond;
+    bool done = false;
+    std::thread reloader;
+    if (options.reload_ms > 0) {
+        reloader = std::thread{[&] {
+            auto interval = std::chrono::milliseconds(options.reload_ms);
+            std::unique_lock<std::mutex> lock{reload_mutex};
+            auto is_done = [&] { return done; };
+            while (!reload_cond.wait_for(lock, interval, is_done)) {
+                string error;
+                if (!info->reload(error)) {
+                    fprintf(stderr, "%s\n", error.c_str());
+                }
+            }
+        }};
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    if (reloader.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock{reload_mutex};
+            done = true;
+        }
+        reload_cond.notify_one();
+        reloader.join();
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+
+    capture.close();
+    // Post-commit functions which are still queued don't count towards the
+    // ops' latency, but do towards how long it takes to drain the queue.
+    post.close();
+    double drain_seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count() -
+                           seconds;
+
+    vector<uint64_t> latencies;
+    unsigned errors = 0;
+    unsigned mismatches = 0;
+    for (ThreadResult &result : results) {
+        latencies.insert(latencies.end(), result.latencies_ns.begin(),
+                         result.latencies_ns.end());
+        errors += result.errors;
+        mismatches += result.mismatches;
+    }
+
+    printf("ops %zu errors %u seconds %.3f ops/s %.0f\n", latencies.size(),
+           errors, seconds, latencies.size() / seconds);
+    print_latencies("latency_us", latencies);
+    printf("open_seconds %.3f\n", open_seconds);
+    if (!options.replay_path.empty()) {
+        vector<uint64_t> captured;
+        for (const CapturedUpdate &record : records) {
+            captured.push_back(record.duration_ns);
+        }
+        print_latencies("captured_latency_us", captured);
+        printf("mismatches %u\n", mismatches);
+    }
+    vector<NamedCounter> counters;
+    info->get_counters(counters);
+    if (!options.capture_path.empty()) {
+        capture.get_counters(counters);
+    }
+    if (!options.post.function_name.empty()) {
+        printf("post_drain_seconds %.3f\n", drain_seconds);
+        post.get_counters(counters);
+    }
+    for (const NamedCounter &counter : counters) {
+        printf("%s %llu\n", counter.name.c_str(),
+               static_cast<unsigned long long>(counter.value));
+    }
+    if (options.stats) {
+        report_stats(stats);
+    }
+    return 0;
+}
+
+}  // anonymous namespace
+}  // namespace slapo_py_update_hook
+
+int main(int argc, char **argv) {
+    slapo_py_update_hook::Options options;
+    if (!slapo_py_update_hook::parse_options(argc, argv, options)) {
+        fprintf(stderr, slapo_py_update_hook::usage, argv[0]);
+        return 2;
+    }
+    try {
+        slapo_py_update_hook::init_python();
+        return slapo_py_update_hook::run(options);
+    } catch (slapo_py_update_hook::PyError &exc) {
+        fprintf(stderr, "%s\n", exc.what());
+        return 1;
+    }
+}
@@ -0,0 +1,265 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "capture.h"
+#include "mod_op_codec.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// The size, start time, duration and request size of a record.
+const size_t kRecordHeaderSize = 4 + 8 + 8 + 4;
+
+template <typename T>
+void put(string &buf, size_t pos, T value) {
+    memcpy(&buf[pos], &value, sizeof(value));
+}
+
+template <typename T>
+T get(const char *data) {
+    T value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Appends what encode writes to buf, growing it until it fits.
+template <typename Encode>
+void append_encoded(string &buf, Encode encode) {
+    size_t pos = buf.size();
+    size_t room = 4096;
+    for (;;) {
+        buf.resize(pos + room);
+        size_t size = encode(&buf[pos], room);
+        if (size > 0) {
+            buf.resize(pos + size);
+            return;
+        }
+        room *= 2;
+    }
+}
+
+}  // anonymous namespace
+
+const char kCaptureMagic[8] = {'P', 'Y', 'H', 'K', 'C', 'A', 'P', '1'};
+
+bool CaptureWriter::open(const string &path, size_t max_queued_bytes,
+                         string &error) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                    0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        error = "Unable to open " + path + ": " + strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    fd_ = fd;
+    if (st.st_size == 0 && !write_all(kCaptureMagic, sizeof(kCaptureMagic))) {
+        error = "Unable to write " + path + ": " + strerror(errno);
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    max_queued_bytes_ = max_queued_bytes;
+    closing_ = false;
+    thread_ = std::thread{&CaptureWriter::write_loop, this};
+    return true;
+}
+
+void CaptureWriter::close() {
+    if (fd_ < 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        closing_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    ::close(fd_);
+    fd_ = -1;
+}
+
+bool CaptureWriter::begin(const string &function_name,
+                          const ModificationOp &op, Record &record) const {
+    if (fd_ < 0) {
+        return false;
+    }
+    record.buf.assign(kRecordHeaderSize, '\0');
+    append_encoded(record.buf, [&](char *buf, size_t size) {
+        return encode_request(function_name, op, true, buf, size);
+    });
+    record.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    record.start = std::chrono::steady_clock::now();
+    return true;
+}
+
+void CaptureWriter::finish(Record &record, const UpdateResult &result,
+                           const ModificationOp &op) {
+    uint64_t duration_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - record.start)
+            .count();
+    size_t request_size = record.buf.size() - kRecordHeaderSize;
+    append_encoded(record.buf, [&](char *buf, size_t size) {
+        return encode_result(result, op, buf, size);
+    });
+    put<uint32_t>(record.buf, 0, record.buf.size() - 4);
+    put<uint64_t>(record.buf, 4, record.start_ns);
+    put<uint64_t>(record.buf, 12, duration_ns);
+    put<uint32_t>(record.buf, 20, request_size);
+
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (queued_bytes_ + record.buf.size() > max_queued_bytes_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        queued_bytes_ += record.buf.size();
+        queue_.push_back(std::move(record.buf));
+    }
+    cond_.notify_one();
+}
+
+void CaptureWriter::get_counters(vector<NamedCounter> &counters) const {
+    auto relaxed = std::memory_order_relaxed;
+    counters.push_back(NamedCounter{"capture_records", records_.load(relaxed)});
+    counters.push_back(NamedCounter{"capture_dropped", dropped_.load(relaxed)});
+    counters.push_back(
+        NamedCounter{"capture_write_errors", write_errors_.load(relaxed)});
+}
+
+void CaptureWriter::write_loop() {
+    vector<string> batch;
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;) {
+        cond_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            return;  // closing, and everything has been written
+        }
+        batch.swap(queue_);
+        queued_bytes_ = 0;
+        lock.unlock();
+
+        // Records are joined up to reduce the number of writes.
+        string out;
+        for (string &record : batch) {
+            out += record;
+            if (out.size() >= (1 << 20)) {
+                if (!write_all(out.data(), out.size())) {
+                    write_errors_.fetch_add(1, std::memory_order_relaxed);
+                }
+                out.clear();
+            }
+        }
+        if (!out.empty() && !write_all(out.data(), out.size())) {
+            write_errors_.fetch_add(1, std::memory_order_relaxed);
+        }
+        records_.fetch_add(batch.size(), std::memory_order_relaxed);
+        batch.clear();
+
+        lock.lock();
+    }
+}
+
+bool CaptureWriter::write_all(const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd_, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+CaptureReader::~CaptureReader() {
+    if (data_) {
+        munmap(const_cast<char *>(data_), size_);
+    }
+}
+
+bool CaptureReader::open(const string &path, string &error) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        error = "Unable to open " + path + ": " + strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(kCaptureMagic)) {
+        ::close(fd);
+        error = path + " is not a capture log";
+        return false;
+    }
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        error = "Unable to map " + path + ": " + strerror(errno);
+        return false;
+    }
+    data_ = static_cast<const char *>(data);
+    size_ = size;
+    if (memcmp(data_, kCaptureMagic, sizeof(kCaptureMagic)) != 0) {
+        error = path + " is not a capture log";
+        return false;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    pos_ = sizeof(kCaptureMagic);
+    return true;
+}
+
+bool CaptureReader::next(CapturedUpdate &update) {
+    size_t left = size_ - pos_;
+    if (left == 0) {
+        return false;
+    }
+    const char *record = data_ + pos_;
+    uint32_t size = left >= 4 ? get<uint32_t>(record) : 0;
+    if (left < kRecordHeaderSize || size > left - 4 ||
+        size < kRecordHeaderSize - 4) {
+        truncated_ = true;
+        return false;
+    }
+    uint32_t request_size = get<uint32_t>(record + 20);
+    if (request_size > size + 4 - kRecordHeaderSize) {
+        truncated_ = true;
+        return false;
+    }
+    update.start_ns = get<uint64_t>(record + 4);
+    update.duration_ns = get<uint64_t>(record + 12);
+    update.request = record + kRecordHeaderSize;
+    update.request_size = request_size;
+    update.result = update.request + request_size;
+    update.result_size = size + 4 - kRecordHeaderSize - request_size;
+    pos_ += 4 + size;
+    return true;
+}
+
+}  // namespace slapo_py_update_hook
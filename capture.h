@@ -0,0 +1,117 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+// A capture log holds the updates handed to a hook, and their outcomes, so
+// that they can be replayed offline. It starts with kCaptureMagic, followed
+// by records of:
+//   u32 size of the rest of the record
+//   u64 start time, in ns since the epoch
+//   u64 duration of the update in ns
+//   u32 request size, then the request (see encode_request)
+//   the result (see encode_result)
+// As with mod_op_codec, integers are in host byte order.
+extern const char kCaptureMagic[8];
+
+// One update of a capture log. It borrows from the log.
+struct CapturedUpdate {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    const char *request;
+    size_t request_size;
+    const char *result;
+    size_t result_size;
+};
+
+// Appends updates to a capture log. Records are encoded by the calling
+// thread and written by a background one; if it falls more than
+// max_queued_bytes behind, further records are dropped (and counted).
+class CaptureWriter {
+  public:
+    // The state of an update being captured, between begin and finish.
+    struct Record {
+        std::string buf;
+        uint64_t start_ns = 0;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    CaptureWriter() {}
+    CaptureWriter(const CaptureWriter &) = delete;
+    ~CaptureWriter() { close(); }
+    void operator=(const CaptureWriter &) = delete;
+
+    bool is_open() const { return fd_ >= 0; }
+    // Appends to path, creating it if need be. Returns false (and sets
+    // error) on failure.
+    bool open(const std::string &path, size_t max_queued_bytes,
+              std::string &error);
+    // Writes out whatever is queued.
+    void close();
+
+    // Records op before it is handed to the hook. Returns false, and does
+    // nothing, if the writer isn't open. An empty function_name means the
+    // default function.
+    bool begin(const std::string &function_name, const ModificationOp &op,
+               Record &record) const;
+    // Completes and queues the record, with op as the hook left it.
+    void finish(Record &record, const UpdateResult &result,
+                const ModificationOp &op);
+
+    void get_counters(std::vector<NamedCounter> &counters) const;
+
+  private:
+    void write_loop();
+    bool write_all(const char *data, size_t size);
+
+    int fd_ = -1;
+    size_t max_queued_bytes_ = 0;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::string> queue_;
+    size_t queued_bytes_ = 0;
+    bool closing_ = false;
+    std::atomic<uint64_t> records_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> write_errors_{0};
+};
+
+// Reads a capture log by mapping it into memory.
+class CaptureReader {
+  public:
+    CaptureReader() {}
+    CaptureReader(const CaptureReader &) = delete;
+    ~CaptureReader();
+    void operator=(const CaptureReader &) = delete;
+
+    // Returns false (and sets error) if path can't be mapped or isn't a
+    // capture log.
+    bool open(const std::string &path, std::string &error);
+    // Returns false at the end of the log. A truncated final record, as left
+    // by a writer which didn't close, is treated as the end.
+    bool next(CapturedUpdate &update);
+    bool truncated() const { return truncated_; }
+
+  private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    bool truncated_ = false;
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // CAPTURE_H_
@@ -1,11 +1,14 @@
 #include <Python.h>
 
 #include <cassert>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "slapo_py_update_hook.h"
 #include "cc_py_obj.h"
+#include "stats.h"
 
 using std::string;
 using std::vector;
@@ -13,7 +16,10 @@ using std::vector;
 namespace slapo_py_update_hook {
 namespace {
 
-CCPyObj traceback_mod;
+thread_local InterpreterState *current_state = nullptr;
+
+std::mutex registered_states_mutex;
+vector<std::pair<PyInterpreterState *, InterpreterState *>> registered_states;
 
 class Counter {
   public:
@@ -26,8 +32,32 @@ class Counter {
 
 }  // anonymous namespace
 
+InterpreterState *current_interpreter_state() {
+    if (current_state) {
+        return current_state;
+    }
+    PyInterpreterState *interp = PyInterpreterState_Get();
+    std::lock_guard<std::mutex> lock{registered_states_mutex};
+    for (const auto &entry : registered_states) {
+        if (entry.first == interp) {
+            return entry.second;
+        }
+    }
+    return nullptr;
+}
+
+void set_current_interpreter_state(InterpreterState *state) {
+    current_state = state;
+}
+
+void register_interpreter_state(InterpreterState *state) {
+    std::lock_guard<std::mutex> lock{registered_states_mutex};
+    registered_states.emplace_back(PyInterpreterState_Get(), state);
+}
+
 void init_cc_py_obj() {
-    traceback_mod = CCPyObj::checked_steal(PyImport_ImportModule("traceback"));
+    current_state->traceback_mod =
+        CCPyObj::checked_steal(PyImport_ImportModule("traceback"));
 }
 
 //
@@ -35,17 +65,18 @@ void init_cc_py_obj() {
 //
 
 CCPyObj::CCPyObj() : obj_{nullptr} {}
-CCPyObj::CCPyObj(long value) : obj_{PyInt_FromLong(value)} {}
-CCPyObj::CCPyObj(const char *str) : obj_{PyString_FromString(str)} {}
+CCPyObj::CCPyObj(long value) : obj_{PyLong_FromLong(value)} {}
+CCPyObj::CCPyObj(const char *str) : obj_{PyUnicode_FromString(str)} {}
 CCPyObj::CCPyObj(const string &str)
-    : obj_{PyString_FromStringAndSize(str.data(), str.size())} {}
+    : obj_{PyUnicode_FromStringAndSize(str.data(), str.size())} {}
 CCPyObj::CCPyObj(const CCPyObj &other) : obj_{other.obj_} { Py_XINCREF(obj_); }
 CCPyObj::~CCPyObj() { Py_XDECREF(obj_); }
 
 CCPyObj &CCPyObj::operator=(const CCPyObj &other) {
+    // Taken first, in case other is this.
+    Py_XINCREF(other.obj_);
     Py_XDECREF(obj_);
     obj_ = other.obj_;
-    Py_XINCREF(obj_);
     return *this;
 }
 
@@ -71,11 +102,15 @@ CCPyObj CCPyObj::checked_steal(PyObject *obj) {
     return result;
 }
 
-PyObject *CCPyObj::ref() { return obj_; }
 PyObject *CCPyObj::new_ref() {
     Py_XINCREF(obj_);
     return obj_;
 }
+PyObject *CCPyObj::release() {
+    PyObject *obj = obj_;
+    obj_ = nullptr;
+    return obj;
+}
 
 CCPyObj::operator long() const {
     long result;
@@ -83,8 +118,6 @@ CCPyObj::operator long() const {
         throw PyError{"Cannot cast nullptr to long"};
     } else if (PyLong_Check(obj_)) {
         result = PyLong_AsLong(obj_);
-    } else if (PyInt_Check(obj_)) {
-        result = PyInt_AsLong(obj_);
     } else {
         CCPyObj repr = checked_steal(PyObject_Repr(obj_));
         throw PyError{"Cannot cast " + static_cast<string>(repr) + " to long"};
@@ -96,15 +129,16 @@ CCPyObj::operator long() const {
 CCPyObj::operator string() const {
     if (!obj_) {
         throw PyError{"Cannot cast nullptr to string"};
-    } else if (!PyString_Check(obj_)) {
+    } else if (PyBytes_Check(obj_)) {
+        return string(PyBytes_AS_STRING(obj_), PyBytes_GET_SIZE(obj_));
+    } else if (!PyUnicode_Check(obj_)) {
         CCPyObj repr = checked_steal(PyObject_Repr(obj_));
         throw PyError{"Cannot cast " + static_cast<string>(repr) + " to string"};
     }
-    char *exc_str_data = nullptr;
-    Py_ssize_t exc_str_len = 0;
-    int result = PyString_AsStringAndSize(obj_, &exc_str_data, &exc_str_len);
-    maybe_throw(result < 0);
-    return string(exc_str_data, exc_str_len);
+    Py_ssize_t size = 0;
+    const char *data = PyUnicode_AsUTF8AndSize(obj_, &size);
+    maybe_throw(!data);
+    return string(data, size);
 }
 
 CCPyObj CCPyObj::attr(CCPyObj name) const {
@@ -128,18 +162,20 @@ CCPyObj CCPyObj::item(const string &key) const {
 
 // static
 void CCPyObj::maybe_throw(bool cond) {
-    static int maybe_throw_depth = 0;
+    static thread_local int maybe_throw_depth = 0;
     Counter counter{maybe_throw_depth};
 
     if (!cond) {
         return;
     }
+    Stats::Timer timer{Stats::kExceptionFormat};
 
     assert(PyErr_Occurred());
 
     // If we couldn't import the traceback module or we're already
     // formatting an exception, just print the exception to stderr.
-    if (!traceback_mod.ref() || maybe_throw_depth > 1) {
+    InterpreterState *state = current_interpreter_state();
+    if (!state || !state->traceback_mod.ref() || maybe_throw_depth > 1) {
         PyErr_Print();
         PyErr_Clear();
         throw PyError{"Unhandled exception"};
@@ -163,7 +199,8 @@ void CCPyObj::maybe_throw(bool cond) {
     CCPyObj result;
     try {
         CCPyObj lines =
-            traceback_mod.attr("format_exception")(exc_type, exc_obj, exc_tb);
+            state->traceback_mod.attr("format_exception")(exc_type, exc_obj,
+                                                          exc_tb);
         result = CCPyObj{""}.attr("join")(lines);
     } catch (PyError &exc) {
         // If we can't format the exception, print both exceptions.
@@ -178,12 +215,13 @@ void CCPyObj::maybe_throw(bool cond) {
     throw PyError{result};
 }
 
-CCPyObj CCPyObj::call(vector<CCPyObj> args) {
-    CCPyObj args2 = checked_steal(PyTuple_New(args.size()));
-    for (unsigned int i = 0; i < args.size(); i++) {
-        PyTuple_SET_ITEM(args2.obj_, i, args[i].new_ref());
-    }
-    return checked_steal(PyObject_Call(obj_, args2.obj_, nullptr));
+CCPyObj CCPyObj::operator()() const {
+    return checked_steal(PyObject_CallNoArgs(obj_));
+}
+
+CCPyObj CCPyObj::vectorcall(PyObject *const *args, size_t nargs) const {
+    return checked_steal(PyObject_Vectorcall(
+        obj_, args, nargs | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr));
 }
 
 }  // namespace slapo_py_update_hook
@@ -3,11 +3,13 @@
 
 #include <Python.h>
 
+#include <mutex>
 #include <string>
-#include <vector>
+#include <unordered_map>
 
 namespace slapo_py_update_hook {
 
+// Loads what CCPyObj needs into the current InterpreterState.
 void init_cc_py_obj();
 
 class CCPyObj {
@@ -17,16 +19,29 @@ class CCPyObj {
     CCPyObj(const char *);
     CCPyObj(const std::string &);
     CCPyObj(const CCPyObj &);
+    // Moves hand the reference over, without touching the refcount.
+    CCPyObj(CCPyObj &&other) noexcept : obj_{other.obj_} {
+        other.obj_ = nullptr;
+    }
     ~CCPyObj();
 
     CCPyObj &operator=(const CCPyObj &);
+    CCPyObj &operator=(CCPyObj &&other) noexcept {
+        PyObject *old = obj_;
+        obj_ = other.obj_;
+        other.obj_ = nullptr;
+        Py_XDECREF(old);
+        return *this;
+    }
     static CCPyObj checked_borrow(PyObject *);
     static CCPyObj unchecked_borrow(PyObject *);
     static CCPyObj checked_steal(PyObject *);
     static CCPyObj unchecked_steal(PyObject *);
 
-    PyObject *ref();
+    PyObject *ref() const { return obj_; }
     PyObject *new_ref();
+    // Returns the reference, leaving this empty.
+    PyObject *release();
 
     operator long() const;
     operator std::string() const;
@@ -36,25 +51,104 @@ class CCPyObj {
     CCPyObj item(int) const;
     CCPyObj item(const std::string &) const;
 
+    // Calls the object with args, each a CCPyObj or anything one can be
+    // made from. They are passed with the vectorcall protocol, from an array
+    // on the stack.
+    CCPyObj operator()() const;
     template <class... Args>
-    CCPyObj operator()(Args... args) {
-        return call({}, args...);
-    }
+    CCPyObj operator()(const Args &...args) const;
 
   private:
+    class CallArg;
+
     static void maybe_throw(bool cond);
 
-    CCPyObj call(std::vector<CCPyObj> args);
+    // args[-1] may be overwritten during the call.
+    CCPyObj vectorcall(PyObject *const *args, size_t nargs) const;
+
+    PyObject *obj_;
+};
 
-    template <class First, class... Args>
-    CCPyObj call(std::vector<CCPyObj> args, First more1, Args... more2) {
-        args.emplace_back(more1);
-        return call(args, more2...);
+// An argument of operator(): a CCPyObj is borrowed for the call, and
+// anything else is converted to one.
+class CCPyObj::CallArg {
+  public:
+    CallArg(const CCPyObj &obj) : obj_{obj.obj_} {}
+    template <class T>
+    CallArg(const T &value) : converted_{value}, obj_{converted_.obj_} {
+        maybe_throw(!obj_);
     }
 
+    PyObject *ref() const { return obj_; }
+
+  private:
+    CCPyObj converted_;
     PyObject *obj_;
 };
 
+template <class... Args>
+CCPyObj CCPyObj::operator()(const Args &...args) const {
+    const CallArg converted[] = {CallArg{args}...};
+    // Slot 0 is left for the callee to use; see
+    // PY_VECTORCALL_ARGUMENTS_OFFSET.
+    PyObject *argv[1 + sizeof...(Args)];
+    for (size_t i = 0; i < sizeof...(Args); i++) {
+        argv[i + 1] = converted[i].ref();
+    }
+    return vectorcall(argv + 1, sizeof...(Args));
+}
+
+// What each Python interpreter needs its own copy of: the types defined in
+// py_types.h and the modules used internally. The current state is that of
+// the interpreter the calling thread has entered.
+struct InterpreterState {
+    CCPyObj traceback_mod;
+    CCPyObj value_view_type;
+    CCPyObj entry_view_type;
+    CCPyObj value_set_type;
+    CCPyObj mod_type;
+    CCPyObj op_type;
+    CCPyObj timeout_type;  // HookTimeout; see Watchdog
+    // Interned attribute names by description, and descriptions (as ints)
+    // by name; see attr_name_new.
+    std::unordered_map<const void *, CCPyObj> attr_names;
+    CCPyObj attr_descs;
+    // Hook files compiled in this interpreter, by file name, so that each
+    // is compiled once however many databases use it; see load_module.
+    struct HookFile {
+        std::string source;
+        CCPyObj code;
+        CCPyObj module;  // only with py_share_module
+    };
+    std::unordered_map<std::string, HookFile> hook_files;
+};
+
+// Threads which enter an interpreter through InterpreterLock have its state
+// set for them. For any other thread holding a GIL (e.g. one started by a
+// hook), it is looked up in those registered, or is nullptr if there is
+// none.
+InterpreterState *current_interpreter_state();
+void set_current_interpreter_state(InterpreterState *state);
+// Registers state as that of the interpreter whose GIL is held.
+void register_interpreter_state(InterpreterState *state);
+
+// Locks C++ state which is otherwise guarded by the GIL, on builds without
+// one. Elsewhere it does nothing.
+class NoGilLock {
+  public:
+    explicit NoGilLock(std::mutex &mutex)
+#ifdef Py_GIL_DISABLED
+        : lock_{mutex}
+#endif
+    {
+    }
+
+  private:
+#ifdef Py_GIL_DISABLED
+    std::lock_guard<std::mutex> lock_;
+#endif
+};
+
 }  // namespace slapo_py_update_hook
 
 #endif  // CC_PY_OBJ_H_
@@ -0,0 +1,108 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file_watcher.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// How long to wait for a file to stop changing.
+const int kSettleMs = 200;
+
+}  // anonymous namespace
+
+bool FileWatcher::open(const vector<string> &paths,
+                       std::function<void()> on_change, string &error) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) {
+        error = string{"inotify_init1: "} + strerror(errno);
+        return false;
+    }
+    for (const string &path : paths) {
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+        string name = slash == string::npos ? path : path.substr(slash + 1);
+        int wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) {
+            error = "inotify_add_watch " + dir + ": " + strerror(errno);
+            close();
+            return false;
+        }
+        names_.emplace_back(wd, name);
+    }
+    if (pipe2(stop_fds_, O_CLOEXEC) < 0) {
+        error = string{"pipe2: "} + strerror(errno);
+        close();
+        return false;
+    }
+    on_change_ = std::move(on_change);
+    thread_ = std::thread{&FileWatcher::run, this};
+    return true;
+}
+
+void FileWatcher::close() {
+    if (thread_.joinable()) {
+        char byte = 0;
+        while (write(stop_fds_[1], &byte, 1) < 0 && errno == EINTR) {
+        }
+        thread_.join();
+    }
+    for (int *fd : {&inotify_fd_, &stop_fds_[0], &stop_fds_[1]}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    names_.clear();
+}
+
+void FileWatcher::run() {
+    bool changed = false;
+    for (;;) {
+        pollfd fds[2] = {{stop_fds_[0], POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+        // Once something has changed, wait until nothing more does for a
+        // while before reporting it.
+        int ready = poll(fds, 2, changed ? kSettleMs : -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        } else if (fds[0].revents) {
+            return;
+        } else if (ready == 0) {
+            changed = false;
+            on_change_();
+            continue;
+        }
+
+        alignas(inotify_event) char buf[4096];
+        ssize_t size;
+        while ((size = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + size;) {
+                auto event = reinterpret_cast<inotify_event *>(p);
+                for (const auto &wd_name : names_) {
+                    if (event->len && wd_name.first == event->wd &&
+                        wd_name.second == event->name) {
+                        changed = true;
+                    }
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,44 @@
+#ifndef FILE_WATCHER_H_
+#define FILE_WATCHER_H_
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace slapo_py_update_hook {
+
+// Calls a function from a background thread whenever any of a set of files
+// is rewritten or replaced. Their directories are watched with inotify,
+// rather than the files themselves, so that editors which write a new file
+// and rename it over the old one are noticed too. Changes which come in
+// quick succession are reported once, after they stop.
+class FileWatcher {
+  public:
+    FileWatcher() {}
+    FileWatcher(const FileWatcher &) = delete;
+    ~FileWatcher() { close(); }
+    void operator=(const FileWatcher &) = delete;
+
+    bool is_open() const { return thread_.joinable(); }
+    // Starts watching paths. Returns false (and sets error) on failure.
+    bool open(const std::vector<std::string> &paths,
+              std::function<void()> on_change, std::string &error);
+    // Stops watching, waiting for a call of on_change to finish.
+    void close();
+
+  private:
+    void run();
+
+    std::function<void()> on_change_;
+    // The watched directories' watch descriptors, and the names in them.
+    std::vector<std::pair<int, std::string>> names_;
+    int inotify_fd_ = -1;
+    int stop_fds_[2] = {-1, -1};  // a pipe, written to by close
+    std::thread thread_;
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // FILE_WATCHER_H_
@@ -0,0 +1,148 @@
+#include "portable.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "slap.h"
+
+#include "interest_filter.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+bool normalize_dn(const string &dn, BerValue *ndn) {
+    BerValue in;
+    in.bv_len = dn.size();
+    in.bv_val = const_cast<char *>(dn.c_str());
+    return dnNormalize(0, nullptr, nullptr, &in, ndn, nullptr) ==
+           LDAP_SUCCESS;
+}
+
+void free_dns(vector<BerValue> &dns) {
+    for (BerValue &dn : dns) {
+        ch_free(dn.bv_val);
+    }
+    dns.clear();
+}
+
+}  // anonymous namespace
+
+InterestFilter::~InterestFilter() {
+    free_dns(subtrees_);
+    for (Route &route : routes_) {
+        ch_free(route.ndn.bv_val);
+    }
+}
+
+bool InterestFilter::compile(string &error) {
+    attrs_.clear();
+    free_dns(subtrees_);
+    ocs_.clear();
+    for (Route &route : routes_) {
+        ch_free(route.ndn.bv_val);
+    }
+    routes_.clear();
+
+    for (const string &name : attr_names_) {
+        AttributeDescription *ad = nullptr;
+        const char *text;
+        if (slap_str2ad(name.c_str(), &ad, &text) != LDAP_SUCCESS) {
+            error = "py_attrs: unknown attribute " + name;
+            return false;
+        }
+        attrs_.push_back(ad);
+    }
+
+    for (const string &dn : subtree_dns_) {
+        BerValue ndn;
+        if (!normalize_dn(dn, &ndn)) {
+            error = "py_subtree: invalid DN " + dn;
+            return false;
+        }
+        subtrees_.push_back(ndn);
+    }
+
+    for (const string &name : oc_names_) {
+        ObjectClass *oc = oc_find(name.c_str());
+        if (!oc) {
+            error = "py_objectclass: unknown objectClass " + name;
+            return false;
+        }
+        ocs_.push_back(oc);
+    }
+
+    for (const auto &dn_function : route_dns_) {
+        Route route;
+        if (!normalize_dn(dn_function.first, &route.ndn)) {
+            error = "py_route: invalid DN " + dn_function.first;
+            return false;
+        }
+        route.function = dn_function.second;
+        routes_.push_back(route);
+    }
+    // A DN is within all of its ancestors, so try the longest bases first.
+    std::stable_sort(routes_.begin(), routes_.end(),
+                     [](const Route &a, const Route &b) {
+                         return a.ndn.bv_len > b.ndn.bv_len;
+                     });
+
+    return true;
+}
+
+bool InterestFilter::wants(const BerValue &ndn,
+                           const Modifications *mods) const {
+    if (!subtrees_.empty()) {
+        bool found = false;
+        for (const BerValue &base : subtrees_) {
+            if (dnIsSuffix(&ndn, &base)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+
+    if (attrs_.empty()) {
+        return true;
+    }
+    for (const Modifications *mod = mods; mod; mod = mod->sml_next) {
+        for (AttributeDescription *ad : attrs_) {
+            if (mod->sml_desc == ad || is_ad_subtype(mod->sml_desc, ad)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool InterestFilter::wants_entry(Entry *entry) const {
+    if (ocs_.empty()) {
+        return true;
+    }
+    if (!entry) {
+        return false;
+    }
+    for (ObjectClass *oc : ocs_) {
+        if (is_entry_objectclass(entry, oc, 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const string *InterestFilter::route(const BerValue &ndn) const {
+    for (const Route &route : routes_) {
+        if (dnIsSuffix(&ndn, &route.ndn)) {
+            return &route.function;
+        }
+    }
+    return nullptr;
+}
+
+}  // namespace slapo_py_update_hook
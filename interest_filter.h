@@ -0,0 +1,67 @@
+#ifndef INTEREST_FILTER_H_
+#define INTEREST_FILTER_H_
+
+#include "portable.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "slap.h"
+
+namespace slapo_py_update_hook {
+
+// Decides, before anything is converted or the GIL is taken, whether a
+// modify is of interest to the hook and which function should handle it.
+// Attribute names, DNs and objectClasses are collected while parsing the
+// config and resolved against the schema by compile().
+class InterestFilter {
+  public:
+    InterestFilter() {}
+    InterestFilter(const InterestFilter &) = delete;
+    ~InterestFilter();
+    void operator=(const InterestFilter &) = delete;
+
+    void add_attribute(const std::string &name) { attr_names_.push_back(name); }
+    void add_subtree(const std::string &dn) { subtree_dns_.push_back(dn); }
+    void add_objectclass(const std::string &name) { oc_names_.push_back(name); }
+    void add_route(const std::string &dn, const std::string &function) {
+        route_dns_.emplace_back(dn, function);
+    }
+    const std::vector<std::pair<std::string, std::string>> &routes() const {
+        return route_dns_;
+    }
+
+    // Returns false (and sets error) if a name or DN can't be resolved.
+    bool compile(std::string &error);
+
+    // Checks the target DN and modifications against py_subtree/py_attrs.
+    bool wants(const BerValue &ndn, const Modifications *mods) const;
+    // Whether wants_entry needs to look at the entry at all.
+    bool needs_entry() const { return !ocs_.empty(); }
+    // Checks the target entry against py_objectclass.
+    bool wants_entry(Entry *entry) const;
+    // Returns the function configured by py_route for ndn, or nullptr if the
+    // default function should be used.
+    const std::string *route(const BerValue &ndn) const;
+
+  private:
+    struct Route {
+        BerValue ndn;
+        std::string function;
+    };
+
+    std::vector<std::string> attr_names_;
+    std::vector<std::string> subtree_dns_;
+    std::vector<std::string> oc_names_;
+    std::vector<std::pair<std::string, std::string>> route_dns_;
+
+    std::vector<AttributeDescription *> attrs_;
+    std::vector<BerValue> subtrees_;
+    std::vector<ObjectClass *> ocs_;
+    std::vector<Route> routes_;  // most specific first
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // INTEREST_FILTER_H_
@@ -0,0 +1,340 @@
+#include <algorithm>  // max, min
+#include <atomic>
+#include <cstdint>
+#include <functional>  // hash
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "memo_cache.h"
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+const size_t kNumShards = 16;
+
+// A modification as the hook left it. Those passed through unchanged are
+// remembered by their origin alone.
+struct CachedMod {
+    size_t origin;
+    string name;
+    const void *desc;
+    vector<string> values;
+    int op;
+    int flags;
+};
+
+struct Decision {
+    int status;
+    string error;
+    vector<CachedMod> mods;  // only if status is LDAP_SUCCESS
+};
+
+void append_u32(string &key, uint32_t value) {
+    key.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void append_str(string &key, ValueRef value) {
+    append_u32(key, value.size);
+    key.append(value.data, value.size);
+}
+
+// One slice of the cache, with its own lock and LRU list. The lock is only
+// held to look up or insert a decision, never while the hook runs.
+class Shard {
+  public:
+    Shard() : capacity_{1} {}
+    Shard(const Shard &) = delete;
+    void operator=(const Shard &) = delete;
+
+    void set_capacity(size_t capacity) { capacity_ = capacity; }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock{mu_};
+        index_.clear();
+        lru_.clear();
+    }
+
+    shared_ptr<const Decision> find(size_t hash, const string &key) {
+        std::lock_guard<std::mutex> lock{mu_};
+        auto it = index_.find(hash);
+        if (it == index_.end() || it->second->key != key) {
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->decision;
+    }
+
+    void insert(size_t hash, string key, shared_ptr<const Decision> decision) {
+        std::lock_guard<std::mutex> lock{mu_};
+        auto it = index_.find(hash);
+        if (it != index_.end()) {
+            // Either the same key, raced in by another thread, or a hash
+            // collision; the newer decision wins either way.
+            it->second->key = std::move(key);
+            it->second->decision = std::move(decision);
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return;
+        }
+        if (index_.size() >= capacity_) {
+            index_.erase(lru_.back().hash);
+            lru_.pop_back();
+        }
+        lru_.push_front(Entry{hash, std::move(key), std::move(decision)});
+        index_.emplace(hash, lru_.begin());
+    }
+
+  private:
+    struct Entry {
+        size_t hash;
+        string key;
+        shared_ptr<const Decision> decision;
+    };
+
+    size_t capacity_;
+    std::mutex mu_;
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<size_t, std::list<Entry>::iterator> index_;
+};
+
+class MemoCache : public InstanceInfo {
+  public:
+    MemoCache(unique_ptr<InstanceInfo> inner, const MemoConfig &config)
+        : inner_{std::move(inner)}, config_(config), hits_{0}, misses_{0} {
+        // Split max_entries exactly, over fewer shards if it is small, with
+        // the remainder spread one each over the first shards.
+        size_t max_entries = std::max<size_t>(config_.max_entries, 1);
+        num_shards_ = std::min(max_entries, kNumShards);
+        for (size_t i = 0; i < num_shards_; i++) {
+            shards_[i].set_capacity(max_entries / num_shards_ +
+                                    (i < max_entries % num_shards_ ? 1 : 0));
+        }
+    }
+    MemoCache(const MemoCache &) = delete;
+    void operator=(const MemoCache &) = delete;
+
+    void set_filename(const string &name) override {
+        inner_->set_filename(name);
+    }
+    void set_function_name(const string &name) override {
+        inner_->set_function_name(name);
+    }
+    void add_function_name(const string &name) override {
+        inner_->add_function_name(name);
+    }
+    void add_file(const string &filename,
+                  const string &function_name) override {
+        inner_->add_file(filename, function_name);
+    }
+    void set_zero_copy(bool zero_copy) override {
+        inner_->set_zero_copy(zero_copy);
+    }
+    void set_interpreters(unsigned interpreters) override {
+        inner_->set_interpreters(interpreters);
+    }
+    void set_entry_cache_size(size_t size) override {
+        inner_->set_entry_cache_size(size);
+    }
+    void set_value_set_threshold(size_t threshold) override {
+        inner_->set_value_set_threshold(threshold);
+    }
+    void set_bytecode_cache(const string &dir) override {
+        inner_->set_bytecode_cache(dir);
+    }
+    void set_share_module(bool share) override {
+        inner_->set_share_module(share);
+    }
+    void set_timeout(unsigned long ms) override { inner_->set_timeout(ms); }
+    void set_timeout_status(int status) override {
+        inner_->set_timeout_status(status);
+    }
+    void set_profile(const string &path, unsigned hz) override {
+        inner_->set_profile(path, hz);
+    }
+    void open() override { inner_->open(); }
+    bool reload(string &error) override {
+        // Decisions made by the old version no longer stand.
+        if (!inner_->reload(error)) {
+            return false;
+        }
+        for (size_t i = 0; i < num_shards_; i++) {
+            shards_[i].clear();
+        }
+        return true;
+    }
+    int update(ModificationOp &op, string &error) override {
+        return memoize(nullptr, op, error);
+    }
+    int update(const string &function_name, ModificationOp &op,
+               string &error) override {
+        return memoize(&function_name, op, error);
+    }
+    void get_counters(vector<NamedCounter> &counters) const override {
+        counters.push_back(NamedCounter{"memo_hits", hits_.load()});
+        counters.push_back(NamedCounter{"memo_misses", misses_.load()});
+        inner_->get_counters(counters);
+    }
+
+  private:
+    int memoize(const string *function_name, ModificationOp &op,
+                string &error);
+    string make_key(const string *function_name,
+                    const ModificationOp &op) const;
+
+    unique_ptr<InstanceInfo> inner_;
+    const MemoConfig config_;
+    size_t num_shards_;  // how many of shards_ are used
+    Shard shards_[kNumShards];
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+string MemoCache::make_key(const string *function_name,
+                           const ModificationOp &op) const {
+    string key;
+    append_str(key, function_name ? ValueRef{function_name->data(),
+                                             function_name->size()}
+                                  : ValueRef{"", 0});
+    if (config_.inputs & MemoConfig::kDn) {
+        append_str(key, op.dn);
+    }
+    if (config_.inputs & MemoConfig::kAuthDn) {
+        append_str(key, op.auth_dn);
+    }
+    if (config_.inputs & MemoConfig::kMods) {
+        append_u32(key, op.mods.size());
+        for (const Modification &mod : op.mods) {
+            append_str(key, mod.name);
+            append_u32(key, mod.op);
+            append_u32(key, mod.flags);
+            append_u32(key, mod.values.size());
+            for (const Value &value : mod.values) {
+                append_str(key, value.ref());
+            }
+        }
+    }
+    if (config_.inputs & MemoConfig::kEntry) {
+        const EntryView *entry = op.entry;
+        size_t num_attrs = entry ? entry->size() : 0;
+        append_u32(key, num_attrs);
+        for (size_t i = 0; i < num_attrs; i++) {
+            append_str(key, entry->name(i));
+            size_t num_values = entry->num_values(i);
+            append_u32(key, num_values);
+            for (size_t j = 0; j < num_values; j++) {
+                append_str(key, entry->value(i, j));
+            }
+        }
+    }
+    return key;
+}
+
+shared_ptr<const Decision> record(int status, const string &error,
+                                  const ModificationOp &op) {
+    auto decision = std::make_shared<Decision>();
+    decision->status = status;
+    decision->error = error;
+    if (status != 0) {  // LDAP_SUCCESS
+        return decision;
+    }
+    decision->mods.reserve(op.mods.size());
+    for (const Modification &mod : op.mods) {
+        CachedMod cached{mod.origin, string{}, mod.desc, {}, mod.op,
+                         mod.flags};
+        if (mod.origin == Modification::kNew) {
+            cached.name = mod.name.str();
+            cached.values.reserve(mod.values.size());
+            for (const Value &value : mod.values) {
+                cached.values.push_back(value.str());
+            }
+        }
+        decision->mods.push_back(std::move(cached));
+    }
+    return decision;
+}
+
+// Applies decision's modifications to op. Returns false, leaving op alone,
+// if they refer to originals op doesn't have, which can only happen if the
+// modifications aren't part of the key.
+bool replay(const Decision &decision, ModificationOp &op) {
+    if (decision.status != 0) {  // LDAP_SUCCESS
+        return true;
+    }
+    ArenaVector<bool> used(op.mods.size(), false,
+                           ArenaAllocator<bool>{op.arena});
+    for (const CachedMod &cached : decision.mods) {
+        if (cached.origin == Modification::kNew) {
+            continue;
+        } else if (cached.origin >= used.size() || used[cached.origin]) {
+            return false;
+        }
+        used[cached.origin] = true;
+    }
+
+    ArenaVector<Modification> mods{ArenaAllocator<Modification>{op.arena}};
+    mods.reserve(decision.mods.size());
+    for (const CachedMod &cached : decision.mods) {
+        if (cached.origin != Modification::kNew) {
+            mods.push_back(std::move(op.mods[cached.origin]));
+            continue;
+        }
+        Modification mod{op.arena};
+        mod.name = copy_ref(ValueRef{cached.name.data(), cached.name.size()},
+                            op.arena);
+        mod.desc = cached.desc;
+        mod.values.reserve(cached.values.size());
+        for (const string &value : cached.values) {
+            mod.values.push_back(
+                Value{ValueRef{value.data(), value.size()}, op.arena});
+        }
+        mod.op = cached.op;
+        mod.flags = cached.flags;
+        mods.push_back(std::move(mod));
+    }
+    op.mods.swap(mods);
+    return true;
+}
+
+int MemoCache::memoize(const string *function_name, ModificationOp &op,
+                       string &error) {
+    string key = make_key(function_name, op);
+    size_t hash = std::hash<string>{}(key);
+    Shard &shard = shards_[hash % num_shards_];
+
+    shared_ptr<const Decision> decision = shard.find(hash, key);
+    if (decision && replay(*decision, op)) {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        if (decision->status != 0) {  // LDAP_SUCCESS
+            error = decision->error;
+        }
+        return decision->status;
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    // Exceptions propagate without being cached, and timeouts aren't.
+    int status = function_name ? inner_->update(*function_name, op, error)
+                               : inner_->update(op, error);
+    if (!op.timed_out) {
+        shard.insert(hash, std::move(key), record(status, error, op));
+    }
+    return status;
+}
+
+}  // anonymous namespace
+
+InstanceInfo *create_memo_cache(unique_ptr<InstanceInfo> inner,
+                                const MemoConfig &config) {
+    return new MemoCache{std::move(inner), config};
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,37 @@
+#ifndef MEMO_CACHE_H_
+#define MEMO_CACHE_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+struct MemoConfig {
+    // Which parts of a ModificationOp the hook's decision depends on; the
+    // function called is always part of the key.
+    enum Input {
+        kDn = 1 << 0,
+        kAuthDn = 1 << 1,
+        kMods = 1 << 2,
+        kEntry = 1 << 3,
+    };
+
+    // Caching is only enabled if this is non-zero.
+    unsigned inputs = 0;
+    // Largest number of decisions remembered across all shards.
+    size_t max_entries = 4096;
+};
+
+// Creates an InstanceInfo which remembers the decisions (status, error and
+// rewritten modifications) inner makes, keyed by the configured inputs, and
+// replays them for identical updates without calling inner. Only suitable
+// for hooks whose decisions depend on nothing else. Updates which raise are
+// never cached. Reports "memo_hits" and "memo_misses" counters.
+InstanceInfo *create_memo_cache(std::unique_ptr<InstanceInfo> inner,
+                                const MemoConfig &config);
+
+}  // namespace slapo_py_update_hook
+
+#endif  // MEMO_CACHE_H_
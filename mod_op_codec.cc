@@ -0,0 +1,322 @@
+#include <algorithm>  // max, min
+#include <cstdint>
+#include <cstring>  // memcpy
+#include <string>
+#include <utility>  // move
+
+#include "slapo_py_update_hook.h"
+#include "mod_op_codec.h"
+
+using std::string;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// The origin written for modifications that aren't one of the originals.
+const uint32_t kNewOrigin = 0xffffffff;
+
+class Writer {
+  public:
+    Writer(char *buf, size_t size)
+        : begin_{buf}, pos_{buf}, end_{buf + size}, ok_{true} {}
+
+    void u32(uint32_t value) { bytes(&value, sizeof(value)); }
+    void i32(int32_t value) { bytes(&value, sizeof(value)); }
+    void str(const char *data, size_t size) {
+        u32(size);
+        bytes(data, size);
+    }
+    void str(ValueRef value) { str(value.data, value.size); }
+    void str(const string &value) { str(value.data(), value.size()); }
+
+    // With diff set, modifications passed through unchanged are written as
+    // just their origin.
+    void mods(const ArenaVector<Modification> &mods, bool diff) {
+        u32(mods.size());
+        for (const Modification &mod : mods) {
+            if (diff) {
+                bool is_new = mod.origin == Modification::kNew;
+                u32(is_new ? kNewOrigin : mod.origin);
+                if (!is_new) {
+                    continue;
+                }
+            }
+            str(mod.name);
+            u32(mod.values.size());
+            for (const Value &value : mod.values) {
+                str(value.ref());
+            }
+            i32(mod.op);
+            i32(mod.flags);
+        }
+    }
+
+    // Returns the number of bytes written, or 0 on overflow.
+    size_t finish() const { return ok_ ? pos_ - begin_ : 0; }
+
+  private:
+    void bytes(const void *data, size_t size) {
+        if (!ok_ || static_cast<size_t>(end_ - pos_) < size) {
+            ok_ = false;
+            return;
+        }
+        if (size > 0) {
+            memcpy(pos_, data, size);
+        }
+        pos_ += size;
+    }
+
+    char *begin_;
+    char *pos_;
+    char *end_;
+    bool ok_;
+};
+
+class Reader {
+  public:
+    Reader(const char *buf, size_t size)
+        : pos_{buf}, end_{buf + size}, ok_{true} {}
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+    int32_t i32() {
+        int32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+    // Reads an element count, each element taking at least four bytes.
+    uint32_t count() {
+        uint32_t value = u32();
+        if (value > static_cast<size_t>(end_ - pos_) / sizeof(uint32_t)) {
+            ok_ = false;
+            return 0;
+        }
+        return value;
+    }
+    ValueRef ref() {
+        uint32_t size = u32();
+        if (!ok_ || static_cast<size_t>(end_ - pos_) < size) {
+            ok_ = false;
+            return ValueRef{nullptr, 0};
+        }
+        ValueRef value{pos_, size};
+        pos_ += size;
+        return value;
+    }
+    string str() {
+        ValueRef value = ref();
+        return string(value.data, value.size);
+    }
+
+    // Reads what Writer::mods wrote into mods, which allocate from
+    // op.arena. With originals set, the modifications were written as a
+    // diff: unchanged ones are moved over from originals and the rest are
+    // copied into op.arena. Otherwise they are the originals themselves, and
+    // borrow from the buffer.
+    void mods(ModificationOp &op, ArenaVector<Modification> &mods,
+              ArenaVector<Modification> *originals) {
+        uint32_t num_mods = count();
+        mods.reserve(num_mods);
+        ArenaVector<bool> used(originals ? originals->size() : 0, false,
+                               ArenaAllocator<bool>{op.arena});
+        for (uint32_t i = 0; ok_ && i < num_mods; i++) {
+            if (originals) {
+                uint32_t origin = u32();
+                if (origin != kNewOrigin) {
+                    if (origin >= used.size() || used[origin]) {
+                        ok_ = false;
+                        return;
+                    }
+                    used[origin] = true;
+                    mods.push_back(std::move((*originals)[origin]));
+                    continue;
+                }
+            }
+
+            Modification mod{op.arena};
+            mod.name = ref();
+            uint32_t num_values = count();
+            mod.values.reserve(num_values);
+            for (uint32_t j = 0; ok_ && j < num_values; j++) {
+                mod.values.push_back(Value::borrow(ref()));
+            }
+            mod.op = i32();
+            mod.flags = i32();
+            if (originals) {
+                mod.name = copy_ref(mod.name, op.arena);
+                for (Value &value : mod.values) {
+                    value.own(op.arena);
+                }
+                mod.origin = Modification::kNew;
+            } else {
+                mod.origin = i;
+            }
+            mods.push_back(std::move(mod));
+        }
+    }
+
+    bool good() const { return ok_; }
+    // Whether the whole buffer was read without error.
+    bool done() const { return ok_ && pos_ == end_; }
+
+  private:
+    void bytes(void *data, size_t size) {
+        if (!ok_ || static_cast<size_t>(end_ - pos_) < size) {
+            ok_ = false;
+            return;
+        }
+        memcpy(data, pos_, size);
+        pos_ += size;
+    }
+
+    const char *pos_;
+    const char *end_;
+    bool ok_;
+};
+
+// Copies what of piece, which is at pos within a larger encoding, falls
+// within the part of it at [offset, end) to buf, which holds that part, and
+// moves pos past it.
+void copy_piece(const void *piece, size_t piece_size, size_t &pos,
+                size_t offset, size_t end, char *buf) {
+    size_t from = std::max(pos, offset);
+    size_t to = std::min(pos + piece_size, end);
+    if (from < to) {
+        memcpy(buf + (from - offset),
+               static_cast<const char *>(piece) + (from - pos), to - from);
+    }
+    pos += piece_size;
+}
+
+}  // anonymous namespace
+
+size_t encode_request(const string &function_name, const ModificationOp &op,
+                      bool entry_values, char *buf, size_t size) {
+    Writer writer{buf, size};
+    writer.str(function_name);
+    writer.str(op.dn);
+    writer.str(op.auth_dn);
+
+    const EntryView *entry = op.entry;
+    size_t num_attrs = entry ? entry->size() : 0;
+    writer.u32(num_attrs);
+    for (size_t i = 0; i < num_attrs; i++) {
+        writer.str(entry->name(i));
+        size_t num_values = entry->num_values(i);
+        writer.u32(num_values);
+        for (size_t j = 0; entry_values && j < num_values; j++) {
+            writer.str(entry->value(i, j));
+        }
+    }
+
+    writer.mods(op.mods, false);
+    return writer.finish();
+}
+
+bool decode_request(const char *buf, size_t size, bool entry_values,
+                    string &function_name, ModificationOp &op,
+                    FlatEntryView &entry) {
+    Reader reader{buf, size};
+    function_name = reader.str();
+    op.dn = reader.ref();
+    op.auth_dn = reader.ref();
+
+    uint32_t num_attrs = reader.count();
+    entry.attrs.clear();
+    entry.attrs.reserve(num_attrs);
+    entry.values.clear();
+    for (uint32_t i = 0; reader.good() && i < num_attrs; i++) {
+        FlatEntryView::Attribute attr;
+        attr.name = reader.ref();
+        if (i > 0 && !name_less(entry.attrs.back().name, attr.name)) {
+            return false;  // find relies on the order
+        }
+        attr.first_value = entry.values.size();
+        if (entry_values) {
+            attr.num_values = reader.count();
+            for (uint32_t j = 0; reader.good() && j < attr.num_values; j++) {
+                entry.values.push_back(reader.ref());
+            }
+        } else {
+            attr.num_values = reader.u32();
+        }
+        entry.attrs.push_back(attr);
+    }
+    op.entry = &entry;
+
+    op.mods.clear();
+    reader.mods(op, op.mods, nullptr);
+    return reader.done();
+}
+
+size_t values_size(const EntryView &entry, size_t attr) {
+    size_t num_values = entry.num_values(attr);
+    size_t size = num_values * sizeof(uint32_t);
+    for (size_t i = 0; i < num_values; i++) {
+        size += entry.value(attr, i).size;
+    }
+    return size;
+}
+
+void encode_values(const EntryView &entry, size_t attr, size_t offset,
+                   char *buf, size_t size) {
+    size_t end = offset + size;
+    size_t pos = 0;
+    size_t num_values = entry.num_values(attr);
+    for (size_t i = 0; i < num_values && pos < end; i++) {
+        ValueRef value = entry.value(attr, i);
+        uint32_t value_size = value.size;
+        copy_piece(&value_size, sizeof(value_size), pos, offset, end, buf);
+        copy_piece(value.data, value.size, pos, offset, end, buf);
+    }
+}
+
+bool decode_values(const char *buf, size_t size, size_t attr,
+                   FlatEntryView &entry) {
+    Reader reader{buf, size};
+    FlatEntryView::Attribute &attribute = entry.attrs[attr];
+    attribute.first_value = entry.values.size();
+    for (size_t i = 0; reader.good() && i < attribute.num_values; i++) {
+        entry.values.push_back(reader.ref());
+    }
+    if (!reader.done()) {
+        // Don't leave attr claiming values it doesn't have.
+        attribute.num_values = 0;
+        return false;
+    }
+    return true;
+}
+
+size_t encode_result(const UpdateResult &result, const ModificationOp &op,
+                     char *buf, size_t size) {
+    Writer writer{buf, size};
+    writer.i32(result.status);
+    writer.u32(result.exception);
+    writer.str(result.error);
+    if (result.status == 0) {  // LDAP_SUCCESS
+        writer.mods(op.mods, true);
+    }
+    return writer.finish();
+}
+
+bool decode_result(const char *buf, size_t size, UpdateResult &result,
+                   ModificationOp &op) {
+    Reader reader{buf, size};
+    result.status = reader.i32();
+    result.exception = reader.u32() != 0;
+    result.error = reader.str();
+    if (result.status == 0) {  // LDAP_SUCCESS
+        ArenaVector<Modification> mods{ArenaAllocator<Modification>{op.arena}};
+        reader.mods(op, mods, &op.mods);
+        if (!reader.done()) {
+            return false;
+        }
+        op.mods.swap(mods);
+    }
+    return reader.done();
+}
+
+}  // namespace slapo_py_update_hook
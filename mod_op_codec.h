@@ -0,0 +1,58 @@
+#ifndef MOD_OP_CODEC_H_
+#define MOD_OP_CODEC_H_
+
+#include <cstddef>
+#include <string>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+// A compact binary encoding of update requests and their results, used to
+// hand ModificationOps to other processes. Integers are in host byte order,
+// so encoded buffers are only meant to be read on the machine that wrote
+// them.
+
+// Each encode function returns the number of bytes written to buf, or 0 if
+// buf is too small.
+
+// An empty function_name means the default function. Without entry_values,
+// only the entry's attribute names and how many values each has are
+// written, so that the values can be fetched as they are needed (see
+// encode_values).
+size_t encode_request(const std::string &function_name,
+                      const ModificationOp &op, bool entry_values, char *buf,
+                      size_t size);
+// op.entry is set to entry; it and op borrow everything from buf. Each
+// modification's origin is set to its index. entry_values must be as it was
+// for encode_request; without it, the entry's values are left for
+// decode_values to add.
+bool decode_request(const char *buf, size_t size, bool entry_values,
+                    std::string &function_name, ModificationOp &op,
+                    FlatEntryView &entry);
+
+// The values of one of the entry's attributes are encoded as each one's
+// size followed by its bytes, values_size bytes in all. encode_values
+// writes the size bytes of that starting at offset to buf, so that they can
+// be handed over in pieces.
+size_t values_size(const EntryView &entry, size_t attr);
+void encode_values(const EntryView &entry, size_t attr, size_t offset,
+                   char *buf, size_t size);
+// Sets entry's values for attr from the whole of their encoding, which they
+// borrow. Returns false if buf doesn't hold as many as entry says attr has.
+bool decode_values(const char *buf, size_t size, size_t attr,
+                   FlatEntryView &entry);
+
+// The modifications are only encoded if result.status is LDAP_SUCCESS, and
+// those passed through unchanged only as their origin.
+size_t encode_result(const UpdateResult &result, const ModificationOp &op,
+                     char *buf, size_t size);
+// op.mods should hold the modifications the request was made with; they are
+// replaced with the result's, moving over those passed through unchanged and
+// copying the rest into op.arena.
+bool decode_result(const char *buf, size_t size, UpdateResult &result,
+                   ModificationOp &op);
+
+}  // namespace slapo_py_update_hook
+
+#endif  // MOD_OP_CODEC_H_
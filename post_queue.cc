@@ -0,0 +1,169 @@
+#include <algorithm>  // max, min
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "mod_op_codec.h"
+#include "post_queue.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Returns false if op's encoding would be larger than max_size.
+bool encode(const ModificationOp &op, size_t max_size, string &buf) {
+    size_t room = std::min<size_t>(4096, max_size);
+    for (;;) {
+        buf.resize(room);
+        size_t size = encode_request(string{}, op, true, &buf[0], room);
+        if (size > 0) {
+            buf.resize(size);
+            return true;
+        } else if (room == max_size) {
+            return false;
+        }
+        room = std::min(room * 2, max_size);
+    }
+}
+
+}  // anonymous namespace
+
+void PostQueue::open(InstanceInfo *info, const PostConfig &config) {
+    info_ = info;
+    config_ = config;
+    closing_ = false;
+    for (unsigned i = 0; i < std::max(config.threads, 1u); i++) {
+        threads_.emplace_back(&PostQueue::run, this);
+    }
+}
+
+void PostQueue::close() {
+    if (threads_.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        closing_ = true;
+    }
+    not_empty_.notify_all();
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+}
+
+void PostQueue::push(const ModificationOp &op) {
+    string dn = op.dn.str();
+    string request;
+    if (!encode(op, config_.max_queued_bytes, request)) {
+        log_error("Modification of " + dn +
+                  " is too large for py_post_queue_bytes, dropping it");
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;) {
+        Item *queued = nullptr;
+        if (config_.coalesce) {
+            auto it = queued_dns_.find(dn);
+            if (it != queued_dns_.end()) {
+                // The seqs of the queue are consecutive.
+                queued = &queue_[it->second - queue_.front().seq];
+            }
+        }
+        size_t bytes = queued_bytes_ + request.size() -
+                       (queued ? queued->request.size() : 0);
+        bool room = bytes <= config_.max_queued_bytes &&
+                    (queued || queue_.size() < config_.max_queued);
+        if (room && queued) {
+            queued->request = std::move(request);
+            queued_bytes_ = bytes;
+            coalesced_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else if (room) {
+            break;
+        } else if (config_.overflow == PostConfig::kDropNew) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else if (config_.overflow == PostConfig::kDropOld) {
+            // Room for a large update may take more than one.
+            pop_locked();
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // Something for the same DN may be queued while this waits.
+        not_full_.wait(lock);
+    }
+    if (config_.coalesce) {
+        queued_dns_[dn] = next_seq_;
+    }
+    queued_bytes_ += request.size();
+    queue_.push_back(Item{next_seq_++, std::move(dn), std::move(request)});
+    queued_.fetch_add(1, std::memory_order_relaxed);
+    lock.unlock();
+    not_empty_.notify_one();
+}
+
+PostQueue::Item PostQueue::pop_locked() {
+    Item item = std::move(queue_.front());
+    queue_.pop_front();
+    queued_bytes_ -= item.request.size();
+    if (config_.coalesce) {
+        auto it = queued_dns_.find(item.dn);
+        if (it != queued_dns_.end() && it->second == item.seq) {
+            queued_dns_.erase(it);
+        }
+    }
+    return item;
+}
+
+void PostQueue::get_counters(vector<NamedCounter> &counters) const {
+    auto relaxed = std::memory_order_relaxed;
+    counters.push_back(NamedCounter{"post_queued", queued_.load(relaxed)});
+    counters.push_back(
+        NamedCounter{"post_coalesced", coalesced_.load(relaxed)});
+    counters.push_back(NamedCounter{"post_dropped", dropped_.load(relaxed)});
+    counters.push_back(NamedCounter{"post_calls", calls_.load(relaxed)});
+    counters.push_back(
+        NamedCounter{"post_exceptions", exceptions_.load(relaxed)});
+}
+
+void PostQueue::run() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    for (;;) {
+        not_empty_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            return;  // closing, and everything has been handed over
+        }
+        Item item = pop_locked();
+        lock.unlock();
+        // The room may be enough for some waiting updates but not others.
+        not_full_.notify_all();
+
+        {
+            ModificationOp op;
+            FlatEntryView entry{op.arena};
+            string function_name;
+            if (decode_request(item.request.data(), item.request.size(), true,
+                               function_name, op, entry)) {
+                string error;
+                try {
+                    info_->update(config_.function_name, op, error);
+                } catch (PyError &exc) {
+                    log_error(exc.what());
+                    exceptions_.fetch_add(1, std::memory_order_relaxed);
+                }
+                calls_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,95 @@
+#ifndef POST_QUEUE_H_
+#define POST_QUEUE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+struct PostConfig {
+    // What to do with an update when the queue is full.
+    enum Overflow {
+        kBlock,     // wait for room
+        kDropNew,   // drop the update
+        kDropOld,   // drop the oldest queued update to make room
+    };
+
+    // The function called after each committed update. Empty means off.
+    std::string function_name;
+    unsigned threads = 1;
+    size_t max_queued = 1024;
+    // Largest total size of the queued updates' encodings, which include
+    // the entry. An update whose encoding alone is larger is dropped.
+    size_t max_queued_bytes = 64 << 20;
+    Overflow overflow = kBlock;
+    // Whether an update replaces one for the same DN which is still queued.
+    bool coalesce = false;
+};
+
+// Hands committed updates to a hook function from background threads, so
+// that the client doesn't wait for it. Updates are encoded (see
+// mod_op_codec) when they are pushed, so nothing they borrowed needs to
+// outlive the push. What the function returns is ignored; exceptions are
+// logged and counted.
+class PostQueue {
+  public:
+    PostQueue() {}
+    PostQueue(const PostQueue &) = delete;
+    ~PostQueue() { close(); }
+    void operator=(const PostQueue &) = delete;
+
+    bool is_open() const { return !threads_.empty(); }
+    // Starts the threads, which call info's config.function_name. info must
+    // stay open until close returns.
+    void open(InstanceInfo *info, const PostConfig &config);
+    // Waits for everything queued to be handed to the hook.
+    void close();
+
+    // Queues op, or drops it as config.overflow says.
+    void push(const ModificationOp &op);
+
+    void get_counters(std::vector<NamedCounter> &counters) const;
+
+  private:
+    struct Item {
+        uint64_t seq;
+        std::string dn;
+        std::string request;
+    };
+
+    void run();
+    // Removes the oldest item. mutex_ must be held.
+    Item pop_locked();
+
+    InstanceInfo *info_ = nullptr;
+    PostConfig config_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<Item> queue_;
+    uint64_t next_seq_ = 0;
+    // The seq of the queued item for each DN, with config_.coalesce.
+    std::unordered_map<std::string, uint64_t> queued_dns_;
+    size_t queued_bytes_ = 0;  // of the requests in queue_
+    bool closing_ = false;
+    std::atomic<uint64_t> queued_{0};
+    std::atomic<uint64_t> coalesced_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> calls_{0};
+    std::atomic<uint64_t> exceptions_{0};
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // POST_QUEUE_H_
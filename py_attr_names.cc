@@ -0,0 +1,70 @@
+#include <Python.h>
+
+#include <mutex>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Descriptions beyond this many aren't cached. Schemas don't come close,
+// but attribute options can make up new descriptions.
+const size_t kMaxAttrNames = 4096;
+
+std::mutex attr_names_mutex;
+
+}  // anonymous namespace
+
+void init_attr_names() {
+    current_interpreter_state()->attr_descs =
+        CCPyObj::checked_steal(PyDict_New());
+}
+
+PyObject *attr_name_new(ValueRef name, const void *desc) {
+    if (!desc) {
+        return PyUnicode_FromStringAndSize(name.data, name.size);
+    }
+    InterpreterState *state = current_interpreter_state();
+    NoGilLock lock{attr_names_mutex};
+    auto it = state->attr_names.find(desc);
+    if (it != state->attr_names.end()) {
+        return it->second.new_ref();
+    }
+
+    PyObject *py_name = PyUnicode_FromStringAndSize(name.data, name.size);
+    if (!py_name || state->attr_names.size() >= kMaxAttrNames) {
+        return py_name;
+    }
+    PyUnicode_InternInPlace(&py_name);
+    PyObject *py_desc = PyLong_FromVoidPtr(const_cast<void *>(desc));
+    if (!py_desc ||
+        PyDict_SetItem(state->attr_descs.ref(), py_name, py_desc) < 0) {
+        // Only the caching failed.
+        Py_XDECREF(py_desc);
+        PyErr_Clear();
+        return py_name;
+    }
+    Py_DECREF(py_desc);
+    state->attr_names.emplace(desc, CCPyObj::checked_borrow(py_name));
+    return py_name;
+}
+
+const void *attr_name_desc(PyObject *obj) {
+    if (!PyUnicode_CheckExact(obj)) {
+        return nullptr;
+    }
+    InterpreterState *state = current_interpreter_state();
+    NoGilLock lock{attr_names_mutex};
+    // Names handed back untouched are found by identity; equal ones made by
+    // the hook are hashed.
+    PyObject *py_desc = PyDict_GetItemWithError(state->attr_descs.ref(), obj);
+    if (!py_desc) {
+        PyErr_Clear();
+        return nullptr;
+    }
+    return PyLong_AsVoidPtr(py_desc);
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,399 @@
+#include <Python.h>
+
+#include <string>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+using std::string;
+
+namespace slapo_py_update_hook {
+namespace {
+
+struct EntryViewObject {
+    PyObject_HEAD
+    const EntryView *view;
+    ValueViews *value_views;
+    PyObject *cache;  // {name: [value, ...]} for attributes read so far
+    PyObject *cached;  // see EntryValueCache
+    size_t value_set_threshold;
+};
+
+bool check_attached(EntryViewObject *self) {
+    if (!self->view) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "entry is only available during the update call");
+        return false;
+    }
+    return true;
+}
+
+// Returns the index of the attribute named by key, or EntryView::npos if
+// there is no such attribute (or key isn't a string).
+size_t find_attr(EntryViewObject *self, PyObject *key) {
+    if (!PyUnicode_Check(key)) {
+        return EntryView::npos;
+    }
+    Py_ssize_t size;
+    const char *data = PyUnicode_AsUTF8AndSize(key, &size);
+    if (!data) {
+        PyErr_Clear();
+        return EntryView::npos;
+    }
+    return self->view->find(ValueRef{data, static_cast<size_t>(size)});
+}
+
+PyObject *names_list(EntryViewObject *self) {
+    if (!check_attached(self)) {
+        return nullptr;
+    }
+    size_t size = self->view->size();
+    PyObject *names = PyList_New(size);
+    for (size_t i = 0; names && i < size; i++) {
+        PyObject *py_name =
+            attr_name_new(self->view->name(i), self->view->desc(i));
+        if (!py_name) {
+            Py_CLEAR(names);
+            break;
+        }
+        PyList_SET_ITEM(names, i, py_name);
+    }
+    return names;
+}
+
+// Returns a new list of the values for key, or an empty CCPyObj (without
+// an exception set, if the attribute doesn't exist).
+CCPyObj convert(EntryViewObject *self, PyObject *key) {
+    if (self->cached) {
+        PyObject *cached = PyDict_GetItemWithError(self->cached, key);
+        if (cached) {
+            return CCPyObj::unchecked_steal(PySequence_List(cached));
+        } else if (PyErr_Occurred()) {
+            return CCPyObj{};
+        }
+    }
+    size_t attr = find_attr(self, key);
+    if (attr == EntryView::npos) {
+        return CCPyObj{};
+    }
+
+    size_t num_values = self->view->num_values(attr);
+    if (self->value_set_threshold &&
+        num_values >= self->value_set_threshold) {
+        // Never cached: it refers to the EntryView.
+        return CCPyObj::unchecked_steal(
+            value_set_new(self->view, attr, self->value_views));
+    }
+    CCPyObj values = CCPyObj::unchecked_steal(PyList_New(num_values));
+    if (!values.ref()) {
+        return CCPyObj{};
+    }
+    for (size_t i = 0; i < num_values; i++) {
+        ValueRef value = self->view->value(attr, i);
+        PyObject *py_value =
+            self->value_views
+                ? self->value_views->make(value, nullptr)
+                : PyBytes_FromStringAndSize(value.data, value.size);
+        if (!py_value) {
+            return CCPyObj{};
+        }
+        PyList_SET_ITEM(values.ref(), i, py_value);
+    }
+
+    // The hook may change the list it is given, so a tuple is cached.
+    if (self->cached) {
+        CCPyObj cached =
+            CCPyObj::unchecked_steal(PyList_AsTuple(values.ref()));
+        if (!cached.ref() ||
+            PyDict_SetItem(self->cached, key, cached.ref()) < 0) {
+            return CCPyObj{};
+        }
+    }
+    return values;
+}
+
+// Returns a new reference to the list of values for key. Returns nullptr
+// without setting an exception if the attribute doesn't exist.
+PyObject *lookup(EntryViewObject *self, PyObject *key) {
+    if (self->cache) {
+        PyObject *cached = PyDict_GetItem(self->cache, key);
+        if (cached) {
+            Py_INCREF(cached);
+            return cached;
+        }
+    }
+    if (!check_attached(self)) {
+        return nullptr;
+    }
+    CCPyObj values = convert(self, key);
+    if (!values.ref()) {
+        return nullptr;
+    }
+
+    if (!self->cache && !(self->cache = PyDict_New())) {
+        return nullptr;
+    }
+    if (PyDict_SetItem(self->cache, key, values.ref()) < 0) {
+        return nullptr;
+    }
+    return values.new_ref();
+}
+
+//
+// Type slots
+//
+
+void entry_view_dealloc(EntryViewObject *self) {
+    // Instances of heap types hold a reference to their type.
+    PyTypeObject *type = Py_TYPE(self);
+    Py_XDECREF(self->cache);
+    Py_XDECREF(self->cached);
+    type->tp_free(reinterpret_cast<PyObject *>(self));
+    Py_DECREF(type);
+}
+
+Py_ssize_t entry_view_length(EntryViewObject *self) {
+    if (!check_attached(self)) {
+        return -1;
+    }
+    return self->view->size();
+}
+
+PyObject *entry_view_subscript(EntryViewObject *self, PyObject *key) {
+    PyObject *values = lookup(self, key);
+    if (!values && !PyErr_Occurred()) {
+        PyErr_SetObject(PyExc_KeyError, key);
+    }
+    return values;
+}
+
+int entry_view_contains(EntryViewObject *self, PyObject *key) {
+    if (self->cache && PyDict_GetItem(self->cache, key)) {
+        return 1;
+    }
+    if (!check_attached(self)) {
+        return -1;
+    }
+    return find_attr(self, key) != EntryView::npos;
+}
+
+PyObject *entry_view_iter(EntryViewObject *self) {
+    CCPyObj names = CCPyObj::unchecked_steal(names_list(self));
+    if (!names.ref()) {
+        return nullptr;
+    }
+    return PyObject_GetIter(names.ref());
+}
+
+//
+// Methods
+//
+
+PyObject *entry_view_keys(EntryViewObject *self, PyObject *) {
+    return names_list(self);
+}
+
+PyObject *entry_view_values(EntryViewObject *self, PyObject *) {
+    CCPyObj names = CCPyObj::unchecked_steal(names_list(self));
+    if (!names.ref()) {
+        return nullptr;
+    }
+    Py_ssize_t size = PyList_GET_SIZE(names.ref());
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject *values = lookup(self, PyList_GET_ITEM(names.ref(), i));
+        if (!values) {
+            return nullptr;
+        }
+        // Replaces (and releases) the name at index i.
+        PyList_SetItem(names.ref(), i, values);
+    }
+    return names.new_ref();
+}
+
+PyObject *entry_view_items(EntryViewObject *self, PyObject *) {
+    CCPyObj names = CCPyObj::unchecked_steal(names_list(self));
+    if (!names.ref()) {
+        return nullptr;
+    }
+    Py_ssize_t size = PyList_GET_SIZE(names.ref());
+    for (Py_ssize_t i = 0; i < size; i++) {
+        PyObject *name = PyList_GET_ITEM(names.ref(), i);
+        PyObject *values = lookup(self, name);
+        if (!values) {
+            return nullptr;
+        }
+        PyObject *item = Py_BuildValue("(ON)", name, values);
+        if (!item) {
+            return nullptr;
+        }
+        PyList_SetItem(names.ref(), i, item);
+    }
+    return names.new_ref();
+}
+
+PyObject *entry_view_get(EntryViewObject *self, PyObject *args) {
+    PyObject *key;
+    PyObject *default_value = Py_None;
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &default_value)) {
+        return nullptr;
+    }
+    PyObject *values = lookup(self, key);
+    if (!values && !PyErr_Occurred()) {
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return values;
+}
+
+// Returns a new list of the values of key as normalized by its attribute's
+// equality rule, straight from the EntryView.
+PyObject *entry_view_normalized(EntryViewObject *self, PyObject *key) {
+    if (!check_attached(self)) {
+        return nullptr;
+    }
+    size_t attr = find_attr(self, key);
+    if (attr == EntryView::npos) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return nullptr;
+    }
+    size_t num_values = self->view->num_values(attr);
+    CCPyObj values = CCPyObj::unchecked_steal(PyList_New(num_values));
+    if (!values.ref()) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < num_values; i++) {
+        ValueRef value = self->view->normalized_value(attr, i);
+        PyObject *py_value =
+            self->value_views
+                ? self->value_views->make(value, nullptr)
+                : PyBytes_FromStringAndSize(value.data, value.size);
+        if (!py_value) {
+            return nullptr;
+        }
+        PyList_SET_ITEM(values.ref(), i, py_value);
+    }
+    return values.release();
+}
+
+PyMethodDef entry_view_methods[] = {
+    {"keys", reinterpret_cast<PyCFunction>(&entry_view_keys), METH_NOARGS,
+     nullptr},
+    {"values", reinterpret_cast<PyCFunction>(&entry_view_values), METH_NOARGS,
+     nullptr},
+    {"items", reinterpret_cast<PyCFunction>(&entry_view_items), METH_NOARGS,
+     nullptr},
+    {"get", reinterpret_cast<PyCFunction>(&entry_view_get), METH_VARARGS,
+     nullptr},
+    {"normalized", reinterpret_cast<PyCFunction>(&entry_view_normalized),
+     METH_O, nullptr},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyType_Slot entry_view_slots[] = {
+    {Py_tp_dealloc, reinterpret_cast<void *>(&entry_view_dealloc)},
+    {Py_tp_iter, reinterpret_cast<void *>(&entry_view_iter)},
+    {Py_tp_methods, entry_view_methods},
+    {Py_tp_doc,
+     const_cast<char *>("Read-only, lazily converted view of an entry")},
+    {Py_mp_length, reinterpret_cast<void *>(&entry_view_length)},
+    {Py_mp_subscript, reinterpret_cast<void *>(&entry_view_subscript)},
+    {Py_sq_contains, reinterpret_cast<void *>(&entry_view_contains)},
+    {0, nullptr},
+};
+
+PyType_Spec entry_view_spec = {
+    "EntryView",
+    sizeof(EntryViewObject),
+    0,
+    kNoInstantiation,
+    entry_view_slots,
+};
+
+}  // anonymous namespace
+
+void init_entry_view_type() {
+    current_interpreter_state()->entry_view_type =
+        CCPyObj::checked_steal(PyType_FromSpec(&entry_view_spec));
+}
+
+CCPyObj entry_view_new(const EntryView *view, ValueViews *values,
+                       PyObject *cached, size_t value_set_threshold) {
+    auto type = reinterpret_cast<PyTypeObject *>(
+        current_interpreter_state()->entry_view_type.ref());
+    EntryViewObject *self = PyObject_New(EntryViewObject, type);
+    if (self) {
+        self->view = view;
+        self->value_views = values;
+        self->cache = nullptr;
+        self->cached = values ? nullptr : cached;
+        Py_XINCREF(self->cached);
+        self->value_set_threshold = value_set_threshold;
+    }
+    return CCPyObj::checked_steal(reinterpret_cast<PyObject *>(self));
+}
+
+void entry_view_release(CCPyObj &obj) {
+    PyObject *type = current_interpreter_state()->entry_view_type.ref();
+    if (obj.ref() &&
+        reinterpret_cast<PyObject *>(Py_TYPE(obj.ref())) == type) {
+        auto self = reinterpret_cast<EntryViewObject *>(obj.ref());
+        self->view = nullptr;
+        self->value_views = nullptr;
+        Py_CLEAR(self->cached);
+        if (self->value_set_threshold && self->cache) {
+            PyObject *key, *values;
+            Py_ssize_t pos = 0;
+            while (PyDict_Next(self->cache, &pos, &key, &values)) {
+                value_set_release(values);
+            }
+        }
+    }
+}
+
+//
+// EntryValueCache
+//
+
+CCPyObj EntryValueCache::get(ValueRef dn, const EntryView &view) {
+    ValueRef version = view.version();
+    if (max_entries_ == 0 || version.size == 0) {
+        return CCPyObj{};
+    }
+    NoGilLock lock{mutex_};
+    string key = dn.str();
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        Entry &entry = lru_.front();
+        if (entry.version.size() == version.size &&
+            entry.version.compare(0, version.size, version.data,
+                                  version.size) == 0) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return entry.values;
+        }
+        // The entry has changed since.
+        entry.version = version.str();
+        entry.values = CCPyObj::checked_steal(PyDict_New());
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return entry.values;
+    }
+
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    if (lru_.size() >= max_entries_) {
+        index_.erase(lru_.back().dn);
+        lru_.pop_back();
+    }
+    lru_.push_front(Entry{key, version.str(),
+                          CCPyObj::checked_steal(PyDict_New())});
+    index_.emplace(std::move(key), lru_.begin());
+    return lru_.front().values;
+}
+
+void EntryValueCache::clear() {
+    NoGilLock lock{mutex_};
+    index_.clear();
+    lru_.clear();
+}
+
+}  // namespace slapo_py_update_hook
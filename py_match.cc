@@ -0,0 +1,174 @@
+#include <Python.h>
+
+#include <string>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+using std::string;
+
+namespace slapo_py_update_hook {
+namespace {
+
+bool check_nargs(const char *function, Py_ssize_t nargs, Py_ssize_t expected) {
+    if (nargs != expected) {
+        PyErr_Format(PyExc_TypeError, "%s() takes %zd arguments (%zd given)",
+                     function, expected, nargs);
+        return false;
+    }
+    return true;
+}
+
+// The bytes of a bytes-like argument (such as a ValueView), or the UTF-8
+// encoding of a str, which are valid for as long as it lives.
+class ValueArg {
+  public:
+    ValueArg() : ref_{nullptr, 0}, has_buffer_{false} {}
+    ValueArg(const ValueArg &) = delete;
+    ~ValueArg() {
+        if (has_buffer_) {
+            PyBuffer_Release(&buffer_);
+        }
+    }
+    void operator=(const ValueArg &) = delete;
+
+    // Returns false with an exception set if obj is neither.
+    bool set(PyObject *obj) {
+        if (PyUnicode_Check(obj)) {
+            Py_ssize_t size;
+            const char *data = PyUnicode_AsUTF8AndSize(obj, &size);
+            ref_ = ValueRef{data, static_cast<size_t>(size)};
+            return data != nullptr;
+        } else if (PyObject_GetBuffer(obj, &buffer_, PyBUF_SIMPLE) < 0) {
+            return false;
+        }
+        has_buffer_ = true;
+        ref_ = ValueRef{static_cast<const char *>(buffer_.buf),
+                        static_cast<size_t>(buffer_.len)};
+        return true;
+    }
+
+    ValueRef ref() const { return ref_; }
+
+  private:
+    ValueRef ref_;
+    Py_buffer buffer_;
+    bool has_buffer_;
+};
+
+// Reads an attribute name, along with its description if it is one handed
+// out by attr_name_new, so that it needn't be looked up again.
+bool attr_arg(PyObject *obj, ValueRef &name, const void *&desc) {
+    if (!PyUnicode_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "attribute name must be str, not %.100s",
+                     Py_TYPE(obj)->tp_name);
+        return false;
+    }
+    Py_ssize_t size;
+    const char *data = PyUnicode_AsUTF8AndSize(obj, &size);
+    if (!data) {
+        return false;
+    }
+    name = ValueRef{data, static_cast<size_t>(size)};
+    desc = attr_name_desc(obj);
+    return true;
+}
+
+PyObject *value_error(const string &error) {
+    PyErr_SetString(PyExc_ValueError, error.c_str());
+    return nullptr;
+}
+
+//
+// Functions
+//
+
+PyObject *match_normalize(PyObject *, PyObject *const *args,
+                          Py_ssize_t nargs) {
+    ValueRef name;
+    const void *desc;
+    ValueArg value;
+    if (!check_nargs("normalize", nargs, 2) ||
+        !attr_arg(args[0], name, desc) || !value.set(args[1])) {
+        return nullptr;
+    }
+    string out, error;
+    if (!normalize_value(name, desc, value.ref(), out, error)) {
+        return value_error(error);
+    }
+    return PyBytes_FromStringAndSize(out.data(), out.size());
+}
+
+PyObject *match_equality_match(PyObject *, PyObject *const *args,
+                               Py_ssize_t nargs) {
+    ValueRef name;
+    const void *desc;
+    ValueArg a, b;
+    if (!check_nargs("equality_match", nargs, 3) ||
+        !attr_arg(args[0], name, desc) || !a.set(args[1]) ||
+        !b.set(args[2])) {
+        return nullptr;
+    }
+    bool match;
+    string error;
+    if (!equality_match(name, desc, a.ref(), b.ref(), match, error)) {
+        return value_error(error);
+    }
+    return PyBool_FromLong(match);
+}
+
+PyObject *match_dn_normalize(PyObject *, PyObject *const *args,
+                             Py_ssize_t nargs) {
+    ValueArg dn;
+    if (!check_nargs("dn_normalize", nargs, 1) || !dn.set(args[0])) {
+        return nullptr;
+    }
+    string out, error;
+    if (!dn_normalize(dn.ref(), out, error)) {
+        return value_error(error);
+    }
+    return PyUnicode_FromStringAndSize(out.data(), out.size());
+}
+
+PyObject *match_is_descendant(PyObject *, PyObject *const *args,
+                              Py_ssize_t nargs) {
+    ValueArg dn, base;
+    if (!check_nargs("is_descendant", nargs, 2) || !dn.set(args[0]) ||
+        !base.set(args[1])) {
+        return nullptr;
+    }
+    bool descendant;
+    string error;
+    if (!dn_is_descendant(dn.ref(), base.ref(), descendant, error)) {
+        return value_error(error);
+    }
+    return PyBool_FromLong(descendant);
+}
+
+PyMethodDef match_functions[] = {
+    {"normalize", reinterpret_cast<PyCFunction>(&match_normalize),
+     METH_FASTCALL,
+     "normalize(attr, value) -> bytes: value as normalized by the "
+     "attribute's equality matching rule"},
+    {"equality_match", reinterpret_cast<PyCFunction>(&match_equality_match),
+     METH_FASTCALL,
+     "equality_match(attr, a, b) -> bool: whether a and b are equal by the "
+     "attribute's equality matching rule"},
+    {"dn_normalize", reinterpret_cast<PyCFunction>(&match_dn_normalize),
+     METH_FASTCALL, "dn_normalize(dn) -> str: dn in slapd's normalized form"},
+    {"is_descendant", reinterpret_cast<PyCFunction>(&match_is_descendant),
+     METH_FASTCALL,
+     "is_descendant(dn, base) -> bool: whether dn is below base"},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+}  // anonymous namespace
+
+void add_match_functions(CCPyObj module) {
+    if (PyModule_AddFunctions(module.ref(), match_functions) < 0) {
+        CCPyObj::checked_steal(nullptr);  // throws
+    }
+}
+
+}  // namespace slapo_py_update_hook
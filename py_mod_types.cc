@@ -0,0 +1,265 @@
+#include <Python.h>
+
+#include <cstdint>
+#include <cstring>  // strcmp
+#include <string>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+using std::string;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Both types are tuple subclasses with this many named fields.
+const Py_ssize_t kNumFields = 4;
+
+struct TupleType {
+    const char *name;
+    const char *doc;
+    const char *fields[kNumFields];
+    PyGetSetDef getset[kNumFields + 1];
+};
+
+TupleType mod_type = {
+    "Modification",
+    "Modification(name, values, op, flags)",
+    {"name", "values", "op", "flags"},
+};
+
+TupleType op_type = {
+    "ModificationOp",
+    "ModificationOp(dn, auth_dn, entry, modifications)",
+    {"dn", "auth_dn", "entry", "modifications"},
+};
+
+// Works for subclasses (defined in Python) too. The types are told apart
+// by name rather than identity, since each interpreter has its own.
+const TupleType *tuple_type_of(PyTypeObject *type) {
+    while (type->tp_base && type->tp_base != &PyTuple_Type) {
+        type = type->tp_base;
+    }
+    return strcmp(type->tp_name, mod_type.name) == 0 ? &mod_type : &op_type;
+}
+
+// Returns the index of the field named by key, or kNumFields.
+Py_ssize_t field_index(const TupleType *tuple_type, PyObject *key) {
+    Py_ssize_t idx = 0;
+    while (idx < kNumFields &&
+           !(PyUnicode_Check(key) &&
+             PyUnicode_CompareWithASCIIString(key, tuple_type->fields[idx]) ==
+                 0)) {
+        idx++;
+    }
+    return idx;
+}
+
+PyObject *alloc_tuple(PyTypeObject *type, PyObject *const *items) {
+    PyObject *self = type->tp_alloc(type, kNumFields);
+    if (!self) {
+        return nullptr;
+    }
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        Py_INCREF(items[i]);
+        PyTuple_SET_ITEM(self, i, items[i]);
+    }
+    return self;
+}
+
+// Fills items from positional and keyword args, namedtuple-style. Returns
+// false with an exception set on failure.
+bool parse_fields(const TupleType *tuple_type, PyObject *args,
+                  PyObject *kwargs, PyObject **items) {
+    Py_ssize_t num_args = args ? PyTuple_GET_SIZE(args) : 0;
+    if (num_args > kNumFields) {
+        PyErr_Format(PyExc_TypeError, "%s takes %d arguments (%d given)",
+                     tuple_type->name, static_cast<int>(kNumFields),
+                     static_cast<int>(num_args));
+        return false;
+    }
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        items[i] = i < num_args ? PyTuple_GET_ITEM(args, i) : nullptr;
+    }
+
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        Py_ssize_t idx = field_index(tuple_type, key);
+        if (idx == kNumFields || items[idx]) {
+            PyErr_Format(PyExc_TypeError, "%s got an unexpected or repeated "
+                         "keyword argument", tuple_type->name);
+            return false;
+        }
+        items[idx] = value;
+    }
+
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        if (!items[i]) {
+            PyErr_Format(PyExc_TypeError, "%s is missing argument %s",
+                         tuple_type->name, tuple_type->fields[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Type slots
+//
+
+PyObject *tuple_type_new(PyTypeObject *type, PyObject *args,
+                         PyObject *kwargs) {
+    PyObject *items[kNumFields];
+    if (!parse_fields(tuple_type_of(type), args, kwargs, items)) {
+        return nullptr;
+    }
+    return alloc_tuple(type, items);
+}
+
+PyObject *tuple_type_repr(PyObject *self) {
+    const TupleType *tuple_type = tuple_type_of(Py_TYPE(self));
+    static_assert(kNumFields == 4, "the format needs a field for each");
+    return PyUnicode_FromFormat(
+        "%s(%s=%R, %s=%R, %s=%R, %s=%R)", Py_TYPE(self)->tp_name,
+        tuple_type->fields[0], PyTuple_GET_ITEM(self, 0), tuple_type->fields[1],
+        PyTuple_GET_ITEM(self, 1), tuple_type->fields[2],
+        PyTuple_GET_ITEM(self, 2), tuple_type->fields[3],
+        PyTuple_GET_ITEM(self, 3));
+}
+
+PyObject *get_field(PyObject *self, void *closure) {
+    PyObject *item =
+        PyTuple_GET_ITEM(self, reinterpret_cast<intptr_t>(closure));
+    Py_INCREF(item);
+    return item;
+}
+
+//
+// Methods
+//
+
+PyObject *tuple_type_replace(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+    const TupleType *tuple_type = tuple_type_of(Py_TYPE(self));
+    PyObject *items[kNumFields];
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        items[i] = PyTuple_GET_ITEM(self, i);
+    }
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (kwargs && PyDict_Next(kwargs, &pos, &key, &value)) {
+        Py_ssize_t idx = field_index(tuple_type, key);
+        if (idx == kNumFields) {
+            PyErr_Format(PyExc_ValueError, "Got unexpected field names");
+            return nullptr;
+        }
+        items[idx] = value;
+    }
+    return alloc_tuple(Py_TYPE(self), items);
+}
+
+PyObject *tuple_type_asdict(PyObject *self, PyObject *) {
+    const TupleType *tuple_type = tuple_type_of(Py_TYPE(self));
+    CCPyObj result = CCPyObj::unchecked_steal(PyDict_New());
+    for (Py_ssize_t i = 0; result.ref() && i < kNumFields; i++) {
+        if (PyDict_SetItemString(result.ref(), tuple_type->fields[i],
+                                 PyTuple_GET_ITEM(self, i)) < 0) {
+            return nullptr;
+        }
+    }
+    return result.new_ref();
+}
+
+PyObject *tuple_type_make(PyObject *type, PyObject *iterable) {
+    CCPyObj items = CCPyObj::unchecked_steal(PySequence_Tuple(iterable));
+    if (!items.ref()) {
+        return nullptr;
+    }
+    return tuple_type_new(reinterpret_cast<PyTypeObject *>(type), items.ref(),
+                          nullptr);
+}
+
+PyObject *tuple_type_getnewargs(PyObject *self, PyObject *) {
+    return PyTuple_GetSlice(self, 0, kNumFields);
+}
+
+PyMethodDef tuple_type_methods[] = {
+    {"_replace", reinterpret_cast<PyCFunction>(&tuple_type_replace),
+     METH_VARARGS | METH_KEYWORDS, nullptr},
+    {"_asdict", reinterpret_cast<PyCFunction>(&tuple_type_asdict),
+     METH_NOARGS, nullptr},
+    {"_make", reinterpret_cast<PyCFunction>(&tuple_type_make),
+     METH_O | METH_CLASS, nullptr},
+    {"__getnewargs__", reinterpret_cast<PyCFunction>(&tuple_type_getnewargs),
+     METH_NOARGS, nullptr},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+CCPyObj init_tuple_type(TupleType &tuple_type) {
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        PyGetSetDef &getset = tuple_type.getset[i];
+        getset.name = const_cast<char *>(tuple_type.fields[i]);
+        getset.get = &get_field;
+        getset.closure = reinterpret_cast<void *>(i);
+    }
+
+    PyType_Slot slots[] = {
+        {Py_tp_repr, reinterpret_cast<void *>(&tuple_type_repr)},
+        {Py_tp_doc, const_cast<char *>(tuple_type.doc)},
+        {Py_tp_methods, tuple_type_methods},
+        {Py_tp_getset, tuple_type.getset},
+        {Py_tp_new, reinterpret_cast<void *>(&tuple_type_new)},
+        {0, nullptr},
+    };
+    // The basic and item sizes are inherited from tuple.
+    PyType_Spec spec = {tuple_type.name, 0, 0,
+                        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, slots};
+    CCPyObj bases = CCPyObj::checked_steal(
+        PyTuple_Pack(1, reinterpret_cast<PyObject *>(&PyTuple_Type)));
+    CCPyObj type =
+        CCPyObj::checked_steal(PyType_FromSpecWithBases(&spec, bases.ref()));
+
+    CCPyObj fields = CCPyObj::checked_steal(PyTuple_New(kNumFields));
+    for (Py_ssize_t i = 0; i < kNumFields; i++) {
+        PyTuple_SET_ITEM(fields.ref(), i,
+                         CCPyObj{tuple_type.fields[i]}.new_ref());
+    }
+    if (PyObject_SetAttrString(type.ref(), "_fields", fields.ref()) < 0) {
+        PyErr_Clear();
+        throw PyError{string{"Unable to initialize "} + tuple_type.name +
+                      " type"};
+    }
+    return type;
+}
+
+}  // anonymous namespace
+
+void init_mod_types() {
+    InterpreterState *state = current_interpreter_state();
+    state->mod_type = init_tuple_type(mod_type);
+    state->op_type = init_tuple_type(op_type);
+}
+
+CCPyObj modification_type() {
+    return current_interpreter_state()->mod_type;
+}
+
+CCPyObj modification_new(CCPyObj name, CCPyObj values, CCPyObj op,
+                         CCPyObj flags) {
+    PyObject *items[] = {name.ref(), values.ref(), op.ref(), flags.ref()};
+    auto type = reinterpret_cast<PyTypeObject *>(
+        current_interpreter_state()->mod_type.ref());
+    return CCPyObj::checked_steal(alloc_tuple(type, items));
+}
+
+CCPyObj modification_op_new(CCPyObj dn, CCPyObj auth_dn, CCPyObj entry,
+                            CCPyObj mods) {
+    PyObject *items[] = {dn.ref(), auth_dn.ref(), entry.ref(), mods.ref()};
+    auto type = reinterpret_cast<PyTypeObject *>(
+        current_interpreter_state()->op_type.ref());
+    return CCPyObj::checked_steal(alloc_tuple(type, items));
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,97 @@
+#include <Python.h>
+#include <frameobject.h>
+#include <unistd.h>  // getpid, unlink
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "py_profile.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Only the last component of file names, to keep the lines short.
+const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+string frame_label(PyFrameObject *frame) {
+    PyCodeObject *code = PyFrame_GetCode(frame);
+    const char *name = PyUnicode_AsUTF8(code->co_name);
+    const char *filename = PyUnicode_AsUTF8(code->co_filename);
+    if (!name || !filename) {
+        PyErr_Clear();
+    }
+    string label = name ? name : "?";
+    label += " (";
+    label += filename ? base_name(filename) : "?";
+    label += ':';
+    label += std::to_string(PyFrame_GetLineNumber(frame));
+    label += ')';
+    Py_DECREF(code);
+    // Either would split the line into fields.
+    for (char &c : label) {
+        if (c == ';' || c == '\n') {
+            c = '_';
+        }
+    }
+    return label;
+}
+
+}  // anonymous namespace
+
+void FoldedStacks::add(PyFrameObject *frame, const string &root,
+                       uint64_t count) {
+    // Innermost first.
+    vector<string> labels;
+    Py_XINCREF(frame);
+    while (frame) {
+        labels.push_back(frame_label(frame));
+        PyFrameObject *back = PyFrame_GetBack(frame);
+        Py_DECREF(frame);
+        frame = back;
+    }
+
+    string stack = root;
+    for (auto it = labels.rbegin(); it != labels.rend(); ++it) {
+        stack += ';';
+        stack += *it;
+    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    counts_[stack] += count;
+    samples_ += count;
+}
+
+bool FoldedStacks::write(const string &path, string &error) {
+    // Written under another name and renamed, so that readers never see
+    // half of it.
+    string tmp_path = path + ".tmp" + std::to_string(getpid());
+    std::unique_ptr<FILE, decltype(&fclose)> fp{nullptr, &fclose};
+    fp.reset(fopen(tmp_path.c_str(), "w"));
+    std::lock_guard<std::mutex> lock{mutex_};
+    bool ok = fp != nullptr;
+    for (const auto &stack_count : counts_) {
+        if (!ok) {
+            break;
+        }
+        ok = fprintf(fp.get(), "%s %llu\n", stack_count.first.c_str(),
+                     static_cast<unsigned long long>(stack_count.second)) > 0;
+    }
+    ok = fp && fclose(fp.release()) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        error = "Unable to write " + path + ": " + strerror(errno);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace slapo_py_update_hook
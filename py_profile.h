@@ -0,0 +1,39 @@
+#ifndef PY_PROFILE_H_
+#define PY_PROFILE_H_
+
+#include <Python.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace slapo_py_update_hook {
+
+// Counts sampled Python stacks, in the "folded" form which flame graph tools
+// read: one line per distinct stack, of its frames from the outermost in,
+// separated by ';', then a space and the number of times it was seen. Each
+// frame is "function (file:line)".
+class FoldedStacks {
+  public:
+    FoldedStacks() : samples_{0} {}
+    FoldedStacks(const FoldedStacks &) = delete;
+    void operator=(const FoldedStacks &) = delete;
+
+    // Counts frame's stack count times, under root. The GIL must be held.
+    void add(PyFrameObject *frame, const std::string &root, uint64_t count);
+    uint64_t samples() const { return samples_.load(); }
+    // Replaces path with the stacks counted so far. Returns false (and sets
+    // error) on failure.
+    bool write(const std::string &path, std::string &error);
+
+  private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, uint64_t> counts_;
+    std::atomic<uint64_t> samples_;
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // PY_PROFILE_H_
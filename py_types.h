@@ -0,0 +1,144 @@
+#ifndef PY_TYPES_H_
+#define PY_TYPES_H_
+
+#include <Python.h>
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+
+namespace slapo_py_update_hook {
+
+// The types are heap types, created separately in each interpreter by the
+// init functions, which store them in the current InterpreterState.
+
+// Type flags for types which can only be instantiated from C++.
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+const unsigned int kNoInstantiation =
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION;
+#else
+const unsigned int kNoInstantiation = Py_TPFLAGS_DEFAULT;
+#endif
+
+// ValueView: a read-only, buffer-protocol view of a value owned by slapd,
+// used in zero-copy mode, which otherwise behaves like bytes. Views are only
+// backed by slapd's memory for the duration of an update call; ValueViews
+// tracks the views created for one call so that any the hook holds on to can
+// be given their own copy.
+class ValueViews {
+  public:
+    ValueViews() {}
+    ValueViews(const ValueViews &) = delete;
+    ~ValueViews() { release(); }
+    void operator=(const ValueViews &) = delete;
+
+    // Returns a new reference, or nullptr with an exception set.
+    PyObject *make(ValueRef ref, const void *origin);
+    void release();
+
+  private:
+    std::vector<CCPyObj> views_;
+};
+
+void init_value_view_type();
+// If obj is a view which is still backed by slapd's memory, sets ref and
+// origin and returns true.
+bool value_view_get(PyObject *obj, ValueRef &ref, const void *&origin);
+
+// The converted values of recently seen entries, so that those of an entry
+// which is modified over and over needn't be converted again while it
+// doesn't change. Each entry's are kept as {attribute_name: (value, ...)},
+// keyed by DN and only valid for the EntryView::version they were
+// converted at. The least recently used go first.
+class EntryValueCache {
+  public:
+    EntryValueCache() : max_entries_{0}, hits_{0}, misses_{0} {}
+    EntryValueCache(const EntryValueCache &) = delete;
+    void operator=(const EntryValueCache &) = delete;
+
+    void set_max_entries(size_t max_entries) { max_entries_ = max_entries; }
+    bool enabled() const { return max_entries_ > 0; }
+    // Returns the values cached for view, which an entry view both reads
+    // and fills in, or an empty CCPyObj if it has no version.
+    CCPyObj get(ValueRef dn, const EntryView &view);
+    void clear();
+    uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t misses() const {
+        return misses_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct Entry {
+        std::string dn;
+        std::string version;
+        CCPyObj values;
+    };
+
+    size_t max_entries_;
+    std::mutex mutex_;  // see NoGilLock
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+};
+
+// EntryView: a read-only mapping {attribute_name: [value, ...]} backed by an
+// EntryView. Values are only converted when an attribute is first read.
+void init_entry_view_type();
+// If values is set, attribute values are handed out as ValueViews.
+// Otherwise, if cached is set (see EntryValueCache::get), values are taken
+// from and added to it. If value_set_threshold is nonzero, attributes with
+// at least that many values are handed out as ValueSets rather than lists.
+CCPyObj entry_view_new(const EntryView *view, ValueViews *values,
+                       PyObject *cached, size_t value_set_threshold);
+// Detaches the mapping from its EntryView, and any ValueSets it handed out;
+// later reads of attributes that were not already converted raise
+// RuntimeError.
+void entry_view_release(CCPyObj &obj);
+
+// ValueSet: a read-only sequence of one attribute's values, which also
+// answers `in` and `-` through a hash index over the values normalized by
+// the attribute's equality rule, built when first needed.
+void init_value_set_type();
+// Returns a new reference, or nullptr with an exception set. values is as
+// for entry_view_new.
+PyObject *value_set_new(const EntryView *view, size_t attr,
+                        ValueViews *values);
+// Detaches obj, if it is a ValueSet, from its EntryView.
+void value_set_release(PyObject *obj);
+
+// Attribute names: the schema doesn't change, so each attribute's name is
+// made once, interned, and handed out again whenever the attribute comes up,
+// and names the hook hands back are mapped straight back to the attribute.
+void init_attr_names();
+// Returns a new reference to the str for name, or nullptr with an exception
+// set. If desc (see Modification::desc) is set, it is cached.
+PyObject *attr_name_new(ValueRef name, const void *desc);
+// Returns the description of a name made by attr_name_new, or nullptr if obj
+// isn't (or isn't equal to) one.
+const void *attr_name_desc(PyObject *obj);
+
+// Modification and ModificationOp: tuple subclasses with named fields, like
+// the namedtuples they replace, but created and read directly from C++.
+void init_mod_types();
+CCPyObj modification_type();
+CCPyObj modification_new(CCPyObj name, CCPyObj values, CCPyObj op,
+                         CCPyObj flags);
+CCPyObj modification_op_new(CCPyObj dn, CCPyObj auth_dn, CCPyObj entry,
+                            CCPyObj mods);
+
+// The hook module's functions for comparing values and DNs as slapd does
+// (normalize, equality_match, dn_normalize and is_descendant); see
+// normalize_value and the functions after it in slapo_py_update_hook.h.
+void add_match_functions(CCPyObj module);
+
+}  // namespace slapo_py_update_hook
+
+#endif  // PY_TYPES_H_
@@ -0,0 +1,323 @@
+#include <Python.h>
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+bool same_bytes(ValueRef a, ValueRef b) {
+    return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+
+// An open-addressing hash index over an attribute's normalized values,
+// which it borrows from the EntryView.
+class ValueIndex {
+  public:
+    ValueIndex(const EntryView &view, size_t attr) : view_(view), attr_{attr} {
+        size_t num_values = view.num_values(attr);
+        size_t capacity = 16;
+        while (capacity < num_values * 2) {
+            capacity *= 2;
+        }
+        slots_.assign(capacity, 0);
+        size_t mask = capacity - 1;
+        for (size_t i = 0; i < num_values; i++) {
+            size_t slot = hash_bytes(view.normalized_value(attr, i)) & mask;
+            while (slots_[slot]) {
+                slot = (slot + 1) & mask;
+            }
+            slots_[slot] = i + 1;
+        }
+    }
+
+    bool contains(ValueRef normalized) const {
+        size_t mask = slots_.size() - 1;
+        for (size_t slot = hash_bytes(normalized) & mask; slots_[slot];
+             slot = (slot + 1) & mask) {
+            if (same_bytes(view_.normalized_value(attr_, slots_[slot] - 1),
+                           normalized)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  private:
+    const EntryView &view_;
+    size_t attr_;
+    vector<uint32_t> slots_;  // value index + 1, or 0 if empty
+};
+
+struct ValueSetObject {
+    PyObject_HEAD
+    const EntryView *view;
+    size_t attr;
+    Py_ssize_t size;
+    ValueViews *value_views;
+    ValueIndex *index;  // built on first use
+};
+
+bool is_value_set(PyObject *obj) {
+    return reinterpret_cast<PyObject *>(Py_TYPE(obj)) ==
+           current_interpreter_state()->value_set_type.ref();
+}
+
+bool check_attached(ValueSetObject *self) {
+    if (!self->view) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "entry is only available during the update call");
+        return false;
+    }
+    return true;
+}
+
+bool ensure_index(ValueSetObject *self) {
+    if (!self->index) {
+        try {
+            self->index = new ValueIndex{*self->view, self->attr};
+        } catch (std::bad_alloc &) {
+            PyErr_NoMemory();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Normalizes a bytes-like object, or the UTF-8 encoding of a str, for
+// self's attribute. Returns false, without an exception set, if obj is
+// neither or isn't a valid value.
+bool normalize_key(ValueSetObject *self, PyObject *obj, string &out) {
+    if (PyUnicode_Check(obj)) {
+        Py_ssize_t size;
+        const char *data = PyUnicode_AsUTF8AndSize(obj, &size);
+        if (!data) {
+            PyErr_Clear();
+            return false;
+        }
+        return self->view->normalize(
+            self->attr, ValueRef{data, static_cast<size_t>(size)}, out);
+    }
+    Py_buffer buf;
+    if (PyObject_GetBuffer(obj, &buf, PyBUF_SIMPLE) < 0) {
+        PyErr_Clear();
+        return false;
+    }
+    bool ok = self->view->normalize(
+        self->attr,
+        ValueRef{static_cast<const char *>(buf.buf),
+                 static_cast<size_t>(buf.len)},
+        out);
+    PyBuffer_Release(&buf);
+    return ok;
+}
+
+// Whether a and b hold values of the same attribute, and so normalize them
+// alike.
+bool same_attribute(ValueSetObject *a, ValueSetObject *b) {
+    const void *a_desc = a->view->desc(a->attr);
+    if (a_desc) {
+        return a_desc == b->view->desc(b->attr);
+    }
+    ValueRef a_name = a->view->name(a->attr);
+    ValueRef b_name = b->view->name(b->attr);
+    return !name_less(a_name, b_name) && !name_less(b_name, a_name);
+}
+
+// Returns a new list of self's values which aren't in other.
+PyObject *values_not_in(ValueSetObject *self, PyObject *other) {
+    // Another ValueSet of the same attribute is probed through its index;
+    // anything else, including a ValueSet of another attribute, has its
+    // items normalized for self's attribute.
+    ValueSetObject *other_set = nullptr;
+    std::unordered_set<string> others;
+    if (is_value_set(other)) {
+        other_set = reinterpret_cast<ValueSetObject *>(other);
+        if (!check_attached(other_set)) {
+            return nullptr;
+        } else if (!same_attribute(self, other_set)) {
+            other_set = nullptr;
+        } else if (!ensure_index(other_set)) {
+            return nullptr;
+        }
+    }
+    if (!other_set) {
+        CCPyObj iter = CCPyObj::unchecked_steal(PyObject_GetIter(other));
+        if (!iter.ref()) {
+            return nullptr;
+        }
+        string key;
+        while (PyObject *item = PyIter_Next(iter.ref())) {
+            if (normalize_key(self, item, key)) {
+                others.insert(key);
+            }
+            Py_DECREF(item);
+        }
+        if (PyErr_Occurred()) {
+            return nullptr;
+        }
+    }
+
+    CCPyObj result = CCPyObj::unchecked_steal(PyList_New(0));
+    if (!result.ref()) {
+        return nullptr;
+    }
+    for (Py_ssize_t i = 0; i < self->size; i++) {
+        ValueRef normalized = self->view->normalized_value(self->attr, i);
+        if (other_set ? other_set->index->contains(normalized)
+                      : others.count(normalized.str()) > 0) {
+            continue;
+        }
+        ValueRef value = self->view->value(self->attr, i);
+        CCPyObj py_value = CCPyObj::unchecked_steal(
+            self->value_views
+                ? self->value_views->make(value, nullptr)
+                : PyBytes_FromStringAndSize(value.data, value.size));
+        if (!py_value.ref() || PyList_Append(result.ref(), py_value.ref())) {
+            return nullptr;
+        }
+    }
+    return result.new_ref();
+}
+
+// Returns a new list of the items of iterable which aren't in self.
+PyObject *items_not_in(PyObject *iterable, ValueSetObject *self) {
+    if (!ensure_index(self)) {
+        return nullptr;
+    }
+    CCPyObj iter = CCPyObj::unchecked_steal(PyObject_GetIter(iterable));
+    CCPyObj result = CCPyObj::unchecked_steal(PyList_New(0));
+    if (!iter.ref() || !result.ref()) {
+        return nullptr;
+    }
+    string key;
+    while (PyObject *item = PyIter_Next(iter.ref())) {
+        bool found = normalize_key(self, item, key) &&
+                     self->index->contains(ValueRef{key.data(), key.size()});
+        int status = found ? 0 : PyList_Append(result.ref(), item);
+        Py_DECREF(item);
+        if (status < 0) {
+            return nullptr;
+        }
+    }
+    if (PyErr_Occurred()) {
+        return nullptr;
+    }
+    return result.new_ref();
+}
+
+//
+// Type slots
+//
+
+void value_set_dealloc(ValueSetObject *self) {
+    // Instances of heap types hold a reference to their type.
+    PyTypeObject *type = Py_TYPE(self);
+    delete self->index;
+    type->tp_free(reinterpret_cast<PyObject *>(self));
+    Py_DECREF(type);
+}
+
+PyObject *value_set_repr(ValueSetObject *self) {
+    return PyUnicode_FromFormat("<ValueSet of %zd values>", self->size);
+}
+
+Py_ssize_t value_set_length(ValueSetObject *self) { return self->size; }
+
+PyObject *value_set_item(ValueSetObject *self, Py_ssize_t i) {
+    if (!check_attached(self)) {
+        return nullptr;
+    } else if (i < 0 || i >= self->size) {
+        PyErr_SetString(PyExc_IndexError, "ValueSet index out of range");
+        return nullptr;
+    }
+    ValueRef value = self->view->value(self->attr, i);
+    return self->value_views
+               ? self->value_views->make(value, nullptr)
+               : PyBytes_FromStringAndSize(value.data, value.size);
+}
+
+int value_set_contains(ValueSetObject *self, PyObject *obj) {
+    if (!check_attached(self) || !ensure_index(self)) {
+        return -1;
+    }
+    string key;
+    return normalize_key(self, obj, key) &&
+           self->index->contains(ValueRef{key.data(), key.size()});
+}
+
+PyObject *value_set_subtract(PyObject *a, PyObject *b) {
+    if (is_value_set(a)) {
+        auto self = reinterpret_cast<ValueSetObject *>(a);
+        return check_attached(self) ? values_not_in(self, b) : nullptr;
+    }
+    auto self = reinterpret_cast<ValueSetObject *>(b);
+    return check_attached(self) ? items_not_in(a, self) : nullptr;
+}
+
+PyType_Slot value_set_slots[] = {
+    {Py_tp_dealloc, reinterpret_cast<void *>(&value_set_dealloc)},
+    {Py_tp_repr, reinterpret_cast<void *>(&value_set_repr)},
+    {Py_tp_hash, reinterpret_cast<void *>(&PyObject_HashNotImplemented)},
+    {Py_tp_doc,
+     const_cast<char *>("Read-only sequence of an attribute's values, with "
+                        "hashed membership tests and differences")},
+    {Py_sq_length, reinterpret_cast<void *>(&value_set_length)},
+    {Py_sq_item, reinterpret_cast<void *>(&value_set_item)},
+    {Py_sq_contains, reinterpret_cast<void *>(&value_set_contains)},
+    {Py_nb_subtract, reinterpret_cast<void *>(&value_set_subtract)},
+    {0, nullptr},
+};
+
+PyType_Spec value_set_spec = {
+    "ValueSet",
+    sizeof(ValueSetObject),
+    0,
+    kNoInstantiation,
+    value_set_slots,
+};
+
+}  // anonymous namespace
+
+void init_value_set_type() {
+    current_interpreter_state()->value_set_type =
+        CCPyObj::checked_steal(PyType_FromSpec(&value_set_spec));
+}
+
+PyObject *value_set_new(const EntryView *view, size_t attr,
+                        ValueViews *values) {
+    auto type = reinterpret_cast<PyTypeObject *>(
+        current_interpreter_state()->value_set_type.ref());
+    ValueSetObject *self = PyObject_New(ValueSetObject, type);
+    if (self) {
+        self->view = view;
+        self->attr = attr;
+        self->size = view->num_values(attr);
+        self->value_views = values;
+        self->index = nullptr;
+    }
+    return reinterpret_cast<PyObject *>(self);
+}
+
+void value_set_release(PyObject *obj) {
+    if (is_value_set(obj)) {
+        auto self = reinterpret_cast<ValueSetObject *>(obj);
+        self->view = nullptr;
+        self->value_views = nullptr;
+        delete self->index;
+        self->index = nullptr;
+    }
+}
+
+}  // namespace slapo_py_update_hook
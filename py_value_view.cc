@@ -0,0 +1,236 @@
+#include <Python.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "slapo_py_update_hook.h"
+#include "cc_py_obj.h"
+#include "py_types.h"
+
+namespace slapo_py_update_hook {
+namespace {
+
+struct ValueViewObject {
+    PyObject_HEAD
+    const char *data;
+    Py_ssize_t size;
+    const void *origin;
+    // Owns data once the view has outlived its update call.
+    PyObject *copy;
+    Py_hash_t hash;
+};
+
+PyObject *to_bytes(ValueViewObject *self) {
+    if (self->copy) {
+        Py_INCREF(self->copy);
+        return self->copy;
+    }
+    return PyBytes_FromStringAndSize(self->data, self->size);
+}
+
+//
+// Type slots
+//
+
+void value_view_dealloc(ValueViewObject *self) {
+    // Instances of heap types hold a reference to their type.
+    PyTypeObject *type = Py_TYPE(self);
+    Py_XDECREF(self->copy);
+    type->tp_free(reinterpret_cast<PyObject *>(self));
+    Py_DECREF(type);
+}
+
+PyObject *value_view_repr(ValueViewObject *self) {
+    CCPyObj bytes = CCPyObj::unchecked_steal(to_bytes(self));
+    if (!bytes.ref()) {
+        return nullptr;
+    }
+    return PyUnicode_FromFormat("ValueView(%R)", bytes.ref());
+}
+
+Py_hash_t value_view_hash(ValueViewObject *self) {
+    // Hash like the equivalent bytes, so views can be used to look up dicts
+    // and sets keyed by bytes.
+    if (self->hash == -1) {
+        CCPyObj bytes = CCPyObj::unchecked_steal(to_bytes(self));
+        if (!bytes.ref()) {
+            return -1;
+        }
+        self->hash = PyObject_Hash(bytes.ref());
+    }
+    return self->hash;
+}
+
+PyObject *value_view_richcompare(ValueViewObject *self, PyObject *other,
+                                 int op) {
+    const char *other_data;
+    Py_ssize_t other_size;
+    if (Py_TYPE(other) == Py_TYPE(self)) {
+        auto other_view = reinterpret_cast<ValueViewObject *>(other);
+        other_data = other_view->data;
+        other_size = other_view->size;
+    } else if (PyBytes_Check(other)) {
+        other_data = PyBytes_AS_STRING(other);
+        other_size = PyBytes_GET_SIZE(other);
+    } else {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+
+    Py_ssize_t common = std::min(self->size, other_size);
+    int cmp = common > 0 ? memcmp(self->data, other_data, common) : 0;
+    if (cmp == 0) {
+        cmp = (self->size > other_size) - (self->size < other_size);
+    }
+    bool result;
+    switch (op) {
+        case Py_LT: result = cmp < 0; break;
+        case Py_LE: result = cmp <= 0; break;
+        case Py_EQ: result = cmp == 0; break;
+        case Py_NE: result = cmp != 0; break;
+        case Py_GT: result = cmp > 0; break;
+        default: result = cmp >= 0; break;
+    }
+    return PyBool_FromLong(result);
+}
+
+// Anything else (bytes methods, slicing, ...) works on a copy.
+PyObject *value_view_getattro(ValueViewObject *self, PyObject *name) {
+    PyObject *result =
+        PyObject_GenericGetAttr(reinterpret_cast<PyObject *>(self), name);
+    if (result || !PyErr_ExceptionMatches(PyExc_AttributeError)) {
+        return result;
+    }
+    PyErr_Clear();
+    CCPyObj bytes = CCPyObj::unchecked_steal(to_bytes(self));
+    if (!bytes.ref()) {
+        return nullptr;
+    }
+    return PyObject_GetAttr(bytes.ref(), name);
+}
+
+Py_ssize_t value_view_length(ValueViewObject *self) { return self->size; }
+
+int value_view_contains(ValueViewObject *self, PyObject *item) {
+    CCPyObj bytes = CCPyObj::unchecked_steal(to_bytes(self));
+    if (!bytes.ref()) {
+        return -1;
+    }
+    return PySequence_Contains(bytes.ref(), item);
+}
+
+PyObject *value_view_subscript(ValueViewObject *self, PyObject *key) {
+    CCPyObj bytes = CCPyObj::unchecked_steal(to_bytes(self));
+    if (!bytes.ref()) {
+        return nullptr;
+    }
+    return PyObject_GetItem(bytes.ref(), key);
+}
+
+int value_view_getbuffer(ValueViewObject *self, Py_buffer *view, int flags) {
+    return PyBuffer_FillInfo(view, reinterpret_cast<PyObject *>(self),
+                             const_cast<char *>(self->data), self->size, 1,
+                             flags);
+}
+
+//
+// Methods
+//
+
+PyObject *value_view_tobytes(ValueViewObject *self, PyObject *) {
+    return to_bytes(self);
+}
+
+PyMethodDef value_view_methods[] = {
+    {"tobytes", reinterpret_cast<PyCFunction>(&value_view_tobytes),
+     METH_NOARGS, nullptr},
+    {"__bytes__", reinterpret_cast<PyCFunction>(&value_view_tobytes),
+     METH_NOARGS, nullptr},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyType_Slot value_view_slots[] = {
+    {Py_tp_dealloc, reinterpret_cast<void *>(&value_view_dealloc)},
+    {Py_tp_repr, reinterpret_cast<void *>(&value_view_repr)},
+    {Py_tp_hash, reinterpret_cast<void *>(&value_view_hash)},
+    {Py_tp_richcompare, reinterpret_cast<void *>(&value_view_richcompare)},
+    {Py_tp_getattro, reinterpret_cast<void *>(&value_view_getattro)},
+    {Py_tp_methods, value_view_methods},
+    {Py_tp_doc, const_cast<char *>("Read-only view of an attribute value")},
+    {Py_sq_length, reinterpret_cast<void *>(&value_view_length)},
+    {Py_sq_contains, reinterpret_cast<void *>(&value_view_contains)},
+    {Py_mp_length, reinterpret_cast<void *>(&value_view_length)},
+    {Py_mp_subscript, reinterpret_cast<void *>(&value_view_subscript)},
+    {Py_bf_getbuffer, reinterpret_cast<void *>(&value_view_getbuffer)},
+    {0, nullptr},
+};
+
+PyType_Spec value_view_spec = {
+    "ValueView",
+    sizeof(ValueViewObject),
+    0,
+    kNoInstantiation,
+    value_view_slots,
+};
+
+}  // anonymous namespace
+
+void init_value_view_type() {
+    current_interpreter_state()->value_view_type =
+        CCPyObj::checked_steal(PyType_FromSpec(&value_view_spec));
+}
+
+bool value_view_get(PyObject *obj, ValueRef &ref, const void *&origin) {
+    PyObject *type = current_interpreter_state()->value_view_type.ref();
+    if (reinterpret_cast<PyObject *>(Py_TYPE(obj)) != type) {
+        return false;
+    }
+    auto self = reinterpret_cast<ValueViewObject *>(obj);
+    if (self->copy) {
+        return false;
+    }
+    ref = ValueRef{self->data, static_cast<size_t>(self->size)};
+    origin = self->origin;
+    return true;
+}
+
+//
+// ValueViews
+//
+
+PyObject *ValueViews::make(ValueRef ref, const void *origin) {
+    auto type = reinterpret_cast<PyTypeObject *>(
+        current_interpreter_state()->value_view_type.ref());
+    ValueViewObject *self = PyObject_New(ValueViewObject, type);
+    if (!self) {
+        return nullptr;
+    }
+    self->data = ref.data;
+    self->size = ref.size;
+    self->origin = origin;
+    self->copy = nullptr;
+    self->hash = -1;
+    auto obj = reinterpret_cast<PyObject *>(self);
+    views_.push_back(CCPyObj::unchecked_borrow(obj));
+    return obj;
+}
+
+void ValueViews::release() {
+    for (CCPyObj &view : views_) {
+        // Views nobody else refers to are about to go away anyway.
+        if (Py_REFCNT(view.ref()) == 1) {
+            continue;
+        }
+        auto self = reinterpret_cast<ValueViewObject *>(view.ref());
+        self->copy = PyBytes_FromStringAndSize(self->data, self->size);
+        if (!self->copy) {
+            PyErr_Clear();
+            self->copy = PyBytes_FromString("");
+        }
+        self->data = PyBytes_AS_STRING(self->copy);
+        self->origin = nullptr;
+    }
+    views_.clear();
+}
+
+}  // namespace slapo_py_update_hook
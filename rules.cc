@@ -0,0 +1,368 @@
+#include "portable.h"
+
+#include <strings.h>  // strncasecmp
+#include <time.h>
+
+#include <algorithm>  // remove_if
+#include <cctype>
+#include <fstream>
+#include <string>
+#include <utility>  // move
+#include <vector>
+
+#include "slap.h"
+
+#include "rules.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Splits a line of a rules file into words at whitespace, except within
+// double quotes, where a backslash escapes the next character. Returns false
+// if a quote is left open.
+bool split_words(const string &line, vector<string> &words) {
+    size_t i = 0;
+    while (true) {
+        while (i < line.size() &&
+               isspace(static_cast<unsigned char>(line[i]))) {
+            i++;
+        }
+        if (i == line.size()) {
+            return true;
+        }
+        string word;
+        bool quoted = false;
+        for (; i < line.size(); i++) {
+            char c = line[i];
+            if (quoted && c == '\\' && i + 1 < line.size()) {
+                word += line[++i];
+            } else if (c == '"') {
+                quoted = !quoted;
+            } else if (!quoted && isspace(static_cast<unsigned char>(c))) {
+                break;
+            } else {
+                word += c;
+            }
+        }
+        if (quoted) {
+            return false;
+        }
+        words.push_back(std::move(word));
+    }
+}
+
+string join_words(const vector<string> &words) {
+    string text;
+    for (const string &word : words) {
+        if (!text.empty()) {
+            text += ' ';
+        }
+        text += word;
+    }
+    return text;
+}
+
+ValueRef ad_name(const AttributeDescription *ad) {
+    return ValueRef{ad->ad_cname.bv_val,
+                    static_cast<size_t>(ad->ad_cname.bv_len)};
+}
+
+// Whether mod is to ad, or to a subtype of it or ad with options (such as
+// description;lang-en for description), as access controls see it.
+bool is_attr(const Modification &mod, AttributeDescription *ad) {
+    auto desc =
+        static_cast<AttributeDescription *>(const_cast<void *>(mod.desc));
+    if (!desc) {
+        BerValue bv;
+        bv.bv_len = mod.name.size;
+        bv.bv_val = const_cast<char *>(mod.name.data);
+        const char *text;
+        if (slap_bv2ad(&bv, &desc, &text) != LDAP_SUCCESS) {
+            // slapd will refuse it anyway; compare names until then.
+            ValueRef ad_ref = ad_name(ad);
+            return mod.name.size == ad_ref.size &&
+                   strncasecmp(mod.name.data, ad_ref.data, mod.name.size) ==
+                       0;
+        }
+    }
+    return desc == ad || is_ad_subtype(desc, ad);
+}
+
+// Expands $dn, $auth_dn, $now (as a GeneralizedTime) and $$ in a set rule's
+// value.
+string expand(const string &value, const ModificationOp &op) {
+    string result;
+    for (size_t i = 0; i < value.size(); i++) {
+        if (value[i] != '$') {
+            result += value[i];
+        } else if (value.compare(i, 8, "$auth_dn") == 0) {
+            result.append(op.auth_dn.data, op.auth_dn.size);
+            i += 7;
+        } else if (value.compare(i, 3, "$dn") == 0) {
+            result.append(op.dn.data, op.dn.size);
+            i += 2;
+        } else if (value.compare(i, 4, "$now") == 0) {
+            time_t now = time(nullptr);
+            struct tm tm;
+            char buf[32];
+            gmtime_r(&now, &tm);
+            result.append(buf,
+                          strftime(buf, sizeof(buf), "%Y%m%d%H%M%SZ", &tm));
+            i += 3;
+        } else if (value.compare(i, 2, "$$") == 0) {
+            result += '$';
+            i += 1;
+        } else {
+            result += '$';
+        }
+    }
+    return result;
+}
+
+}  // anonymous namespace
+
+//
+// RuleSet::Regex
+//
+
+RuleSet::Regex::Regex(Regex &&other) noexcept
+    : regex_(other.regex_), compiled_{other.compiled_} {
+    other.compiled_ = false;
+}
+
+RuleSet::Regex::~Regex() {
+    if (compiled_) {
+        regfree(&regex_);
+    }
+}
+
+bool RuleSet::Regex::compile(const string &pattern, int flags,
+                             string &error) {
+    if (compiled_) {
+        regfree(&regex_);
+        compiled_ = false;
+    }
+    int status = regcomp(&regex_, pattern.c_str(), flags | REG_EXTENDED |
+                                                       REG_NOSUB);
+    if (status != 0) {
+        char buf[256];
+        regerror(status, &regex_, buf, sizeof(buf));
+        error = buf;
+        return false;
+    }
+    compiled_ = true;
+    return true;
+}
+
+bool RuleSet::Regex::matches(ValueRef value) const {
+    // regexec needs a terminated string, which values needn't be.
+    thread_local string buf;
+    buf.assign(value.data, value.size);
+    return regexec(&regex_, buf.c_str(), 0, nullptr, 0) == 0;
+}
+
+//
+// RuleSet
+//
+
+bool RuleSet::add(const vector<string> &words, string &error) {
+    Rule rule;
+    rule.text = join_words(words);
+
+    size_t i = 0;
+    for (; i < words.size(); i++) {
+        const string &word = words[i];
+        Condition condition;
+        size_t eq = word.find('=');
+        if (eq == string::npos) {
+            break;
+        }
+        condition.negate = eq > 0 && word[eq - 1] == '!';
+        string target = word.substr(0, condition.negate ? eq - 1 : eq);
+        if (target == "dn") {
+            condition.auth_dn = false;
+        } else if (target == "auth_dn") {
+            condition.auth_dn = true;
+        } else {
+            break;
+        }
+        condition.pattern = word.substr(eq + 1);
+        rule.conditions.push_back(std::move(condition));
+    }
+
+    size_t num_args = words.size() - i;
+    string action = i < words.size() ? words[i] : "";
+    bool ok;
+    if (action == "reject") {
+        rule.action = kReject;
+        ok = num_args == 2 || num_args == 3;
+    } else if (action == "match") {
+        rule.action = kMatch;
+        ok = num_args == 3 || num_args == 4;
+    } else if (action == "strip") {
+        rule.action = kStrip;
+        ok = num_args == 2;
+    } else if (action == "set") {
+        rule.action = kSet;
+        ok = num_args == 3;
+    } else if (action == "accept") {
+        rule.action = kAccept;
+        ok = num_args == 1;
+    } else {
+        error = "unknown rule action in: " + rule.text;
+        return false;
+    }
+    if (!ok) {
+        error = "wrong number of arguments for " + action + " in: " +
+                rule.text;
+        return false;
+    }
+
+    if (num_args > 1) {
+        rule.attr_name = words[i + 1];
+    }
+    if (rule.action == kMatch || rule.action == kSet) {
+        rule.arg = words[i + 2];
+    }
+    if (rule.action == kReject && num_args == 3) {
+        rule.message = words[i + 2];
+    } else if (rule.action == kMatch && num_args == 4) {
+        rule.message = words[i + 3];
+    }
+    rules_.push_back(std::move(rule));
+    return true;
+}
+
+bool RuleSet::add_file(const string &path, string &error) {
+    std::ifstream file{path};
+    if (!file) {
+        error = "can't read " + path;
+        return false;
+    }
+    string line;
+    for (int lineno = 1; std::getline(file, line); lineno++) {
+        vector<string> words;
+        if (!split_words(line, words)) {
+            error = path + " line " + std::to_string(lineno) +
+                    ": unterminated quote";
+            return false;
+        }
+        if (words.empty() || words[0][0] == '#') {
+            continue;
+        }
+        if (!add(words, error)) {
+            error = path + " line " + std::to_string(lineno) + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RuleSet::compile(string &error) {
+    for (Rule &rule : rules_) {
+        for (Condition &condition : rule.conditions) {
+            if (!condition.regex.compile(condition.pattern, REG_ICASE,
+                                         error)) {
+                error = "py_rule: invalid regex " + condition.pattern + " (" +
+                        error + ") in: " + rule.text;
+                return false;
+            }
+        }
+        if (rule.action == kMatch &&
+            !rule.regex.compile(rule.arg, 0, error)) {
+            error = "py_rule: invalid regex " + rule.arg + " (" + error +
+                    ") in: " + rule.text;
+            return false;
+        }
+        if (!rule.attr_name.empty()) {
+            const char *text;
+            rule.ad = nullptr;
+            if (slap_str2ad(rule.attr_name.c_str(), &rule.ad, &text) !=
+                LDAP_SUCCESS) {
+                error = "py_rule: unknown attribute " + rule.attr_name +
+                        " in: " + rule.text;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool RuleSet::applies(const Rule &rule, const ModificationOp &op) const {
+    for (const Condition &condition : rule.conditions) {
+        bool matches =
+            condition.regex.matches(condition.auth_dn ? op.auth_dn : op.dn);
+        if (matches == condition.negate) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RuleSet::apply(ModificationOp &op, int &status, string &error) const {
+    for (const Rule &rule : rules_) {
+        if (!applies(rule, op)) {
+            continue;
+        }
+        AttributeDescription *ad = rule.ad;
+        switch (rule.action) {
+        case kReject:
+            for (const Modification &mod : op.mods) {
+                if (is_attr(mod, ad)) {
+                    status = LDAP_INSUFFICIENT_ACCESS;
+                    error = rule.message.empty()
+                                ? "Modification of " + rule.attr_name +
+                                      " is not allowed"
+                                : rule.message;
+                    return true;
+                }
+            }
+            break;
+        case kMatch:
+            for (const Modification &mod : op.mods) {
+                if (!is_attr(mod, ad) ||
+                    (mod.op & LDAP_MOD_OP) == LDAP_MOD_DELETE) {
+                    continue;
+                }
+                for (const Value &value : mod.values) {
+                    if (!rule.regex.matches(value.ref())) {
+                        status = LDAP_CONSTRAINT_VIOLATION;
+                        error = rule.message.empty()
+                                    ? "Invalid value for " + rule.attr_name
+                                    : rule.message;
+                        return true;
+                    }
+                }
+            }
+            break;
+        case kStrip:
+        case kSet:
+            op.mods.erase(std::remove_if(op.mods.begin(), op.mods.end(),
+                                         [ad](const Modification &mod) {
+                                             return is_attr(mod, ad);
+                                         }),
+                          op.mods.end());
+            if (rule.action == kSet) {
+                string value = expand(rule.arg, op);
+                Modification mod{op.arena};
+                mod.name = ad_name(ad);
+                mod.desc = ad;
+                mod.values.push_back(
+                    Value{ValueRef{value.data(), value.size()}, op.arena});
+                mod.op = LDAP_MOD_REPLACE;
+                mod.flags = SLAP_MOD_INTERNAL;
+                op.mods.push_back(std::move(mod));
+            }
+            break;
+        case kAccept:
+            status = LDAP_SUCCESS;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,91 @@
+#ifndef RULES_H_
+#define RULES_H_
+
+#include "portable.h"
+
+#include <regex.h>
+
+#include <string>
+#include <vector>
+
+#include "slap.h"
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+// Declarative rules (py_rule / py_rules_file) which handle common hook
+// patterns natively, before the hook is called. Rules are parsed as the
+// config is read and resolved against the schema by compile(); apply() runs
+// them in order on a ModificationOp.
+class RuleSet {
+  public:
+    RuleSet() {}
+    RuleSet(const RuleSet &) = delete;
+    void operator=(const RuleSet &) = delete;
+
+    // Adds a rule from its words. Returns false (and sets error) if it is
+    // malformed.
+    bool add(const std::vector<std::string> &words, std::string &error);
+    // Adds each rule in a file, one per line. Returns false (and sets error)
+    // if the file can't be read or a rule is malformed.
+    bool add_file(const std::string &path, std::string &error);
+    bool empty() const { return rules_.empty(); }
+
+    // Returns false (and sets error) if an attribute or regex is invalid.
+    bool compile(std::string &error);
+
+    // Runs the rules on op until one decides the outcome, rewriting its
+    // modifications as they say. Returns true if one did, setting status
+    // (and error, on failure); otherwise the hook should decide.
+    bool apply(ModificationOp &op, int &status, std::string &error) const;
+
+  private:
+    enum Action { kReject, kMatch, kStrip, kSet, kAccept };
+
+    // A compiled POSIX extended regex.
+    class Regex {
+      public:
+        Regex() : compiled_{false} {}
+        Regex(Regex &&other) noexcept;
+        Regex(const Regex &) = delete;
+        ~Regex();
+        void operator=(const Regex &) = delete;
+
+        bool compile(const std::string &pattern, int flags,
+                     std::string &error);
+        bool matches(ValueRef value) const;
+
+      private:
+        regex_t regex_;
+        bool compiled_;
+    };
+
+    // A condition on the DN (or auth DN) which limits a rule.
+    struct Condition {
+        bool auth_dn;
+        bool negate;
+        std::string pattern;
+        Regex regex;
+    };
+
+    struct Rule {
+        std::string text;  // for error messages
+        std::vector<Condition> conditions;
+        Action action;
+        std::string attr_name;
+        std::string arg;  // regex for kMatch, value for kSet
+        std::string message;
+
+        AttributeDescription *ad = nullptr;
+        Regex regex;  // for kMatch
+    };
+
+    bool applies(const Rule &rule, const ModificationOp &op) const;
+
+    std::vector<Rule> rules_;
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // RULES_H_
@@ -1,9 +1,14 @@
 #include "portable.h"
 
+#include <algorithm>  // lower_bound, sort
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>  // strtoul
 #include <cstring>  // memcpy
 #include <map>
+#include <memory>
 #include <string>
+#include <utility>  // move
 #include <vector>
 
 #include "lutil.h"
@@ -11,9 +16,20 @@
 #include "config.h"
 
 #include "slapo_py_update_hook.h"
+#include "batcher.h"
+#include "capture.h"
+#include "memo_cache.h"
+#include "file_watcher.h"
+#include "post_queue.h"
+#include "rules.h"
+#include "stats.h"
+#include "stats_monitor.h"
+#include "interest_filter.h"
+#include "worker_pool.h"
 
 using std::map;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 
 namespace slapo_py_update_hook {
@@ -26,202 +42,1115 @@ const map<string, int> py_consts{
     {"LDAP_MOD_REPLACE", LDAP_MOD_REPLACE},
 };
 
+void log_error(const string &message) {
+    Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", message.c_str());
+}
+
 namespace {
 
 //
 // Utils
 //
 
-string bv_to_string(const BerValue &src) {
-    if (src.bv_len > 0)
-        return string(src.bv_val, src.bv_len);
-    return "";
+ValueRef bv_to_ref(const BerValue &src) {
+    return ValueRef{src.bv_val, static_cast<size_t>(src.bv_len)};
+}
+
+// The returned BerValue borrows ref's bytes.
+BerValue ref_to_bv(ValueRef ref) {
+    BerValue bv;
+    bv.bv_len = ref.size;
+    bv.bv_val = const_cast<char *>(ref.data);
+    return bv;
+}
+
+// Whether value is one of the values of the modifications in mods.
+bool in_mods(const BerValue *value, const Modifications *mods) {
+    for (; mods; mods = mods->sml_next) {
+        if (mods->sml_values && value >= mods->sml_values &&
+            value < mods->sml_values + mods->sml_numvals) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void string_to_bv(const string &src, BerValue *dst) {
-    dst->bv_len = src.size();
-    if (src.empty()) {
+// Moves a value that is still borrowed from one of the dropped original
+// modifications into dst, or copies it if it came from anywhere else.
+void value_to_bv(const Value &src, BerValue *dst,
+                 const Modifications *dropped) {
+    ValueRef ref = src.ref();
+    auto origin = static_cast<BerValue *>(const_cast<void *>(src.origin()));
+    if (origin && in_mods(origin, dropped) && origin->bv_val == ref.data) {
+        *dst = *origin;
+        origin->bv_val = nullptr;
+        return;
+    }
+
+    dst->bv_len = ref.size;
+    if (ref.size == 0) {
         dst->bv_val = nullptr;
     } else {
-        dst->bv_val = static_cast<char *>(ch_malloc(src.size()));
-        memcpy(dst->bv_val, src.data(), src.size());
+        dst->bv_val = static_cast<char *>(ch_malloc(ref.size));
+        memcpy(dst->bv_val, ref.data, ref.size);
+    }
+}
+
+// Frees the dropped original modifications, minus any values value_to_bv
+// moved out.
+void free_dropped_mods(Modifications *mods) {
+    for (Modifications *mod = mods; mod; mod = mod->sml_next) {
+        if (!mod->sml_values) {
+            continue;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < mod->sml_numvals; i++) {
+            if (mod->sml_values[i].bv_val) {
+                mod->sml_values[kept++] = mod->sml_values[i];
+            }
+        }
+        BER_BVZERO(&mod->sml_values[kept]);
     }
+    slap_mods_free(mods, 1);
 }
 
+// The op borrows everything from dn, auth_dn and mods, which must outlive
+// it.
 void mod_op_from_ldap(ModificationOp &op, const BerValue &dn,
                       const BerValue &auth_dn, const Modifications *mods) {
-    op.dn = bv_to_string(dn);
-    op.auth_dn = bv_to_string(auth_dn);
+    op.dn = bv_to_ref(dn);
+    op.auth_dn = bv_to_ref(auth_dn);
 
+    size_t num_mods = 0;
     for (const Modifications *in_mod = mods; in_mod;
          in_mod = in_mod->sml_next) {
-        Modification out_mod;
+        num_mods++;
+    }
+    op.mods.reserve(num_mods);
+
+    size_t idx = 0;
+    for (const Modifications *in_mod = mods; in_mod;
+         in_mod = in_mod->sml_next) {
+        Modification out_mod{op.arena};
+        out_mod.origin = idx++;
 
         assert(in_mod->sml_desc);
-        out_mod.name = bv_to_string(in_mod->sml_desc->ad_cname);
+        out_mod.name = bv_to_ref(in_mod->sml_desc->ad_cname);
+        out_mod.desc = in_mod->sml_desc;
+        out_mod.values.reserve(in_mod->sml_numvals);
         for (size_t i = 0; i < in_mod->sml_numvals; i++) {
-            out_mod.values.push_back(bv_to_string(in_mod->sml_values[i]));
+            const BerValue &value = in_mod->sml_values[i];
+            out_mod.values.push_back(Value::borrow(bv_to_ref(value), &value));
         }
         out_mod.op = in_mod->sml_op;
         out_mod.flags = in_mod->sml_flags;
-        op.mods.push_back(out_mod);
+        op.mods.push_back(std::move(out_mod));
     }
 }
 
-void mod_op_add_entry(ModificationOp &op, const Entry &entry) {
-    for (const Attribute *in_attr = entry.e_attrs; in_attr;
-         in_attr = in_attr->a_next) {
-        const string name = bv_to_string(in_attr->a_desc->ad_cname);
-        vector<string> &attrs = op.entry[name];
-        for (size_t i = 0; i < in_attr->a_numvals; i++) {
-            attrs.push_back(bv_to_string(in_attr->a_vals[i]));
+// Returns the description of the attribute named name, unless desc is
+// already set, or nullptr with error set if there's no such attribute.
+AttributeDescription *find_desc(ValueRef name, const void *desc,
+                                string &error) {
+    auto ad = static_cast<AttributeDescription *>(const_cast<void *>(desc));
+    if (!ad) {
+        BerValue bv = ref_to_bv(name);
+        const char *text;
+        if (slap_bv2ad(&bv, &ad, &text) != LDAP_SUCCESS) {
+            error = "Invalid attribute: " + name.str();
+            return nullptr;
         }
     }
+    return ad;
 }
 
-int mod_op_to_ldap(ModificationOp &op, Modifications **mods, string &error) {
-    for (Modification &in_mod : op.mods) {
-        auto out_mod =
-            static_cast<Modifications *>(ch_calloc(1, sizeof(Modifications)));
-        *mods = out_mod;
-        mods = &out_mod->sml_next;
+// A value normalized for its attribute's equality rule, as slapd normalizes
+// those it stores. Values of attributes without a normalizer are borrowed
+// as they are.
+class NormalizedValue {
+  public:
+    NormalizedValue() : owned_{false} { BER_BVZERO(&bv_); }
+    NormalizedValue(const NormalizedValue &) = delete;
+    ~NormalizedValue() {
+        if (owned_) {
+            ch_free(bv_.bv_val);
+        }
+    }
+    void operator=(const NormalizedValue &) = delete;
+
+    // Returns false, with error set, if value isn't valid for ad.
+    bool set(AttributeDescription *ad, ValueRef value, string &error) {
+        Syntax *syntax = ad->ad_type->sat_syntax;
+        MatchingRule *mr = ad->ad_type->sat_equality;
+        BerValue in = ref_to_bv(value);
+        if (syntax->ssyn_validate &&
+            syntax->ssyn_validate(syntax, &in) != LDAP_SUCCESS) {
+            error = "Invalid value for " + bv_to_ref(ad->ad_cname).str();
+            return false;
+        }
+        if (!mr || !mr->smr_normalize) {
+            bv_ = in;
+            return true;
+        }
+        if (mr->smr_normalize(
+                SLAP_MR_EQUALITY | SLAP_MR_VALUE_OF_ATTRIBUTE_SYNTAX, syntax,
+                mr, &in, &bv_, nullptr) != LDAP_SUCCESS) {
+            error = "Unable to normalize value for " +
+                    bv_to_ref(ad->ad_cname).str();
+            return false;
+        }
+        owned_ = true;
+        return true;
+    }
+
+    BerValue &bv() { return bv_; }
+
+  private:
+    BerValue bv_;
+    bool owned_;
+};
+
+// A normalized DN, freed along with it.
+class NormalizedDn {
+  public:
+    NormalizedDn() { BER_BVZERO(&bv_); }
+    NormalizedDn(const NormalizedDn &) = delete;
+    ~NormalizedDn() { ch_free(bv_.bv_val); }
+    void operator=(const NormalizedDn &) = delete;
+
+    // Returns false, with error set, if dn isn't a valid DN.
+    bool set(ValueRef dn, string &error) {
+        BerValue in = ref_to_bv(dn);
+        if (dnNormalize(0, nullptr, nullptr, &in, &bv_, nullptr) !=
+            LDAP_SUCCESS) {
+            error = "Invalid DN: " + dn.str();
+            return false;
+        }
+        return true;
+    }
+
+    const BerValue &bv() const { return bv_; }
+
+  private:
+    BerValue bv_;
+};
+
+// Exposes an Entry's attribute chain without copying any values, through an
+// index sorted by name_less. The entry must stay locked for as long as the
+// view is in use. Its version is its entryCSN, if versioned is set (it
+// isn't kept up to date with lastmod off).
+class LdapEntryView : public EntryView {
+  public:
+    LdapEntryView(const Entry *entry, bool versioned, Arena &arena)
+        : attrs_{ArenaAllocator<const Attribute *>{arena}},
+          version_{nullptr, 0} {
+        const Attribute *first = entry ? entry->e_attrs : nullptr;
+        size_t num_attrs = 0;
+        for (const Attribute *attr = first; attr; attr = attr->a_next) {
+            num_attrs++;
+        }
+        attrs_.reserve(num_attrs);
+        for (const Attribute *attr = first; attr; attr = attr->a_next) {
+            attrs_.push_back(attr);
+        }
+        std::sort(attrs_.begin(), attrs_.end(),
+                  [](const Attribute *a, const Attribute *b) {
+                      return name_less(bv_to_ref(a->a_desc->ad_cname),
+                                       bv_to_ref(b->a_desc->ad_cname));
+                  });
+        if (versioned && first) {
+            const Attribute *csn = attr_find(const_cast<Attribute *>(first),
+                                             slap_schema.si_ad_entryCSN);
+            if (csn && csn->a_numvals == 1) {
+                version_ = bv_to_ref(csn->a_vals[0]);
+            }
+        }
+    }
+
+    size_t size() const override { return attrs_.size(); }
+
+    ValueRef name(size_t attr) const override {
+        return bv_to_ref(attrs_[attr]->a_desc->ad_cname);
+    }
+
+    size_t find(ValueRef name) const override {
+        auto it = std::lower_bound(
+            attrs_.begin(), attrs_.end(), name,
+            [](const Attribute *attr, ValueRef name) {
+                return name_less(bv_to_ref(attr->a_desc->ad_cname), name);
+            });
+        if (it != attrs_.end() &&
+            !name_less(name, bv_to_ref((*it)->a_desc->ad_cname))) {
+            return it - attrs_.begin();
+        }
+        return npos;
+    }
+
+    size_t num_values(size_t attr) const override {
+        return attrs_[attr]->a_numvals;
+    }
+
+    ValueRef value(size_t attr, size_t idx) const override {
+        return bv_to_ref(attrs_[attr]->a_vals[idx]);
+    }
+
+    ValueRef normalized_value(size_t attr, size_t idx) const override {
+        const Attribute *a = attrs_[attr];
+        return bv_to_ref(a->a_nvals ? a->a_nvals[idx] : a->a_vals[idx]);
+    }
+
+    bool normalize(size_t attr, ValueRef value, string &out) const override {
+        const Attribute *a = attrs_[attr];
+        if (a->a_nvals == a->a_vals) {
+            out.assign(value.data, value.size);
+            return true;
+        }
+        NormalizedValue norm;
+        string error;
+        if (!norm.set(a->a_desc, value, error)) {
+            return false;
+        }
+        out.assign(norm.bv().bv_val, norm.bv().bv_len);
+        return true;
+    }
+
+    const void *desc(size_t attr) const override {
+        return attrs_[attr]->a_desc;
+    }
 
+    ValueRef version() const override { return version_; }
+
+  private:
+    ArenaVector<const Attribute *> attrs_;
+    ValueRef version_;
+};
+
+// Allocates a new Modifications node for in_mod, stealing values from the
+// dropped original modifications where possible.
+int new_ldap_mod(const Modification &in_mod, const Modifications *dropped,
+                 Modifications **out, string &error) {
+    auto out_mod =
+        static_cast<Modifications *>(ch_calloc(1, sizeof(Modifications)));
+    *out = out_mod;
+
+    // Names the hook got from slapd come back with their description.
+    auto ad = static_cast<AttributeDescription *>(
+        const_cast<void *>(in_mod.desc));
+    if (!ad) {
         BerValue name;
-        name.bv_len = in_mod.name.size();
-        name.bv_val = const_cast<char *>(in_mod.name.data());
-        AttributeDescription *ad = nullptr;
+        name.bv_len = in_mod.name.size;
+        name.bv_val = const_cast<char *>(in_mod.name.data);
         const char *text;
         int status = slap_bv2ad(&name, &ad, &text);
         if (status != LDAP_SUCCESS) {
-            error = "Invalid attribute: " + in_mod.name;
+            error = "Invalid attribute: " + in_mod.name.str();
             return status;
         }
-        out_mod->sml_desc = ad;
+    }
+    out_mod->sml_desc = ad;
+
+    out_mod->sml_op = in_mod.op;
+    out_mod->sml_flags = in_mod.flags;
+    out_mod->sml_numvals = in_mod.values.size();
+    out_mod->sml_values = static_cast<BerValue *>(
+        ch_calloc(in_mod.values.size() + 1, sizeof(BerValue)));
+    for (size_t i = 0; i < in_mod.values.size(); i++) {
+        value_to_bv(in_mod.values[i], &out_mod->sml_values[i], dropped);
+    }
+    BER_BVZERO(&out_mod->sml_values[in_mod.values.size()]);
+    out_mod->sml_nvalues = nullptr;
+    return LDAP_SUCCESS;
+}
+
+// Builds the modifications slapd should apply from op, taking ownership of
+// orig_mods, which op's modifications' origins refer to. The nodes of those
+// passed through unchanged are reused as they are (normalized values
+// included) and only new modifications are allocated. On error, *mods still
+// needs to be freed.
+int mod_op_to_ldap(ModificationOp &op, Modifications *orig_mods,
+                   Modifications **mods, string &error) {
+    ArenaVector<Modifications *> originals{
+        ArenaAllocator<Modifications *>{op.arena}};
+    for (Modifications *mod = orig_mods; mod; mod = mod->sml_next) {
+        originals.push_back(mod);
+    }
+    ArenaVector<bool> reused(originals.size(), false,
+                             ArenaAllocator<bool>{op.arena});
+    for (Modification &in_mod : op.mods) {
+        if (in_mod.origin == Modification::kNew) {
+            continue;
+        } else if (in_mod.origin >= originals.size() ||
+                   reused[in_mod.origin]) {
+            in_mod.origin = Modification::kNew;
+            continue;
+        }
+        reused[in_mod.origin] = true;
+    }
 
-        out_mod->sml_op = in_mod.op;
-        out_mod->sml_flags = in_mod.flags;
-        out_mod->sml_numvals = in_mod.values.size();
-        out_mod->sml_values = static_cast<BerValue *>(
-            ch_calloc(in_mod.values.size() + 1, sizeof(BerValue)));
-        for (size_t i = 0; i < in_mod.values.size(); i++) {
-            string_to_bv(in_mod.values[i], &out_mod->sml_values[i]);
+    Modifications *dropped = nullptr;
+    Modifications **dropped_tail = &dropped;
+    for (size_t i = 0; i < originals.size(); i++) {
+        if (!reused[i]) {
+            *dropped_tail = originals[i];
+            dropped_tail = &originals[i]->sml_next;
         }
-        BER_BVZERO(&out_mod->sml_values[in_mod.values.size()]);
-        out_mod->sml_nvalues = nullptr;
     }
+    *dropped_tail = nullptr;
 
-    return LDAP_SUCCESS;
+    // After an error, reused nodes are still linked in so that they are
+    // freed along with the rest.
+    int status = LDAP_SUCCESS;
+    for (const Modification &in_mod : op.mods) {
+        if (in_mod.origin != Modification::kNew) {
+            *mods = originals[in_mod.origin];
+        } else if (status == LDAP_SUCCESS) {
+            status = new_ldap_mod(in_mod, dropped, mods, error);
+        } else {
+            continue;
+        }
+        mods = &(*mods)->sml_next;
+    }
+    *mods = nullptr;
+
+    free_dropped_mods(dropped);
+    return status;
 }
 
 //
 // Hooks
 //
 
+// Per-database state, hung off the overlay's bi_private.
+struct OverlayInfo {
+    unique_ptr<InstanceInfo> info{InstanceInfo::create()};
+    // Without py_filename, only the rules are applied.
+    bool has_filename = false;
+    // The files after the first, with their functions, until open hands
+    // them to info.
+    vector<std::pair<string, string>> pipeline;
+    // Every py_filename, for py_reload to watch.
+    vector<string> filenames;
+    bool reload = false;
+    FileWatcher watcher;
+    // Whether py_timeout or py_profile need a watchdog thread.
+    bool watchdog = false;
+    InterestFilter filter;
+    RuleSet rules;
+    bool stats_enabled = true;
+    Stats stats;
+    StatsMonitor monitor;
+    WorkerPoolConfig worker_pool;
+    BatchConfig batch;
+    MemoConfig memo;
+    unsigned long interpreters = 0;
+    string capture_path;
+    size_t capture_queue_size = 64 << 20;
+    CaptureWriter capture;
+    PostConfig post;
+    // What post_queue calls: info as it is before py_pure wraps it, since
+    // post-commit functions have side effects.
+    InstanceInfo *post_info = nullptr;
+    PostQueue post_queue;
+};
+
+OverlayInfo *get_overlay_info(BackendInfo *bi) {
+    auto on = reinterpret_cast<slap_overinst *>(bi);
+    auto overlay_info = static_cast<OverlayInfo *>(on->on_bi.bi_private);
+    assert(overlay_info);
+    return overlay_info;
+}
+
+int wrong_num_args(const string &directive, const char *fname, int lineno) {
+    Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+         "Wrong number of args for %s in %s on line %d\n", directive.c_str(),
+         fname, lineno);
+    return LDAP_PARAM_ERROR;
+}
+
+// Parses a non-negative integer config argument.
+bool parse_count(const char *arg, unsigned long &value) {
+    char *end;
+    errno = 0;
+    value = strtoul(arg, &end, 10);
+    return *arg && !*end && errno == 0 && arg[0] != '-';
+}
+
+int invalid_arg(const string &directive, const char *fname, int lineno) {
+    Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+         "Invalid value for %s in %s on line %d\n", directive.c_str(), fname,
+         lineno);
+    return LDAP_PARAM_ERROR;
+}
+
 int init_hook(BackendDB *be, ConfigReply *cr) {
     auto on = reinterpret_cast<slap_overinst *>(be->bd_info);
-    on->on_bi.bi_private = InstanceInfo::create();
+    on->on_bi.bi_private = new OverlayInfo;
     return LDAP_SUCCESS;
 }
 
 int config_hook(BackendDB *be, const char *fname, int lineno, int argc,
                 char **argv) {
-    auto on = reinterpret_cast<slap_overinst *>(be->bd_info);
-    auto info = static_cast<InstanceInfo *>(on->on_bi.bi_private);
-    assert(info);
+    OverlayInfo *overlay_info = get_overlay_info(be->bd_info);
+    InstanceInfo *info = overlay_info->info.get();
+    InterestFilter &filter = overlay_info->filter;
 
     string arg{argv[0]};
     if (arg == "py_filename") {
-        if (argc == 2) {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        if (!overlay_info->has_filename) {
             info->set_filename(argv[1]);
-            return LDAP_SUCCESS;
         } else {
-            Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-                 "Wrong number of args for py_filename in %s on line %d\n",
-                 fname, lineno);
-            return LDAP_PARAM_ERROR;
+            overlay_info->pipeline.emplace_back(argv[1], "update");
         }
+        overlay_info->filenames.push_back(argv[1]);
+        overlay_info->has_filename = true;
     } else if (arg == "py_function") {
-        if (argc == 2) {
+        // It applies to the py_filename it follows, if any.
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (overlay_info->pipeline.empty()) {
             info->set_function_name(argv[1]);
-            return LDAP_SUCCESS;
         } else {
-            Log2(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
-                 "Wrong number of args for py_function in %s on line %d\n",
-                 fname, lineno);
+            overlay_info->pipeline.back().second = argv[1];
+        }
+    } else if (arg == "py_post_function") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        overlay_info->post.function_name = argv[1];
+        info->add_function_name(argv[1]);
+    } else if (arg == "py_post_threads" || arg == "py_post_queue_size" ||
+               arg == "py_post_queue_bytes") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value) || value == 0) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        if (arg == "py_post_threads") {
+            overlay_info->post.threads = value;
+        } else if (arg == "py_post_queue_size") {
+            overlay_info->post.max_queued = value;
+        } else {
+            overlay_info->post.max_queued_bytes = value;
+        }
+    } else if (arg == "py_post_overflow") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value == "block") {
+            overlay_info->post.overflow = PostConfig::kBlock;
+        } else if (value == "drop_new") {
+            overlay_info->post.overflow = PostConfig::kDropNew;
+        } else if (value == "drop_old") {
+            overlay_info->post.overflow = PostConfig::kDropOld;
+        } else {
+            return invalid_arg(arg, fname, lineno);
+        }
+    } else if (arg == "py_post_coalesce") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value != "on" && value != "off") {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->post.coalesce = value == "on";
+    } else if (arg == "py_bytecode_cache") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        info->set_bytecode_cache(argv[1]);
+    } else if (arg == "py_share_module") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value != "on" && value != "off") {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_share_module(value == "on");
+    } else if (arg == "py_reload") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value != "on" && value != "off") {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->reload = value == "on";
+    } else if (arg == "py_timeout") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_timeout(value);
+        overlay_info->watchdog = overlay_info->watchdog || value > 0;
+    } else if (arg == "py_timeout_status") {
+        // "allow" lets the modification through as it was.
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (string{argv[1]} == "allow") {
+            value = LDAP_SUCCESS;
+        } else if (!parse_count(argv[1], value) || value == LDAP_SUCCESS ||
+                   value > LDAP_OTHER) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_timeout_status(value);
+    } else if (arg == "py_profile") {
+        unsigned long hz = 100;
+        if (argc != 2 && argc != 3) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (argc == 3 && (!parse_count(argv[2], hz) || hz == 0 ||
+                                 hz > 10000)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_profile(argv[1], hz);
+        overlay_info->watchdog = true;
+    } else if (arg == "py_attrs") {
+        if (argc < 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        for (int i = 1; i < argc; i++) {
+            filter.add_attribute(argv[i]);
+        }
+    } else if (arg == "py_subtree") {
+        if (argc < 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        for (int i = 1; i < argc; i++) {
+            filter.add_subtree(argv[i]);
+        }
+    } else if (arg == "py_objectclass") {
+        if (argc < 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        for (int i = 1; i < argc; i++) {
+            filter.add_objectclass(argv[i]);
+        }
+    } else if (arg == "py_route") {
+        if (argc != 3) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        filter.add_route(argv[1], argv[2]);
+        info->add_function_name(argv[2]);
+    } else if (arg == "py_zero_copy") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value != "on" && value != "off") {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_zero_copy(value == "on");
+    } else if (arg == "py_stats") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        string value{argv[1]};
+        if (value != "on" && value != "off") {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->stats_enabled = value == "on";
+    } else if (arg == "py_workers" || arg == "py_worker_slots" ||
+               arg == "py_worker_slot_size") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        WorkerPoolConfig &pool = overlay_info->worker_pool;
+        if ((arg == "py_workers" && value > kMaxWorkers) ||
+            (arg == "py_worker_slots" && value > kMaxWorkerSlots)) {
+            return invalid_arg(arg, fname, lineno);
+        } else if (arg == "py_workers") {
+            pool.workers = value;
+        } else if (arg == "py_worker_slots") {
+            pool.slots = value;
+        } else {
+            pool.slot_size = value;
+        }
+    } else if (arg == "py_value_set_threshold") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_value_set_threshold(value);
+    } else if (arg == "py_entry_cache") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        info->set_entry_cache_size(value);
+    } else if (arg == "py_interpreters") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->interpreters = value;
+        info->set_interpreters(value);
+    } else if (arg == "py_batch_size" || arg == "py_batch_window") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value)) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        BatchConfig &batch = overlay_info->batch;
+        if (arg == "py_batch_size") {
+            batch.max_size = value;
+        } else {
+            batch.window_us = value;
+        }
+    } else if (arg == "py_rule" || arg == "py_rules_file") {
+        string error;
+        bool ok;
+        if (arg == "py_rule") {
+            if (argc < 2) {
+                return wrong_num_args(arg, fname, lineno);
+            }
+            ok = overlay_info->rules.add(vector<string>(argv + 1, argv + argc),
+                                         error);
+        } else {
+            if (argc != 2) {
+                return wrong_num_args(arg, fname, lineno);
+            }
+            ok = overlay_info->rules.add_file(argv[1], error);
+        }
+        if (!ok) {
+            Log3(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s: %s on line %d\n",
+                 fname, error.c_str(), lineno);
             return LDAP_PARAM_ERROR;
         }
+    } else if (arg == "py_pure") {
+        // With no arguments, depend on everything but the entry.
+        unsigned inputs = argc > 1 ? 0
+                                   : MemoConfig::kDn | MemoConfig::kAuthDn |
+                                         MemoConfig::kMods;
+        for (int i = 1; i < argc; i++) {
+            string input{argv[i]};
+            if (input == "dn") {
+                inputs |= MemoConfig::kDn;
+            } else if (input == "auth_dn") {
+                inputs |= MemoConfig::kAuthDn;
+            } else if (input == "mods") {
+                inputs |= MemoConfig::kMods;
+            } else if (input == "entry") {
+                inputs |= MemoConfig::kEntry;
+            } else {
+                return invalid_arg(arg, fname, lineno);
+            }
+        }
+        overlay_info->memo.inputs = inputs;
+    } else if (arg == "py_capture") {
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        }
+        overlay_info->capture_path = argv[1];
+    } else if (arg == "py_capture_queue_size") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value) || value == 0) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->capture_queue_size = value;
+    } else if (arg == "py_pure_cache_size") {
+        unsigned long value;
+        if (argc != 2) {
+            return wrong_num_args(arg, fname, lineno);
+        } else if (!parse_count(argv[1], value) || value == 0) {
+            return invalid_arg(arg, fname, lineno);
+        }
+        overlay_info->memo.max_entries = value;
     } else {
         return SLAP_CONF_UNKNOWN;
     }
+    return LDAP_SUCCESS;
 }
 
 int open_hook(BackendDB *be, ConfigReply *cr) {
-    auto on = reinterpret_cast<slap_overinst *>(be->bd_info);
-    auto info = static_cast<InstanceInfo *>(on->on_bi.bi_private);
-    assert(info);
-    try {
-        info->open();
-    } catch (PyError &exc) {
-        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", exc.what());
+    OverlayInfo *overlay_info = get_overlay_info(be->bd_info);
+
+    string error;
+    if (!overlay_info->filter.compile(error)) {
+        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", error.c_str());
+        return LDAP_PARAM_ERROR;
+    }
+    if (!overlay_info->rules.compile(error)) {
+        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", error.c_str());
         return LDAP_PARAM_ERROR;
     }
+
+    if (overlay_info->worker_pool.workers > 0 &&
+        overlay_info->batch.max_size > 1) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_batch_size can't be combined with py_workers\n");
+        return LDAP_PARAM_ERROR;
+    }
+    if (overlay_info->worker_pool.workers > 0 &&
+        overlay_info->interpreters > 0) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_interpreters can't be combined with py_workers\n");
+        return LDAP_PARAM_ERROR;
+    }
+    // Batches run one at a time, so they would only ever use one of the
+    // interpreters.
+    if (overlay_info->interpreters > 0 && overlay_info->batch.max_size > 1) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_batch_size can't be combined with py_interpreters\n");
+        return LDAP_PARAM_ERROR;
+    }
+    if (overlay_info->worker_pool.workers > 0 && overlay_info->reload) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_reload can't be combined with py_workers\n");
+        return LDAP_PARAM_ERROR;
+    }
+    if (overlay_info->worker_pool.workers > 0 && overlay_info->watchdog) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_timeout and py_profile can't be combined with py_workers\n");
+        return LDAP_PARAM_ERROR;
+    }
+    if (!overlay_info->post.function_name.empty() &&
+        !overlay_info->has_filename) {
+        Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+             "py_post_function needs py_filename\n");
+        return LDAP_PARAM_ERROR;
+    }
+    for (const auto &file : overlay_info->pipeline) {
+        overlay_info->info->add_file(file.first, file.second);
+    }
+    // Only added once, even if the database is reopened.
+    overlay_info->pipeline.clear();
+    if (overlay_info->batch.max_size > 1) {
+        overlay_info->info.reset(create_batcher(std::move(overlay_info->info),
+                                                overlay_info->batch));
+        // Only wrap once, even if the database is reopened.
+        overlay_info->batch.max_size = 0;
+    }
+    if (overlay_info->worker_pool.workers > 0) {
+        overlay_info->info.reset(create_worker_pool(
+            std::move(overlay_info->info), overlay_info->worker_pool));
+        // Only wrap once, even if the database is reopened.
+        overlay_info->worker_pool.workers = 0;
+    }
+    if (!overlay_info->post_info) {
+        overlay_info->post_info = overlay_info->info.get();
+    }
+    if (overlay_info->memo.inputs != 0) {
+        overlay_info->info.reset(create_memo_cache(
+            std::move(overlay_info->info), overlay_info->memo));
+        // Only wrap once, even if the database is reopened.
+        overlay_info->memo.inputs = 0;
+    }
+
+    if (overlay_info->has_filename || overlay_info->rules.empty()) {
+        try {
+            overlay_info->info->open();
+        } catch (PyError &exc) {
+            Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", exc.what());
+            return LDAP_PARAM_ERROR;
+        }
+    }
+
+    if (overlay_info->reload && overlay_info->has_filename &&
+        !overlay_info->watcher.is_open()) {
+        InstanceInfo *info = overlay_info->info.get();
+        auto reload = [info] {
+            string error;
+            if (info->reload(error)) {
+                Log0(LDAP_DEBUG_ANY, LDAP_LEVEL_INFO,
+                     "py_update_hook: reloaded hook files\n");
+            } else {
+                Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR,
+                     "py_update_hook: reload failed, keeping the old "
+                     "version: %s\n",
+                     error.c_str());
+            }
+        };
+        if (!overlay_info->watcher.open(overlay_info->filenames, reload,
+                                        error)) {
+            Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", error.c_str());
+            return LDAP_OTHER;
+        }
+    }
+
+    if (!overlay_info->capture_path.empty() &&
+        !overlay_info->capture.is_open() &&
+        !overlay_info->capture.open(overlay_info->capture_path,
+                                    overlay_info->capture_queue_size, error)) {
+        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", error.c_str());
+        return LDAP_OTHER;
+    }
+
+    if (!overlay_info->post.function_name.empty() &&
+        !overlay_info->post_queue.is_open()) {
+        overlay_info->post_queue.open(overlay_info->post_info,
+                                      overlay_info->post);
+    }
+
+    if (overlay_info->stats_enabled &&
+        !overlay_info->monitor.open(be, &overlay_info->stats,
+                                    overlay_info->info.get(),
+                                    &overlay_info->capture,
+                                    &overlay_info->post_queue, error)) {
+        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", error.c_str());
+        return LDAP_OTHER;
+    }
     return LDAP_SUCCESS;
 }
 
+// Queues a successful modification for py_post_function, once it has been
+// committed, along with the entry as it now is.
+struct PostCallback {
+    slap_callback cb;  // first, so that the two can be cast
+    slap_overinst *on;
+};
+
+int post_response(Operation *op, SlapReply *rs) {
+    if (rs->sr_type != REP_RESULT || rs->sr_err != LDAP_SUCCESS) {
+        return SLAP_CB_CONTINUE;
+    }
+    auto post = reinterpret_cast<PostCallback *>(op->o_callback);
+    OverlayInfo *overlay_info =
+        get_overlay_info(reinterpret_cast<BackendInfo *>(post->on));
+
+    Entry *entry = nullptr;
+    BackendInfo *bi = op->o_bd->bd_info;
+    op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(post->on->on_info);
+    be_entry_get_rw(op, &op->o_req_ndn, nullptr, nullptr, 0, &entry);
+    {
+        ModificationOp m2;
+        mod_op_from_ldap(m2, op->o_req_ndn, op->o_authz.sai_ndn,
+                         op->orm_modlist);
+        LdapEntryView entry_view{entry, false, m2.arena};
+        m2.entry = &entry_view;
+        overlay_info->post_queue.push(m2);
+    }
+    if (entry) {
+        be_entry_release_rw(op, entry, 0);
+    }
+    op->o_bd->bd_info = bi;
+    return SLAP_CB_CONTINUE;
+}
+
+int post_cleanup(Operation *op, SlapReply *rs) {
+    auto post = reinterpret_cast<PostCallback *>(op->o_callback);
+    op->o_callback = post->cb.sc_next;
+    delete post;
+    return SLAP_CB_CONTINUE;
+}
+
 int modify_hook(Operation *op, SlapReply *rs) {
     auto on = reinterpret_cast<slap_overinst *>(op->o_bd->bd_info);
-    auto info = static_cast<InstanceInfo *>(on->on_bi.bi_private);
-    assert(info);
+    OverlayInfo *overlay_info = get_overlay_info(op->o_bd->bd_info);
+    const InterestFilter &filter = overlay_info->filter;
 
-    ModificationOp m2;
-    mod_op_from_ldap(m2, op->o_req_ndn, op->o_authz.sai_ndn, op->orm_modlist);
-    slap_mods_free(op->orm_modlist, 1);
-    op->orm_modlist = nullptr;
+    if (!filter.wants(op->o_req_ndn, op->orm_modlist)) {
+        return SLAP_CB_CONTINUE;
+    }
+    Stats::Scope stats_scope{overlay_info->stats_enabled ? &overlay_info->stats
+                                                         : nullptr};
+    Stats::Timer total_timer{Stats::kTotal};
+    Stats::add(Stats::kCalls);
 
+    // The entry stays locked while the hook runs so that its attributes can
+    // be converted lazily, only if and when the hook looks at them.
     Entry *entry = nullptr;
     op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on->on_info);
+    Stats::Timer entry_timer{Stats::kEntryFetch};
     be_entry_get_rw(op, &op->o_req_ndn, nullptr, nullptr, 0, &entry);
-    if (entry) {
-        mod_op_add_entry(m2, *entry);
-        be_entry_release_rw(op, entry, 0);
+    entry_timer.stop();
+    if (!filter.wants_entry(entry)) {
+        if (entry) {
+            be_entry_release_rw(op, entry, 0);
+        }
+        op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on);
+        return SLAP_CB_CONTINUE;
     }
     op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on);
 
-    int status;
+    // The hook's values are borrowed from the original modifications, which
+    // mod_op_to_ldap reuses (or moves values out of) where it can, so they
+    // are only freed once it is done.
+    Modifications *orig_mods = op->orm_modlist;
+    op->orm_modlist = nullptr;
+    ModificationOp m2;
+    mod_op_from_ldap(m2, op->o_req_ndn, op->o_authz.sai_ndn, orig_mods);
+    LdapEntryView entry_view{entry, !SLAP_NOLASTMOD(op->o_bd), m2.arena};
+    m2.entry = &entry_view;
+
+    // The hook is only called if no rule decides the outcome.
+    int status = LDAP_SUCCESS;
     string error;
-    try {
-        status = info->update(m2, error);
-    } catch (PyError &exc) {
-        Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", exc.what());
-        status = LDAP_OTHER;
+    bool raised = false;
+    Stats::Timer rules_timer{Stats::kRules};
+    bool decided = overlay_info->rules.apply(m2, status, error);
+    rules_timer.stop();
+    if (!decided && overlay_info->has_filename) {
+        const string *function_name = filter.route(op->o_req_ndn);
+        CaptureWriter::Record capture_record;
+        bool capturing = overlay_info->capture.begin(
+            function_name ? *function_name : string{}, m2, capture_record);
+        string exception;
+        try {
+            if (function_name) {
+                status = overlay_info->info->update(*function_name, m2, error);
+            } else {
+                status = overlay_info->info->update(m2, error);
+            }
+        } catch (PyError &exc) {
+            Log1(LDAP_DEBUG_ANY, LDAP_LEVEL_ERR, "%s\n", exc.what());
+            Stats::add(Stats::kExceptions);
+            raised = true;
+            status = LDAP_OTHER;
+            if (capturing) {
+                exception = exc.what();
+            }
+        }
+        if (capturing) {
+            overlay_info->capture.finish(
+                capture_record,
+                UpdateResult{status, raised, raised ? exception : error}, m2);
+        }
     }
-    if (status != LDAP_SUCCESS) {
+    if (status == LDAP_SUCCESS) {
+        Stats::Timer to_ldap_timer{Stats::kToLdap};
+        status = mod_op_to_ldap(m2, orig_mods, &op->orm_modlist, error);
+        if (status != LDAP_SUCCESS) {
+            slap_mods_free(op->orm_modlist, 1);
+            op->orm_modlist = nullptr;
+        }
+    } else {
+        slap_mods_free(orig_mods, 1);
+        if (!raised) {
+            Stats::add(Stats::kRejections);
+        }
+    }
+
+    // Values borrowed from the entry have been copied by now.
+    m2.entry = nullptr;
+    if (entry) {
         op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on->on_info);
-        send_ldap_error(op, rs, status, error.c_str());
-        return status;
+        be_entry_release_rw(op, entry, 0);
+        op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on);
     }
 
-    status = mod_op_to_ldap(m2, &op->orm_modlist, error);
     if (status != LDAP_SUCCESS) {
-        slap_mods_free(op->orm_modlist, 1);
-        op->orm_modlist = nullptr;
         op->o_bd->bd_info = reinterpret_cast<BackendInfo *>(on->on_info);
         send_ldap_error(op, rs, status, error.c_str());
         return status;
     }
-
+    if (overlay_info->post_queue.is_open()) {
+        auto post = new PostCallback{};
+        post->cb.sc_response = &post_response;
+        post->cb.sc_cleanup = &post_cleanup;
+        post->cb.sc_next = op->o_callback;
+        post->on = on;
+        op->o_callback = &post->cb;
+    }
     return SLAP_CB_CONTINUE;
 }
 
+int close_hook(BackendDB *be, ConfigReply *cr) {
+    OverlayInfo *overlay_info = get_overlay_info(be->bd_info);
+    overlay_info->watcher.close();
+    overlay_info->monitor.close();
+    overlay_info->post_queue.close();
+    overlay_info->capture.close();
+    return LDAP_SUCCESS;
+}
+
 int destroy_hook(BackendDB *be, ConfigReply *cr) {
     auto on = reinterpret_cast<slap_overinst *>(be->bd_info);
-    auto info = static_cast<InstanceInfo *>(on->on_bi.bi_private);
-    delete info;
+    delete static_cast<OverlayInfo *>(on->on_bi.bi_private);
     on->on_bi.bi_private = nullptr;
     return LDAP_SUCCESS;
 }
 
 }  // anonymous namespace
+
+//
+// Matching
+//
+
+bool normalize_value(ValueRef name, const void *desc, ValueRef value,
+                     string &out, string &error) {
+    AttributeDescription *ad = find_desc(name, desc, error);
+    NormalizedValue norm;
+    if (!ad || !norm.set(ad, value, error)) {
+        return false;
+    }
+    out.assign(norm.bv().bv_val, norm.bv().bv_len);
+    return true;
+}
+
+bool equality_match(ValueRef name, const void *desc, ValueRef a, ValueRef b,
+                    bool &match, string &error) {
+    AttributeDescription *ad = find_desc(name, desc, error);
+    if (!ad) {
+        return false;
+    }
+    MatchingRule *mr = ad->ad_type->sat_equality;
+    if (!mr) {
+        error = "No equality matching rule for " +
+                bv_to_ref(ad->ad_cname).str();
+        return false;
+    }
+    NormalizedValue norm_a, norm_b;
+    if (!norm_a.set(ad, a, error) || !norm_b.set(ad, b, error)) {
+        return false;
+    }
+    int result;
+    const char *text = nullptr;
+    if (value_match(&result, ad, mr,
+                    SLAP_MR_EQUALITY | SLAP_MR_VALUE_OF_ATTRIBUTE_SYNTAX |
+                        SLAP_MR_VALUE_NORMALIZED_MATCH,
+                    &norm_a.bv(), &norm_b.bv(), &text) != LDAP_SUCCESS) {
+        error = "Unable to match values of " + bv_to_ref(ad->ad_cname).str();
+        if (text) {
+            error += string{": "} + text;
+        }
+        return false;
+    }
+    match = result == 0;
+    return true;
+}
+
+bool dn_normalize(ValueRef dn, string &out, string &error) {
+    NormalizedDn ndn;
+    if (!ndn.set(dn, error)) {
+        return false;
+    }
+    out.assign(ndn.bv().bv_val, ndn.bv().bv_len);
+    return true;
+}
+
+bool dn_is_descendant(ValueRef dn, ValueRef base, bool &descendant,
+                      string &error) {
+    NormalizedDn ndn, nbase;
+    if (!ndn.set(dn, error) || !nbase.set(base, error)) {
+        return false;
+    }
+    // dnIsSuffix doesn't take the root DSE as a suffix of everything.
+    descendant = ndn.bv().bv_len > nbase.bv().bv_len &&
+                 (nbase.bv().bv_len == 0 || dnIsSuffix(&ndn.bv(), &nbase.bv()));
+    return true;
+}
+
 }  // namespace slapo_py_update_hook
 
 extern "C" int init_module(int argc, char *argv[]) {
@@ -238,6 +1167,7 @@ extern "C" int init_module(int argc, char *argv[]) {
     overlay.on_bi.bi_db_init = &slapo_py_update_hook::init_hook;
     overlay.on_bi.bi_db_config = &slapo_py_update_hook::config_hook;
     overlay.on_bi.bi_db_open = &slapo_py_update_hook::open_hook;
+    overlay.on_bi.bi_db_close = &slapo_py_update_hook::close_hook;
     overlay.on_bi.bi_op_modify = &slapo_py_update_hook::modify_hook;
     overlay.on_bi.bi_db_destroy = &slapo_py_update_hook::destroy_hook;
     return overlay_register(&overlay);
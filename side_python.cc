@@ -1,95 +1,682 @@
 #include <Python.h>
+#include <marshal.h>
+#include <unistd.h>  // getpid, unlink
 
+#include <algorithm>  // find, max, min
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "slapo_py_update_hook.h"
 #include "cc_py_obj.h"
+#include "py_profile.h"
+#include "py_types.h"
+#include "stats.h"
 
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace slapo_py_update_hook {
 namespace {
 
-CCPyObj op_type;
-CCPyObj mod_type;
+const int kLdapBusy = 0x33;  // LDAP_BUSY
 
-class GilHolder {
+// Never destroyed, since its objects can't be released without the GIL once
+// the process is exiting.
+InterpreterState &main_state = *new InterpreterState;
+
+// A subinterpreter with its own GIL. They are never destroyed, since that
+// needs every thread which has used one to be gone first, and slapd only
+// stops its threads when it exits.
+struct SubInterpreter {
+    PyInterpreterState *interp;
+    InterpreterState state;
+};
+
+// The calling thread's thread state for each subinterpreter it has used,
+// kept for as long as the thread lives.
+thread_local vector<std::pair<PyInterpreterState *, PyThreadState *>>
+    thread_states;
+
+PyThreadState *thread_state_for(PyInterpreterState *interp) {
+    for (const auto &entry : thread_states) {
+        if (entry.first == interp) {
+            return entry.second;
+        }
+    }
+    PyThreadState *tstate = PyThreadState_New(interp);
+    if (!tstate) {
+        throw PyError{"Unable to create a Python thread state"};
+    }
+    thread_states.emplace_back(interp, tstate);
+    return tstate;
+}
+
+// Whether the calling thread has its main interpreter thread state pinned.
+// PyGILState_Release destroys the one PyGILState_Ensure made for a thread
+// Python didn't start, frame stack and all, which the next call would then
+// have to allocate again. An extra PyGILState_Ensure, never released, keeps
+// it for as long as the thread lives, as thread_states does for
+// subinterpreters.
+thread_local bool main_thread_state_pinned = false;
+
+// Holds the GIL of the main interpreter, or of a subinterpreter, and makes
+// its InterpreterState current, for as long as it lives. A thread may only
+// hold one at a time.
+class InterpreterLock {
   public:
-    GilHolder() : state_(PyGILState_Ensure()) {}
-    GilHolder(const GilHolder &) = delete;
-    ~GilHolder() { PyGILState_Release(state_); }
-    void operator=(const GilHolder &) = delete;
+    explicit InterpreterLock(SubInterpreter *sub = nullptr)
+        : tstate_{nullptr} {
+        if (sub) {
+            tstate_ = thread_state_for(sub->interp);
+            PyEval_RestoreThread(tstate_);
+            set_current_interpreter_state(&sub->state);
+        } else {
+            gil_state_ = PyGILState_Ensure();
+            if (!main_thread_state_pinned) {
+                PyGILState_Ensure();
+                main_thread_state_pinned = true;
+            }
+            set_current_interpreter_state(&main_state);
+        }
+    }
+    InterpreterLock(const InterpreterLock &) = delete;
+    ~InterpreterLock() {
+        if (tstate_) {
+            PyEval_SaveThread();
+        } else {
+            PyGILState_Release(gil_state_);
+        }
+        set_current_interpreter_state(nullptr);
+    }
+    void operator=(const InterpreterLock &) = delete;
 
   private:
-    PyGILState_STATE state_;
+    PyThreadState *tstate_;  // only for subinterpreters
+    PyGILState_STATE gil_state_;
+};
+
+// Fills in the current InterpreterState.
+void init_interpreter_state() {
+    register_interpreter_state(current_interpreter_state());
+    init_cc_py_obj();
+    init_attr_names();
+    init_value_view_type();
+    init_entry_view_type();
+    init_value_set_type();
+    init_mod_types();
+    // A BaseException, so that hooks which catch Exception don't swallow it.
+    current_interpreter_state()->timeout_type =
+        CCPyObj::checked_steal(PyErr_NewException(
+            "update_hook.HookTimeout", PyExc_BaseException, nullptr));
+}
+
+SubInterpreter *create_subinterpreter() {
+#if PY_VERSION_HEX >= 0x030C0000
+    InterpreterLock main_lock;
+    PyThreadState *main_tstate = PyThreadState_Get();
+
+    // Isolated enough to have its own GIL: extension modules which don't
+    // support that can't be imported.
+    PyInterpreterConfig config;
+    memset(&config, 0, sizeof(config));
+    config.allow_threads = 1;
+    config.check_multi_interp_extensions = 1;
+    config.gil = PyInterpreterConfig_OWN_GIL;
+    PyThreadState *tstate = nullptr;
+    PyThreadState_Swap(nullptr);
+    PyStatus status = Py_NewInterpreterFromConfig(&tstate, &config);
+    if (PyStatus_Exception(status)) {
+        PyThreadState_Swap(main_tstate);
+        throw PyError{string{"Unable to create subinterpreter: "} +
+                      (status.err_msg ? status.err_msg : "unknown error")};
+    }
+
+    // Its first thread state is kept for this thread to use later.
+    auto sub = new SubInterpreter{PyThreadState_GetInterpreter(tstate), {}};
+    thread_states.emplace_back(sub->interp, tstate);
+    set_current_interpreter_state(&sub->state);
+    try {
+        init_interpreter_state();
+    } catch (PyError &) {
+        PyThreadState_Swap(main_tstate);
+        throw;
+    }
+    PyThreadState_Swap(main_tstate);
+    return sub;
+#else
+    throw PyError{"py_interpreters needs Python 3.12 or later"};
+#endif
+}
+
+// Watches hook calls from a thread of its own. It interrupts those which
+// overrun py_timeout, by raising HookTimeout in their thread. That needs the
+// interpreter's GIL, which a thread running Python code gives up every few
+// ms; one in C code which holds on to it is only interrupted once it is
+// back in Python code.
+//
+// For py_profile, it ticks a counter instead, and the calls' own threads
+// sample their stacks, from a profile function, whenever they see that it
+// has moved on. Sampling from the watchdog would only work for calls long
+// enough to be made to give up the GIL.
+class Watchdog {
+  public:
+    // Watches a call from construction until end() or destruction, with
+    // the GIL held throughout.
+    class Call {
+      public:
+        // A timeout of 0 means none.
+        Call(Watchdog *watchdog, SubInterpreter *interp,
+             const std::string &function_name,
+             std::chrono::milliseconds timeout);
+        Call(const Call &) = delete;
+        ~Call() { end(); }
+        void operator=(const Call &) = delete;
+
+        // Returns whether HookTimeout was raised. If it is still pending, it
+        // never will be.
+        bool end();
+
+      private:
+        friend class Watchdog;
+
+        Watchdog *watchdog_;  // nullptr once ended
+        uint64_t id_;
+        std::chrono::steady_clock::time_point deadline_;
+        SubInterpreter *interp_;
+        unsigned long thread_id_;
+        bool timed_out_;
+        const std::string *function_name_;
+        uint64_t seen_tick_;  // for py_profile
+    };
+
+    // Without a profile_path, stacks aren't sampled.
+    Watchdog(const std::string &profile_path, unsigned profile_hz);
+    Watchdog(const Watchdog &) = delete;
+    ~Watchdog();
+    void operator=(const Watchdog &) = delete;
+
+    uint64_t samples() const { return stacks_.samples(); }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    static int profile_func(PyObject *obj, PyFrameObject *frame, int what,
+                            PyObject *arg);
+    bool profiling() const { return !profile_path_.empty(); }
+    void run();
+    // Takes the call's GIL, so is called with lock (of mutex_) held, and
+    // releases it meanwhile.
+    void interrupt(std::unique_lock<std::mutex> &lock, Call *call);
+    void write_profile();
+
+    // The call being profiled in this thread, if any.
+    static thread_local Call *profiled_call_;
+
+    std::string profile_path_;
+    Clock::duration tick_interval_;
+    std::atomic<uint64_t> tick_;
+    FoldedStacks stacks_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    uint64_t next_id_;
+    // Only those with deadlines.
+    std::vector<Call *> calls_;
+    bool stopping_;
+    std::thread thread_;
 };
 
+thread_local Watchdog::Call *Watchdog::profiled_call_ = nullptr;
+
+// How often py_profile's file is rewritten.
+const std::chrono::seconds kProfileWriteInterval{10};
+
+Watchdog::Call::Call(Watchdog *watchdog, SubInterpreter *interp,
+                     const string &function_name,
+                     std::chrono::milliseconds timeout)
+    : watchdog_{watchdog}, timed_out_{false} {
+    if (!watchdog_) {
+        return;
+    }
+    if (watchdog_->profiling()) {
+        function_name_ = &function_name;
+        seen_tick_ = watchdog_->tick_.load(std::memory_order_relaxed);
+        profiled_call_ = this;
+        // Left in place afterwards, since setting it is costly, and it
+        // does nothing outside calls.
+        if (PyThreadState_Get()->c_profilefunc != &Watchdog::profile_func) {
+            PyEval_SetProfile(&Watchdog::profile_func, nullptr);
+        }
+    }
+    if (timeout.count() == 0) {
+        return;
+    }
+
+    deadline_ = Clock::now() + timeout;
+    interp_ = interp;
+    thread_id_ = PyThread_get_thread_ident();
+    // The watchdog sleeps until the earliest deadline.
+    bool earliest = true;
+    {
+        std::lock_guard<std::mutex> lock{watchdog_->mutex_};
+        id_ = watchdog_->next_id_++;
+        for (Call *call : watchdog_->calls_) {
+            if (!call->timed_out_ && call->deadline_ <= deadline_) {
+                earliest = false;
+            }
+        }
+        watchdog_->calls_.push_back(this);
+    }
+    if (earliest) {
+        watchdog_->cond_.notify_one();
+    }
+}
+
+bool Watchdog::Call::end() {
+    if (!watchdog_) {
+        return timed_out_;
+    }
+    if (profiled_call_ == this) {
+        profiled_call_ = nullptr;
+    }
+    std::lock_guard<std::mutex> lock{watchdog_->mutex_};
+    vector<Call *> &calls = watchdog_->calls_;
+    for (size_t i = 0; i < calls.size(); i++) {
+        if (calls[i] == this) {
+            calls[i] = calls.back();
+            calls.pop_back();
+            break;
+        }
+    }
+    if (timed_out_) {
+        PyThreadState_SetAsyncExc(thread_id_, nullptr);
+    }
+    watchdog_ = nullptr;
+    return timed_out_;
+}
+
+Watchdog::Watchdog(const string &profile_path, unsigned profile_hz)
+    : profile_path_(profile_path),
+      tick_interval_{Clock::duration{std::chrono::seconds{1}} /
+                     std::max(profile_hz, 1u)},
+      tick_{0},
+      next_id_{1},
+      stopping_{false},
+      thread_{&Watchdog::run, this} {}
+
+Watchdog::~Watchdog() {
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+        stopping_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    if (profiling()) {
+        write_profile();
+    }
+}
+
+// Called by Python as functions are called and return. Each tick which
+// passed since the call last looked is counted against its stack as it now
+// is, so time spent in C code (or waiting for the GIL) isn't lost.
+// static
+int Watchdog::profile_func(PyObject *obj, PyFrameObject *frame, int what,
+                           PyObject *arg) {
+    Call *call = profiled_call_;
+    if (!call) {
+        return 0;
+    }
+    uint64_t tick = call->watchdog_->tick_.load(std::memory_order_relaxed);
+    if (tick != call->seen_tick_) {
+        call->watchdog_->stacks_.add(frame, *call->function_name_,
+                                     tick - call->seen_tick_);
+        call->seen_tick_ = tick;
+    }
+    return 0;
+}
+
+void Watchdog::run() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    Clock::time_point next_tick = Clock::now() + tick_interval_;
+    Clock::time_point next_write = Clock::now() + kProfileWriteInterval;
+    while (!stopping_) {
+        Call *next = nullptr;
+        for (Call *call : calls_) {
+            if (!call->timed_out_ &&
+                (!next || call->deadline_ < next->deadline_)) {
+                next = call;
+            }
+        }
+        Clock::time_point now = Clock::now();
+        if (next && next->deadline_ <= now) {
+            interrupt(lock, next);
+            continue;
+        } else if (profiling() && next_tick <= now) {
+            tick_.fetch_add(1, std::memory_order_relaxed);
+            next_tick += tick_interval_;
+            continue;
+        } else if (profiling() && next_write <= now) {
+            lock.unlock();
+            write_profile();
+            lock.lock();
+            next_write = now + kProfileWriteInterval;
+            continue;
+        }
+
+        Clock::time_point wake = Clock::time_point::max();
+        if (next) {
+            wake = next->deadline_;
+        }
+        if (profiling()) {
+            wake = std::min(wake, std::min(next_tick, next_write));
+        }
+        if (wake == Clock::time_point::max()) {
+            cond_.wait(lock);
+        } else {
+            cond_.wait_until(lock, wake);
+        }
+    }
+}
+
+void Watchdog::interrupt(std::unique_lock<std::mutex> &lock, Call *call) {
+    // The GIL is taken without mutex_, which calls take to end with the GIL
+    // held. The call may have ended in the meantime.
+    uint64_t id = call->id_;
+    SubInterpreter *interp = call->interp_;
+    lock.unlock();
+    {
+        InterpreterLock gil{interp};
+        std::lock_guard<std::mutex> relock{mutex_};
+        for (Call *call : calls_) {
+            if (call->id_ == id) {
+                PyThreadState_SetAsyncExc(
+                    call->thread_id_,
+                    current_interpreter_state()->timeout_type.ref());
+                call->timed_out_ = true;
+            }
+        }
+    }
+    lock.lock();
+}
+
+void Watchdog::write_profile() {
+    string error;
+    if (!stacks_.write(profile_path_, error)) {
+        log_error(error);
+    }
+}
+
+// Detaches the entry views of ops from the underlying entries once the
+// update call is over, since the hook may hold on to them.
+class EntryViewReleaser {
+  public:
+    EntryViewReleaser() {}
+    EntryViewReleaser(const EntryViewReleaser &) = delete;
+    ~EntryViewReleaser() {
+        for (CCPyObj &py_entry : py_entries_) {
+            entry_view_release(py_entry);
+        }
+    }
+    void operator=(const EntryViewReleaser &) = delete;
+
+    void add(CCPyObj &py_op) {
+        py_entries_.push_back(
+            CCPyObj::checked_borrow(PyTuple_GET_ITEM(py_op.ref(), 2)));
+    }
+
+  private:
+    vector<CCPyObj> py_entries_;
+};
+
+// The Python objects handed to the hook for the original modifications, kept
+// so that mod_op_from_python can tell which ones the hook left alone.
+struct ModsSnapshot {
+    CCPyObj mods;    // tuple of the original Modification objects
+    CCPyObj values;  // tuple of all of their values, in order
+};
+
+// DNs (and attribute names) are handed to the hook as str, and values as
+// bytes.
+CCPyObj str_obj(ValueRef ref) {
+    return CCPyObj::checked_steal(
+        PyUnicode_FromStringAndSize(ref.data, ref.size));
+}
+
+// Returns the bytes of a bytes object, or the UTF-8 encoding of a str,
+// which are only valid while obj is alive.
+ValueRef str_ref(PyObject *obj) {
+    if (PyBytes_Check(obj)) {
+        return ValueRef{PyBytes_AS_STRING(obj),
+                        static_cast<size_t>(PyBytes_GET_SIZE(obj))};
+    } else if (PyUnicode_Check(obj)) {
+        Py_ssize_t size;
+        const char *data = PyUnicode_AsUTF8AndSize(obj, &size);
+        if (data) {
+            return ValueRef{data, static_cast<size_t>(size)};
+        }
+        CCPyObj::checked_steal(nullptr);  // throws the encoding error
+    }
+    CCPyObj repr = CCPyObj::checked_steal(PyObject_Repr(obj));
+    throw PyError{"Cannot cast " + static_cast<string>(repr) +
+                  " to str or bytes"};
+}
+
 }  // anonymous namespace
 
 //
 // ModificationOp
 //
 
-CCPyObj mod_op_to_python(ModificationOp &op) {
-    CCPyObj py_entry = CCPyObj::checked_steal(PyDict_New());
-    for (const auto &name_values : op.entry) {
-        CCPyObj values = CCPyObj::checked_steal(PyList_New(0));
-        for (const string &value : name_values.second) {
-            CCPyObj py_value{value};
-            PyList_Append(values.ref(), py_value.ref());
+CCPyObj mod_op_to_python(ModificationOp &op, ValueViews *value_views,
+                         EntryValueCache &entry_values,
+                         size_t value_set_threshold,
+                         ModsSnapshot &snapshot) {
+    CCPyObj py_entry;
+    if (op.entry) {
+        CCPyObj cached;
+        if (!value_views) {
+            cached = entry_values.get(op.dn, *op.entry);
         }
-        CCPyObj py_name{name_values.first};
-        PyDict_SetItem(py_entry.ref(), py_name.ref(), values.ref());
+        py_entry = entry_view_new(op.entry, value_views, cached.ref(),
+                                  value_set_threshold);
+    } else {
+        py_entry = CCPyObj::checked_steal(PyDict_New());
     }
 
-    CCPyObj py_mods = CCPyObj::checked_steal(PyList_New(0));
+    size_t total_values = 0;
     for (const Modification &mod : op.mods) {
-        CCPyObj py_values = CCPyObj::checked_steal(PyList_New(0));
-        for (const string &value : mod.values) {
-            CCPyObj py_value{value};
-            PyList_Append(py_values.ref(), py_value.ref());
+        total_values += mod.values.size();
+    }
+    snapshot.mods = CCPyObj::checked_steal(PyTuple_New(op.mods.size()));
+    snapshot.values = CCPyObj::checked_steal(PyTuple_New(total_values));
+
+    CCPyObj py_mods = CCPyObj::checked_steal(PyList_New(op.mods.size()));
+    size_t value_idx = 0;
+    for (size_t i = 0; i < op.mods.size(); i++) {
+        const Modification &mod = op.mods[i];
+        CCPyObj py_values =
+            CCPyObj::checked_steal(PyList_New(mod.values.size()));
+        for (size_t j = 0; j < mod.values.size(); j++) {
+            const Value &value = mod.values[j];
+            ValueRef ref = value.ref();
+            CCPyObj py_value = CCPyObj::checked_steal(
+                value_views && value.borrowed()
+                    ? value_views->make(ref, value.origin())
+                    : PyBytes_FromStringAndSize(ref.data, ref.size));
+            PyList_SET_ITEM(py_values.ref(), j, py_value.new_ref());
+            PyTuple_SET_ITEM(snapshot.values.ref(), value_idx++,
+                             py_value.release());
         }
 
-        CCPyObj py_mod = mod_type(mod.name, py_values, mod.op, mod.flags);
-        PyList_Append(py_mods.ref(), py_mod.ref());
+        CCPyObj py_name =
+            CCPyObj::checked_steal(attr_name_new(mod.name, mod.desc));
+        CCPyObj py_mod = modification_new(std::move(py_name),
+                                          std::move(py_values), mod.op,
+                                          mod.flags);
+        PyList_SET_ITEM(py_mods.ref(), i, py_mod.new_ref());
+        PyTuple_SET_ITEM(snapshot.mods.ref(), i, py_mod.release());
+    }
+
+    return modification_op_new(str_obj(op.dn), str_obj(op.auth_dn),
+                               std::move(py_entry), std::move(py_mods));
+}
+
+// Returns the index of py_mod among the original modifications, or
+// Modification::kNew. Hooks rarely reorder modifications, so hint (the one
+// after the last match) is checked first.
+size_t find_original(ModsSnapshot &snapshot, PyObject *py_mod,
+                     size_t hint) {
+    PyObject *originals = snapshot.mods.ref();
+    size_t num_originals = PyTuple_GET_SIZE(originals);
+    if (hint < num_originals && PyTuple_GET_ITEM(originals, hint) == py_mod) {
+        return hint;
+    }
+    for (size_t i = 0; i < num_originals; i++) {
+        if (PyTuple_GET_ITEM(originals, i) == py_mod) {
+            return i;
+        }
     }
+    return Modification::kNew;
+}
 
-    return op_type(op.dn, op.auth_dn, py_entry, py_mods);
+// Whether the values list of an original Modification still holds exactly
+// the objects it was created with, starting at first in the snapshot.
+bool values_unchanged(ModsSnapshot &snapshot, PyObject *py_mod,
+                      size_t first, size_t num_values) {
+    PyObject *values = PyTuple_GET_ITEM(py_mod, 1);
+    if (!PyList_CheckExact(values) ||
+        static_cast<size_t>(PyList_GET_SIZE(values)) != num_values) {
+        return false;
+    }
+    for (size_t i = 0; i < num_values; i++) {
+        if (PyList_GET_ITEM(values, i) !=
+            PyTuple_GET_ITEM(snapshot.values.ref(), first + i)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void mod_op_from_python(ModificationOp &op, CCPyObj py_op) {
-    op.mods.clear();
+void mod_op_from_python(ModificationOp &op, CCPyObj py_op,
+                        ModsSnapshot &snapshot) {
+    // py_op is always one of ours, so its fields can be read directly.
+    CCPyObj mods = CCPyObj::checked_steal(PySequence_Fast(
+        PyTuple_GET_ITEM(py_op.ref(), 3), "modifications must be a list"));
+    Py_ssize_t num_mods = PySequence_Fast_GET_SIZE(mods.ref());
 
-    CCPyObj mods = py_op.attr("modifications");
-    Py_ssize_t num_mods = mods.size();
+    // Where each original modification's values start in the snapshot, or
+    // kNew once it has been passed through.
+    ArenaVector<size_t> first_value(op.mods.size(), 0,
+                                    ArenaAllocator<size_t>{op.arena});
+    for (size_t i = 0, first = 0; i < op.mods.size(); i++) {
+        first_value[i] = first;
+        first += op.mods[i].values.size();
+    }
+
+    ArenaVector<Modification> out_mods{ArenaAllocator<Modification>{op.arena}};
+    out_mods.reserve(num_mods);
+    size_t hint = 0;
     for (Py_ssize_t i = 0; i < num_mods; i++) {
-        CCPyObj py_mod = mods.item(i);
-        if (py_mod.size() != 4) {
+        PyObject *item = PySequence_Fast_GET_ITEM(mods.ref(), i);
+
+        // Modifications the hook left alone are passed through as they
+        // were, without converting them back.
+        size_t orig = find_original(snapshot, item, hint);
+        if (orig != Modification::kNew &&
+            first_value[orig] != Modification::kNew &&
+            values_unchanged(snapshot, item, first_value[orig],
+                             op.mods[orig].values.size())) {
+            first_value[orig] = Modification::kNew;
+            out_mods.push_back(std::move(op.mods[orig]));
+            hint = orig + 1;
+            continue;
+        }
+
+        // Modifications and plain tuples come back as themselves.
+        CCPyObj py_mod = CCPyObj::checked_steal(
+            PySequence_Fast(item, "modifications must contain sequences"));
+        if (PySequence_Fast_GET_SIZE(py_mod.ref()) != 4) {
             throw PyError{"Invalid modification (mods should only contain "
                           "len-4-tuples or "
-                          "Modification namedtuples)"};
+                          "Modification objects)"};
+        }
+        PyObject **fields = PySequence_Fast_ITEMS(py_mod.ref());
+
+        Modification mod{op.arena};
+
+        mod.name = copy_ref(str_ref(fields[0]), op.arena);
+        mod.desc = attr_name_desc(fields[0]);
+
+        CCPyObj values = CCPyObj::checked_steal(
+            PySequence_Fast(fields[1], "values must be a sequence"));
+        Py_ssize_t num_values = PySequence_Fast_GET_SIZE(values.ref());
+        mod.values.reserve(num_values);
+        for (Py_ssize_t j = 0; j < num_values; j++) {
+            PyObject *value = PySequence_Fast_GET_ITEM(values.ref(), j);
+            // Values the hook passed through untouched still refer to
+            // slapd's memory, so there's no need to copy them.
+            ValueRef ref;
+            const void *origin;
+            if (value_view_get(value, ref, origin)) {
+                mod.values.push_back(Value::borrow(ref, origin));
+            } else {
+                mod.values.emplace_back(str_ref(value), op.arena);
+            }
         }
 
-        Modification mod;
+        mod.op = CCPyObj::checked_borrow(fields[2]);
+        mod.flags = CCPyObj::checked_borrow(fields[3]);
+        out_mods.push_back(std::move(mod));
+    }
 
-        mod.name = static_cast<string>(py_mod.item(0));
+    op.mods.swap(out_mods);
+}
 
-        CCPyObj values = py_mod.item(1);
-        CCPyObj iterator =
-            CCPyObj::checked_steal(PyObject_GetIter(values.ref()));
-        CCPyObj item;
-        while ((item = CCPyObj::unchecked_steal(PyIter_Next(iterator.ref())))
-                   .ref() != nullptr) {
-            mod.values.push_back(item);
+// The number of bytes in op's values (and names, and DNs), or only in
+// those of its new modifications, for Stats.
+uint64_t op_bytes(const ModificationOp &op, bool new_only) {
+    uint64_t bytes = new_only ? 0 : op.dn.size + op.auth_dn.size;
+    for (const Modification &mod : op.mods) {
+        if (new_only && mod.origin != Modification::kNew) {
+            continue;
         }
+        bytes += mod.name.size;
+        for (const Value &value : mod.values) {
+            bytes += value.ref().size;
+        }
+    }
+    return bytes;
+}
 
-        mod.op = py_mod.item(2);
-        mod.flags = py_mod.item(3);
-        op.mods.push_back(mod);
+// Handles what the hook returned for op: None, or (status, error). Unless
+// it is an error, op's modifications are updated from py_op.
+int handle_result(CCPyObj result, ModificationOp &op, CCPyObj py_op,
+                  ModsSnapshot &snapshot, string &error) {
+    if (result.ref() != Py_None) {
+        if (result.size() != 2) {
+            throw PyError{"Result must be None or (int, str)"};
+        }
+        int status = result.item(0);
+        if (status != 0) {
+            error = static_cast<string>(result.item(1));
+            return status;
+        }
     }
+
+    mod_op_from_python(op, py_op, snapshot);
+    return 0;  // LDAP_SUCCESS
 }
 
 //
@@ -98,107 +685,747 @@ void mod_op_from_python(ModificationOp &op, CCPyObj py_op) {
 
 void init_python() {
     Py_InitializeEx(0);
-    PyEval_InitThreads();
     PyEval_SaveThread();
-    GilHolder gil_holder;
-
-    init_cc_py_obj();
-
-    // Ideally we'd use PyImport_ImportModule and PyObject_CallMethod or
-    // PyObject_CallMethodObjArgs, but the namedtuple function looks at the
-    // caller's stack frame, which wouldn't exist and would raise an exception.
-    CCPyObj globals = CCPyObj::checked_steal(PyDict_New());
-    PyDict_SetItemString(globals.ref(), "__builtins__", PyEval_GetBuiltins());
-    CCPyObj locals = CCPyObj::checked_steal(PyDict_New());
+    InterpreterLock lock;
+    init_interpreter_state();
+}
 
-    CCPyObj::checked_steal(
-        PyRun_String("import collections\n"
-                     "op_type = collections.namedtuple(\n"
-                     "'ModificationOp', 'dn,auth_dn,entry,modifications')\n"
-                     "mod_type = collections.namedtuple(\n"
-                     "'Modification', 'name,values,op,flags')\n",
-                     Py_file_input, globals.ref(), locals.ref()));
-    op_type = locals.item("op_type");
-    mod_type = locals.item("mod_type");
+pid_t fork_interpreter() {
+    // Like os.fork, hold the GIL across the fork so that the child's
+    // interpreter is in a consistent state.
+    InterpreterLock lock;
+    PyOS_BeforeFork();
+    pid_t pid = fork();
+    if (pid == 0) {
+        PyOS_AfterFork_Child();
+    } else {
+        PyOS_AfterFork_Parent();
+    }
+    return pid;
 }
 
 //
 // InstanceInfo
 //
 
+// A hook file after the first; see InstanceInfo::add_file.
+struct PipelineFile {
+    std::string filename;
+    std::string function_name;
+};
+
+// The hook files as loaded into one interpreter. A reload replaces them as
+// a whole, while calls already running carry on with the ones they started
+// with.
+struct LoadedModules {
+    CCPyObj module;
+    // The default function's name with "_batch" appended, if the hook
+    // defines it (and there is only one file).
+    std::string batch_function_name;
+    // The modules of the files after the first.
+    std::vector<CCPyObj> pipeline;
+};
+
+struct LoadedHook {
+    SubInterpreter *interp;  // nullptr for the main interpreter
+    // Only changed, or released, with the interpreter's GIL held.
+    std::shared_ptr<LoadedModules> modules;
+    std::mutex modules_mutex;  // see NoGilLock
+    EntryValueCache entry_values;
+};
+
+// The modules a call should use from start to finish. The GIL must be held.
+std::shared_ptr<LoadedModules> current_modules(LoadedHook &hook) {
+    NoGilLock lock{hook.modules_mutex};
+    return hook.modules;
+}
+
+// Swaps in new modules, leaving the old ones in modules for the caller to
+// drop while it still holds the GIL.
+void swap_modules(LoadedHook &hook, std::shared_ptr<LoadedModules> &modules) {
+    NoGilLock lock{hook.modules_mutex};
+    hook.modules.swap(modules);
+}
+
+// Held while hook files are loaded, since databases share the compiled code
+// in InterpreterState::hook_files, and reloads run on their own threads.
+// Always taken before any GIL.
+std::mutex load_mutex;
+
+// Returns false, with errno set, if path can't be read.
+bool read_file(const string &path, string &out) {
+    unique_ptr<FILE, decltype(&fclose)> fp{nullptr, &fclose};
+    fp.reset(fopen(path.c_str(), "rb"));
+    if (!fp) {
+        return false;
+    }
+    out.clear();
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
+        out.append(buf, n);
+    }
+    return !ferror(fp.get());
+}
+
+// Reads a hook file, once, since each interpreter runs it separately.
+string read_source(const string &filename) {
+    string source;
+    if (!read_file(filename, source)) {
+        throw PyError{"Unable to read file " + filename + ": " +
+                      strerror(errno)};
+    }
+    return source;
+}
+
+// A py_bytecode_cache file starts with this, followed by the marshalled
+// code object.
+struct BytecodeHeader {
+    uint64_t magic;  // PyImport_GetMagicNumber, which changes with the
+                     // bytecode format
+    uint64_t source_size;
+    uint64_t source_hash;
+};
+
+BytecodeHeader bytecode_header(const string &source) {
+    return BytecodeHeader{static_cast<uint64_t>(PyImport_GetMagicNumber()),
+                          source.size(),
+                          hash_bytes(ValueRef{source.data(), source.size()})};
+}
+
+// Hook files in different directories may have the same name, so the
+// cache file's name includes a hash of the whole path.
+string bytecode_path(const string &dir, const string &filename) {
+    size_t slash = filename.rfind('/');
+    string base = slash == string::npos ? filename : filename.substr(slash + 1);
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx",
+             static_cast<unsigned long long>(
+                 hash_bytes(ValueRef{filename.data(), filename.size()})));
+    return dir + "/" + base + "." + hash + ".pyc";
+}
+
+// Returns the code cached for source at path, or an empty CCPyObj if there
+// is none or it is stale.
+CCPyObj read_bytecode(const string &path, const string &source) {
+    string data;
+    BytecodeHeader expected = bytecode_header(source), header;
+    if (!read_file(path, data) || data.size() < sizeof(header)) {
+        return CCPyObj{};
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != expected.magic ||
+        header.source_size != expected.source_size ||
+        header.source_hash != expected.source_hash) {
+        return CCPyObj{};
+    }
+    PyObject *code = PyMarshal_ReadObjectFromString(
+        data.data() + sizeof(header), data.size() - sizeof(header));
+    if (!code || !PyCode_Check(code)) {
+        PyErr_Clear();
+        Py_XDECREF(code);
+        return CCPyObj{};
+    }
+    return CCPyObj::checked_steal(code);
+}
+
+// Failures are only logged, since the cache is just an optimization.
+void write_bytecode(const string &path, const string &source, CCPyObj code) {
+    PyObject *data =
+        PyMarshal_WriteObjectToString(code.ref(), Py_MARSHAL_VERSION);
+    if (!data) {
+        PyErr_Clear();
+        log_error("Unable to marshal code for " + path);
+        return;
+    }
+    CCPyObj owned = CCPyObj::checked_steal(data);
+    BytecodeHeader header = bytecode_header(source);
+
+    // Written under another name and renamed, so that a slapd starting up
+    // alongside never reads half a file.
+    string tmp_path = path + ".tmp" + std::to_string(getpid());
+    unique_ptr<FILE, decltype(&fclose)> fp{nullptr, &fclose};
+    fp.reset(fopen(tmp_path.c_str(), "wb"));
+    bool ok = fp &&
+              fwrite(&header, sizeof(header), 1, fp.get()) == 1 &&
+              fwrite(PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data), 1,
+                     fp.get()) == 1;
+    ok = fp && fclose(fp.release()) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        log_error("Unable to write " + path + ": " + strerror(errno));
+        unlink(tmp_path.c_str());
+    }
+}
+
+// Compiles a hook file, or loads it from bytecode_dir if it was already
+// compiled there.
+CCPyObj compile_source(const string &filename, const string &source,
+                       const string &bytecode_dir) {
+    string path;
+    if (!bytecode_dir.empty()) {
+        path = bytecode_path(bytecode_dir, filename);
+        CCPyObj code = read_bytecode(path, source);
+        if (code.ref()) {
+            return code;
+        }
+    }
+    CCPyObj code = CCPyObj::checked_steal(
+        Py_CompileString(source.c_str(), filename.c_str(), Py_file_input));
+    if (!path.empty()) {
+        write_bytecode(path, source, code);
+    }
+    return code;
+}
+
+void require_function(CCPyObj mod, const string &filename,
+                      const string &function_name) {
+    if (!PyObject_HasAttrString(mod.ref(), function_name.c_str())) {
+        throw PyError{"File " + filename + " is missing function " +
+                      function_name};
+    }
+}
+
+// Makes any plain tuples a function added to py_op's modifications into
+// Modifications, so that the next file's function sees them as it would
+// its own. Anything else is left for mod_op_from_python to report.
+void mods_to_modifications(CCPyObj py_op) {
+    PyObject *mods = PyTuple_GET_ITEM(py_op.ref(), 3);
+    if (!PyList_Check(mods)) {
+        return;
+    }
+    CCPyObj type = modification_type();
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(mods); i++) {
+        PyObject *item = PyList_GET_ITEM(mods, i);
+        if (PyTuple_CheckExact(item) && PyTuple_GET_SIZE(item) == 4) {
+            PyList_SetItem(mods, i, CCPyObj::checked_steal(PyObject_Call(
+                                        type.ref(), item, nullptr))
+                                        .new_ref());
+        }
+    }
+}
+
+// Whether a function's result lets the update through to the next file's.
+// Malformed results don't, and are left for handle_result to report.
+bool lets_through(CCPyObj result) {
+    PyObject *obj = result.ref();
+    if (obj == Py_None) {
+        return true;
+    } else if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2) {
+        return false;
+    }
+    PyObject *status = PyTuple_GET_ITEM(obj, 0);
+    if (!PyLong_Check(status)) {
+        return false;
+    }
+    // A status too large for a long isn't 0, and raises nothing here.
+    int overflow;
+    long value = PyLong_AsLongAndOverflow(status, &overflow);
+    if (value == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        return false;
+    }
+    return overflow == 0 && value == 0;
+}
+
 class InstanceInfoImpl : public InstanceInfo {
   public:
-    InstanceInfoImpl() : function_name_("update") {}
-    virtual ~InstanceInfoImpl() {}
+    InstanceInfoImpl()
+        : function_name_("update"),
+          zero_copy_{false},
+          interpreters_{0},
+          entry_cache_size_{0},
+          value_set_threshold_{0},
+          share_module_{false},
+          timeout_ms_{0},
+          timeout_status_{kLdapBusy},
+          profile_hz_{0},
+          reloads_{0},
+          reload_failures_{0},
+          timeouts_{0} {}
+    virtual ~InstanceInfoImpl();
 
     void set_filename(const std::string &name) override { filename_ = name; }
     void set_function_name(const std::string &name) override {
         function_name_ = name;
     }
+    void add_function_name(const std::string &name) override {
+        other_function_names_.push_back(name);
+    }
+    void add_file(const std::string &filename,
+                  const std::string &function_name) override {
+        pipeline_.push_back(PipelineFile{filename, function_name});
+    }
+    void set_zero_copy(bool zero_copy) override { zero_copy_ = zero_copy; }
+    void set_interpreters(unsigned interpreters) override {
+        interpreters_ = interpreters;
+    }
+    void set_entry_cache_size(size_t size) override {
+        entry_cache_size_ = size;
+    }
+    void set_value_set_threshold(size_t threshold) override {
+        value_set_threshold_ = threshold;
+    }
+    void set_bytecode_cache(const std::string &dir) override {
+        bytecode_cache_ = dir;
+    }
+    void set_share_module(bool share) override { share_module_ = share; }
+    void set_timeout(unsigned long ms) override { timeout_ms_ = ms; }
+    void set_timeout_status(int status) override { timeout_status_ = status; }
+    void set_profile(const std::string &path, unsigned hz) override {
+        profile_path_ = path;
+        profile_hz_ = hz;
+    }
     void open() override;
-    int update(ModificationOp &op, std::string &error) override;
+    bool reload(std::string &error) override;
+    int update(ModificationOp &op, std::string &error) override {
+        return update(function_name_, op, error);
+    }
+    int update(const std::string &function_name, ModificationOp &op,
+               std::string &error) override;
+    void update_batch(std::vector<BatchItem> &items) override;
+    void get_counters(std::vector<NamedCounter> &counters) const override;
 
   private:
+    // Holds an idle LoadedHook, and its interpreter's GIL, for as long as it
+    // lives.
+    class Lease {
+      public:
+        explicit Lease(InstanceInfoImpl &owner)
+            : owner_(owner), hook_(owner.acquire()), lock_{hook_.interp} {}
+        Lease(const Lease &) = delete;
+        ~Lease() { owner_.release(hook_); }
+        void operator=(const Lease &) = delete;
+
+        LoadedHook &hook() { return hook_; }
+
+      private:
+        InstanceInfoImpl &owner_;
+        LoadedHook &hook_;
+        InterpreterLock lock_;
+    };
+
+    // Reads all of the hook files.
+    void read_sources(std::string &source,
+                      std::vector<std::string> &pipeline_sources) const;
+    std::shared_ptr<LoadedModules> load(
+        const std::string &source, const std::vector<string> &pipeline_sources);
+    // Runs a hook file in a new module.
+    CCPyObj load_module(const std::string &filename,
+                        const std::string &source);
+    // Waits for a LoadedHook which isn't in use.
+    LoadedHook &acquire();
+    void release(LoadedHook &hook);
+    int call(LoadedHook &hook, const std::string &function_name,
+             ModificationOp &op, std::string &error);
+    // Calls the batch function once for all of items.
+    void call_batch_function(LoadedHook &hook, LoadedModules &modules,
+                             std::vector<BatchItem *> &items);
+    // Decides an update whose hook was interrupted by the watchdog.
+    int timed_out(ModificationOp &op, std::string &error);
+
     std::string filename_;
     std::string function_name_;
-    CCPyObj py_module_;
+    std::vector<std::string> other_function_names_;
+    std::vector<PipelineFile> pipeline_;
+    bool zero_copy_;
+    unsigned interpreters_;
+    size_t entry_cache_size_;
+    size_t value_set_threshold_;
+    std::string bytecode_cache_;
+    bool share_module_;
+    unsigned long timeout_ms_;
+    int timeout_status_;
+    std::string profile_path_;
+    unsigned profile_hz_;
+    unique_ptr<Watchdog> watchdog_;  // only with a timeout or profile
+    // One per subinterpreter, or just one for the main interpreter, whose
+    // GIL does the job of idle_.
+    std::vector<unique_ptr<LoadedHook>> hooks_;
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cond_;
+    std::vector<LoadedHook *> idle_;
+    std::atomic<uint64_t> reloads_;
+    std::atomic<uint64_t> reload_failures_;
+    std::atomic<uint64_t> timeouts_;
 };
 
+InstanceInfoImpl::~InstanceInfoImpl() {
+    watchdog_.reset();
+    for (auto &hook : hooks_) {
+        InterpreterLock lock{hook->interp};
+        hook->modules.reset();
+        hook->entry_values.clear();
+    }
+}
+
 void InstanceInfoImpl::open() {
     if (filename_.empty()) {
         throw PyError{"No py_filename specified in config"};
     }
 
-    unique_ptr<FILE, decltype(&fclose)> fp{nullptr, &fclose};
-    fp.reset(fopen(filename_.c_str(), "r"));
-    if (!fp) {
-        throw PyError{"Unable to open file " + filename_ + ": " +
-                      strerror(errno)};
+    string source;
+    vector<string> pipeline_sources;
+    read_sources(source, pipeline_sources);
+
+    if ((timeout_ms_ > 0 || !profile_path_.empty()) && !watchdog_) {
+        watchdog_.reset(new Watchdog{profile_path_, profile_hz_});
+    }
+
+    std::lock_guard<std::mutex> load_lock{load_mutex};
+    if (hooks_.empty()) {
+        if (interpreters_ == 0) {
+            hooks_.emplace_back(new LoadedHook{nullptr});
+        }
+        for (unsigned i = 0; i < interpreters_; i++) {
+            hooks_.emplace_back(new LoadedHook{create_subinterpreter()});
+            idle_.push_back(hooks_.back().get());
+        }
+    }
+    for (auto &hook : hooks_) {
+        InterpreterLock lock{hook->interp};
+        std::shared_ptr<LoadedModules> modules = load(source, pipeline_sources);
+        swap_modules(*hook, modules);
+        hook->entry_values.set_max_entries(entry_cache_size_);
+    }
+}
+
+bool InstanceInfoImpl::reload(string &error) {
+    assert(!hooks_.empty());
+    string source;
+    vector<string> pipeline_sources;
+    std::lock_guard<std::mutex> load_lock{load_mutex};
+    // Every interpreter loads the new version before any switches to it, so
+    // that a broken file leaves them all on the old one.
+    vector<std::shared_ptr<LoadedModules>> loaded(hooks_.size());
+    try {
+        read_sources(source, pipeline_sources);
+        for (size_t i = 0; i < hooks_.size(); i++) {
+            InterpreterLock lock{hooks_[i]->interp};
+            loaded[i] = load(source, pipeline_sources);
+        }
+    } catch (PyError &exc) {
+        error = exc.what();
+        for (size_t i = 0; i < hooks_.size() && loaded[i]; i++) {
+            InterpreterLock lock{hooks_[i]->interp};
+            loaded[i].reset();
+        }
+        reload_failures_++;
+        return false;
+    }
+    for (size_t i = 0; i < hooks_.size(); i++) {
+        InterpreterLock lock{hooks_[i]->interp};
+        swap_modules(*hooks_[i], loaded[i]);
+        loaded[i].reset();
+    }
+    reloads_++;
+    return true;
+}
+
+void InstanceInfoImpl::get_counters(vector<NamedCounter> &counters) const {
+    if (reloads_ > 0 || reload_failures_ > 0) {
+        counters.push_back(NamedCounter{"reloads", reloads_.load()});
+        counters.push_back(
+            NamedCounter{"reload_failures", reload_failures_.load()});
+    }
+    if (timeout_ms_ > 0) {
+        counters.push_back(NamedCounter{"timeouts", timeouts_.load()});
+    }
+    if (!profile_path_.empty()) {
+        counters.push_back(
+            NamedCounter{"profile_samples", watchdog_ ? watchdog_->samples()
+                                                      : 0});
+    }
+    if (entry_cache_size_ == 0) {
+        return;
+    }
+    uint64_t hits = 0, misses = 0;
+    for (const auto &hook : hooks_) {
+        hits += hook->entry_values.hits();
+        misses += hook->entry_values.misses();
+    }
+    counters.push_back(NamedCounter{"entry_cache_hits", hits});
+    counters.push_back(NamedCounter{"entry_cache_misses", misses});
+}
+
+void InstanceInfoImpl::read_sources(string &source,
+                                    vector<string> &pipeline_sources) const {
+    source = read_source(filename_);
+    pipeline_sources.clear();
+    for (const PipelineFile &file : pipeline_) {
+        pipeline_sources.push_back(read_source(file.filename));
+    }
+}
+
+std::shared_ptr<LoadedModules> InstanceInfoImpl::load(
+    const string &source, const vector<string> &pipeline_sources) {
+    CCPyObj mod = load_module(filename_, source);
+    require_function(mod, filename_, function_name_);
+    for (const string &name : other_function_names_) {
+        require_function(mod, filename_, name);
+    }
+    vector<CCPyObj> pipeline;
+    for (size_t i = 0; i < pipeline_.size(); i++) {
+        pipeline.push_back(
+            load_module(pipeline_[i].filename, pipeline_sources[i]));
+        require_function(pipeline.back(), pipeline_[i].filename,
+                         pipeline_[i].function_name);
+    }
+
+    // A batch function can only stand in for the whole pipeline if there
+    // is none.
+    auto modules = std::make_shared<LoadedModules>();
+    string batch_function_name = function_name_ + "_batch";
+    modules->batch_function_name =
+        pipeline_.empty() &&
+                PyObject_HasAttrString(mod.ref(), batch_function_name.c_str())
+            ? batch_function_name
+            : "";
+    modules->module = mod;
+    modules->pipeline = std::move(pipeline);
+    return modules;
+}
+
+CCPyObj InstanceInfoImpl::load_module(const string &filename,
+                                      const string &source) {
+    // Only compiled again if the file has changed since another database
+    // loaded it.
+    InterpreterState::HookFile &file =
+        current_interpreter_state()->hook_files[filename];
+    if (!file.code.ref() || file.source != source) {
+        file.code = compile_source(filename, source, bytecode_cache_);
+        file.source = source;
+        file.module = CCPyObj{};
+    }
+    if (share_module_ && file.module.ref()) {
+        return file.module;
     }
 
-    GilHolder gil_holder;
     CCPyObj mod = CCPyObj::checked_steal(PyModule_New("update_hook"));
-    PyModule_AddStringConstant(mod.ref(), "__file__", filename_.c_str());
+    PyModule_AddStringConstant(mod.ref(), "__file__", filename.c_str());
     for (const auto &name_value : py_consts) {
         PyModule_AddIntConstant(mod.ref(), name_value.first.c_str(),
                                 name_value.second);
     }
     CCPyObj builtins = CCPyObj::checked_borrow(PyEval_GetBuiltins());
     PyModule_AddObject(mod.ref(), "__builtins__", builtins.new_ref());
-    PyModule_AddObject(mod.ref(), "Modification", mod_type.new_ref());
+    PyModule_AddObject(mod.ref(), "Modification",
+                       modification_type().new_ref());
+    PyModule_AddObject(mod.ref(), "HookTimeout",
+                       current_interpreter_state()->timeout_type.new_ref());
+    add_match_functions(mod);
     CCPyObj locals = CCPyObj::checked_steal(PyDict_New());
-    CCPyObj::checked_steal(
-        PyRun_FileEx(fp.get(), filename_.c_str(), Py_file_input,
-                     PyModule_GetDict(mod.ref()), locals.ref(), 0));
+    CCPyObj::checked_steal(PyEval_EvalCode(
+        file.code.ref(), PyModule_GetDict(mod.ref()), locals.ref()));
     PyDict_Update(PyModule_GetDict(mod.ref()), locals.ref());
+    if (share_module_) {
+        file.module = mod;
+    }
+    return mod;
+}
 
-    if (!PyObject_HasAttrString(mod.ref(), function_name_.c_str())) {
-        throw PyError{"File " + filename_ + " is missing function " +
-                      function_name_};
+LoadedHook &InstanceInfoImpl::acquire() {
+    if (!hooks_[0]->interp) {
+        return *hooks_[0];
     }
+    std::unique_lock<std::mutex> lock{idle_mutex_};
+    idle_cond_.wait(lock, [this] { return !idle_.empty(); });
+    // The most recently used is taken first, as its caches are warmest.
+    LoadedHook *hook = idle_.back();
+    idle_.pop_back();
+    return *hook;
+}
 
-    py_module_ = mod;
+void InstanceInfoImpl::release(LoadedHook &hook) {
+    if (!hook.interp) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock{idle_mutex_};
+        idle_.push_back(&hook);
+    }
+    idle_cond_.notify_one();
 }
 
-int InstanceInfoImpl::update(ModificationOp &op, string &error) {
-    assert(py_module_.ref());
-    GilHolder gil_holder;
+int InstanceInfoImpl::update(const string &function_name, ModificationOp &op,
+                             string &error) {
+    assert(!hooks_.empty());
+    Stats::Timer gil_timer{Stats::kGilWait};
+    Lease lease{*this};
+    gil_timer.stop();
+    return call(lease.hook(), function_name, op, error);
+}
 
-    CCPyObj py_op = mod_op_to_python(op);
-    CCPyObj result = py_module_.attr(function_name_)(py_op);
-    if (result.ref() != Py_None) {
-        if (result.size() != 2) {
-            throw PyError{"Result must be None or (int, str)"};
+int InstanceInfoImpl::call(LoadedHook &hook, const string &function_name,
+                           ModificationOp &op, string &error) {
+    // Declared before anything that might refer to the views, so that they
+    // are released last.
+    ValueViews value_views;
+
+    Stats::Timer to_python_timer{Stats::kToPython};
+    ModsSnapshot snapshot;
+    CCPyObj py_op = mod_op_to_python(op, zero_copy_ ? &value_views : nullptr,
+                                     hook.entry_values, value_set_threshold_,
+                                     snapshot);
+    EntryViewReleaser releaser;
+    releaser.add(py_op);
+    to_python_timer.stop();
+    if (Stats::enabled() && !zero_copy_) {
+        Stats::add(Stats::kBytesToPython, op_bytes(op, false));
+    }
+
+    Stats::Timer hook_timer{Stats::kHook};
+    std::shared_ptr<LoadedModules> modules = current_modules(hook);
+    CCPyObj result;
+    Watchdog::Call deadline{watchdog_.get(), hook.interp, function_name,
+                            std::chrono::milliseconds(timeout_ms_)};
+    try {
+        result = modules->module.attr(function_name)(py_op);
+        for (size_t i = 0; i < pipeline_.size() && lets_through(result);
+             i++) {
+            mods_to_modifications(py_op);
+            result =
+                modules->pipeline[i].attr(pipeline_[i].function_name)(py_op);
         }
-        int status = result.item(0);
-        if (status != 0) {
-            error = static_cast<string>(result.item(1));
-            return status;
+    } catch (PyError &) {
+        if (!deadline.end()) {
+            throw;
         }
+        return timed_out(op, error);
     }
+    // A hook which finished anyway (or caught HookTimeout) has the last
+    // word.
+    deadline.end();
+    hook_timer.stop();
 
-    mod_op_from_python(op, py_op);
-    return 0;  // LDAP_SUCCESS
+    Stats::Timer from_python_timer{Stats::kFromPython};
+    int status = handle_result(result, op, py_op, snapshot, error);
+    from_python_timer.stop();
+    if (Stats::enabled()) {
+        Stats::add(Stats::kBytesFromPython, op_bytes(op, true));
+    }
+    return status;
+}
+
+void InstanceInfoImpl::update_batch(vector<BatchItem> &items) {
+    assert(!hooks_.empty());
+    Stats::Timer gil_timer{Stats::kGilWait};
+    Lease lease{*this};
+    gil_timer.stop();
+    LoadedHook &hook = lease.hook();
+    std::shared_ptr<LoadedModules> modules = current_modules(hook);
+
+    // Updates for the default function go to the batch function, if there
+    // is one; the rest are called one at a time, in the same interpreter.
+    vector<BatchItem *> batch;
+    for (BatchItem &item : items) {
+        if (!modules->batch_function_name.empty() &&
+            (!item.function_name || *item.function_name == function_name_)) {
+            batch.push_back(&item);
+            continue;
+        }
+        UpdateResult &result = item.result;
+        result = UpdateResult{0, false, ""};
+        try {
+            result.status = call(
+                hook, item.function_name ? *item.function_name : function_name_,
+                *item.op, result.error);
+        } catch (PyError &exc) {
+            result.exception = true;
+            result.error = exc.what();
+        }
+    }
+    if (batch.empty()) {
+        return;
+    }
+
+    try {
+        call_batch_function(hook, *modules, batch);
+    } catch (PyError &exc) {
+        for (BatchItem *item : batch) {
+            item->result = UpdateResult{0, true, exc.what()};
+        }
+    }
+}
+
+void InstanceInfoImpl::call_batch_function(LoadedHook &hook,
+                                           LoadedModules &modules,
+                                           vector<BatchItem *> &items) {
+    // Declared before anything that might refer to the views, so that they
+    // are released last.
+    ValueViews value_views;
+
+    Stats::Timer to_python_timer{Stats::kToPython};
+    vector<ModsSnapshot> snapshots(items.size());
+    CCPyObj py_ops = CCPyObj::checked_steal(PyList_New(items.size()));
+    EntryViewReleaser releaser;
+    for (size_t i = 0; i < items.size(); i++) {
+        CCPyObj py_op = mod_op_to_python(*items[i]->op,
+                                         zero_copy_ ? &value_views : nullptr,
+                                         hook.entry_values,
+                                         value_set_threshold_, snapshots[i]);
+        releaser.add(py_op);
+        PyList_SET_ITEM(py_ops.ref(), i, py_op.new_ref());
+        if (Stats::enabled() && !zero_copy_) {
+            Stats::add(Stats::kBytesToPython, op_bytes(*items[i]->op, false));
+        }
+    }
+    to_python_timer.stop();
+
+    Stats::Timer hook_timer{Stats::kHook};
+    CCPyObj results;
+    // The timeout applies to the batch as a whole.
+    Watchdog::Call deadline{watchdog_.get(), hook.interp,
+                            modules.batch_function_name,
+                            std::chrono::milliseconds(timeout_ms_)};
+    try {
+        results = modules.module.attr(modules.batch_function_name)(py_ops);
+    } catch (PyError &) {
+        if (!deadline.end()) {
+            throw;
+        }
+        for (BatchItem *item : items) {
+            item->result = UpdateResult{0, false, ""};
+            item->result.status = timed_out(*item->op, item->result.error);
+        }
+        return;
+    }
+    deadline.end();
+    hook_timer.stop();
+    results = CCPyObj::checked_steal(PySequence_Fast(
+        results.ref(), "Batch result must be a list of results"));
+    if (static_cast<size_t>(PySequence_Fast_GET_SIZE(results.ref())) !=
+        items.size()) {
+        throw PyError{"Batch result must have a result for each op"};
+    }
+
+    Stats::Timer from_python_timer{Stats::kFromPython};
+    for (size_t i = 0; i < items.size(); i++) {
+        UpdateResult &result = items[i]->result;
+        result = UpdateResult{0, false, ""};
+        try {
+            result.status = handle_result(
+                CCPyObj::checked_borrow(
+                    PySequence_Fast_GET_ITEM(results.ref(), i)),
+                *items[i]->op,
+                CCPyObj::checked_borrow(PyList_GET_ITEM(py_ops.ref(), i)),
+                snapshots[i], result.error);
+        } catch (PyError &exc) {
+            result.exception = true;
+            result.error = exc.what();
+        }
+        if (Stats::enabled()) {
+            Stats::add(Stats::kBytesFromPython, op_bytes(*items[i]->op, true));
+        }
+    }
+}
+
+int InstanceInfoImpl::timed_out(ModificationOp &op, string &error) {
+    timeouts_++;
+    op.timed_out = true;
+    if (timeout_status_ != 0) {
+        error = "Hook timed out after " + std::to_string(timeout_ms_) + " ms";
+    }
+    return timeout_status_;
 }
 
 // static
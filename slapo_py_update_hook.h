@@ -1,11 +1,19 @@
 #ifndef SLAPO_PY_UPDATE_HOOK_H_
 #define SLAPO_PY_UPDATE_HOOK_H_
 
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <map>
 #include <stdexcept>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "arena.h"
+
 namespace slapo_py_update_hook {
 
 extern const std::map<std::string, int> py_consts;
@@ -15,21 +23,242 @@ class PyError : public std::runtime_error {
     PyError(const std::string &arg) : std::runtime_error{arg} {}
 };
 
+// A non-owning reference to bytes owned by slapd (e.g. a BerValue) or by an
+// operation's Arena.
+struct ValueRef {
+    const char *data;
+    size_t size;
+
+    std::string str() const { return std::string(data, size); }
+};
+
+inline ValueRef copy_ref(ValueRef ref, Arena &arena) {
+    return ValueRef{arena.copy(ref.data, ref.size), ref.size};
+}
+
+// FNV-1a.
+inline uint64_t hash_bytes(ValueRef ref) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < ref.size; i++) {
+        hash ^= static_cast<unsigned char>(ref.data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The order EntryView attributes are sorted in: by length, then by bytes,
+// which is cheaper to compare than lexicographic order.
+inline bool name_less(ValueRef a, ValueRef b) {
+    if (a.size != b.size) {
+        return a.size < b.size;
+    }
+    return memcmp(a.data, b.data, a.size) < 0;
+}
+
+// Read-only access to the attributes of the entry being modified. The
+// underlying entry is only guaranteed to exist for the duration of a single
+// InstanceInfo::update call. Attributes are sorted by name_less.
+class EntryView {
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    virtual ~EntryView() {}
+    virtual size_t size() const = 0;
+    virtual ValueRef name(size_t attr) const = 0;
+    virtual size_t find(ValueRef name) const = 0;
+    virtual size_t num_values(size_t attr) const = 0;
+    virtual ValueRef value(size_t attr, size_t idx) const = 0;
+    // The value as normalized for the attribute's equality rule, such that
+    // equal values are identical, or the value itself if there's no rule.
+    virtual ValueRef normalized_value(size_t attr, size_t idx) const {
+        return value(attr, idx);
+    }
+    // Normalizes value as normalized_value's are, into out. Returns false if
+    // it isn't a valid value for the attribute.
+    virtual bool normalize(size_t attr, ValueRef value,
+                           std::string &out) const {
+        out.assign(value.data, value.size);
+        return true;
+    }
+    // The attribute's description handle (see Modification::desc), or
+    // nullptr if unknown.
+    virtual const void *desc(size_t attr) const { return nullptr; }
+    // Something which changes whenever the entry does, such as its
+    // entryCSN, or empty if there is nothing reliable.
+    virtual ValueRef version() const { return ValueRef{nullptr, 0}; }
+};
+
+// An EntryView over values stored elsewhere, e.g. in an encoded buffer. The
+// values of all attributes are kept in one array.
+class FlatEntryView : public EntryView {
+  public:
+    struct Attribute {
+        ValueRef name;
+        size_t first_value;
+        size_t num_values;
+    };
+
+    FlatEntryView() {}
+    explicit FlatEntryView(Arena &arena)
+        : attrs{ArenaAllocator<Attribute>{arena}},
+          values{ArenaAllocator<ValueRef>{arena}} {}
+
+    size_t size() const override { return attrs.size(); }
+    ValueRef name(size_t attr) const override { return attrs[attr].name; }
+    size_t find(ValueRef name) const override {
+        size_t lo = 0, hi = attrs.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (name_less(attrs[mid].name, name)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < attrs.size() && !name_less(name, attrs[lo].name)) {
+            return lo;
+        }
+        return npos;
+    }
+    size_t num_values(size_t attr) const override {
+        return attrs[attr].num_values;
+    }
+    ValueRef value(size_t attr, size_t idx) const override {
+        return values[attrs[attr].first_value + idx];
+    }
+    ValueRef version() const override { return entry_version; }
+
+    ArenaVector<Attribute> attrs;  // sorted by name_less
+    ArenaVector<ValueRef> values;
+    ValueRef entry_version{nullptr, 0};
+};
+
+// A modification value. It either lives in an operation's Arena or borrows
+// bytes owned by slapd, in which case origin may identify the BerValue they
+// came from so that it can be reused rather than copied.
+class Value {
+  public:
+    Value() : ref_{nullptr, 0}, origin_{nullptr}, borrowed_{false} {}
+    // Copies data into arena.
+    Value(ValueRef data, Arena &arena)
+        : ref_(copy_ref(data, arena)), origin_{nullptr}, borrowed_{false} {}
+    static Value borrow(ValueRef ref, const void *origin = nullptr) {
+        Value value;
+        value.ref_ = ref;
+        value.origin_ = origin;
+        value.borrowed_ = true;
+        return value;
+    }
+
+    ValueRef ref() const { return ref_; }
+    std::string str() const { return ref_.str(); }
+    bool borrowed() const { return borrowed_; }
+    const void *origin() const { return origin_; }
+
+    // Copies borrowed bytes into arena, for when their owner is about to go
+    // away.
+    void own(Arena &arena) {
+        if (borrowed_) {
+            ref_ = copy_ref(ref_, arena);
+            origin_ = nullptr;
+            borrowed_ = false;
+        }
+    }
+
+  private:
+    ValueRef ref_;
+    const void *origin_;
+    bool borrowed_;
+};
+
+// The name and values of a modification are borrowed from slapd or live in
+// the Arena of the ModificationOp it belongs to.
 struct Modification {
-    std::string name;
-    std::vector<std::string> values;
-    int op;
-    int flags;
+    static const size_t kNew = static_cast<size_t>(-1);
+
+    Modification() {}
+    explicit Modification(Arena &arena)
+        : values{ArenaAllocator<Value>{arena}} {}
+
+    ValueRef name{nullptr, 0};
+    // The attribute's description, if known: slapd's AttributeDescription,
+    // which lives as long as the process, so that name needn't be looked
+    // up again. It is only a handle to everything else.
+    const void *desc = nullptr;
+    ArenaVector<Value> values;
+    int op = 0;
+    int flags = 0;
+    // The index in the original list of the modification this was passed
+    // through from unchanged, or kNew. Such modifications can be handed back
+    // to slapd as they were, without converting them again.
+    size_t origin = kNew;
 };
 
+// Everything an operation needs is either borrowed from slapd or allocated
+// from its arena, so converting one costs a handful of allocations rather
+// than a few per value. It can't be copied or moved, since its containers
+// refer to the arena.
 struct ModificationOp {
-    std::string dn;
-    std::string auth_dn;
-    std::map<std::string, std::vector<std::string>> entry;
-    std::vector<Modification> mods;
+    ModificationOp() : mods{ArenaAllocator<Modification>{arena}} {}
+    ModificationOp(const ModificationOp &) = delete;
+    void operator=(const ModificationOp &) = delete;
+
+    Arena arena;
+    ValueRef dn{nullptr, 0};
+    ValueRef auth_dn{nullptr, 0};
+    const EntryView *entry = nullptr;
+    ArenaVector<Modification> mods;
+    // Set by update if the outcome was decided by a timeout rather than by
+    // the hook, so that it isn't remembered.
+    bool timed_out = false;
+};
+
+// The outcome of an update, as returned by InstanceInfo::update.
+struct UpdateResult {
+    int status;
+    // If set, the update raised and error holds the formatted exception.
+    bool exception;
+    std::string error;
+};
+
+// One update of a batch; see InstanceInfo::update_batch.
+struct BatchItem {
+    const std::string *function_name;  // nullptr for the default function
+    ModificationOp *op;
+    UpdateResult result;
+};
+
+// A named statistic reported by an InstanceInfo, such as a cache hit count.
+struct NamedCounter {
+    std::string name;
+    uint64_t value;
 };
 
 void init_python();
+// Forks the process, leaving the interpreter usable in the child. Returns as
+// fork() does.
+pid_t fork_interpreter();
+// Logs a message through slapd's logging.
+void log_error(const std::string &message);
+
+// Compare values and DNs as slapd does, with its schema's matching rules,
+// for the hook module's normalize, equality_match, dn_normalize and
+// is_descendant. Attributes are named by name, or by desc if it is set (see
+// Modification::desc). They return false, with error set, if there's no
+// such attribute, or a value or DN isn't valid.
+
+// Normalizes value for the attribute's equality rule, as slapd normalizes
+// the values it stores (see EntryView::normalized_value).
+bool normalize_value(ValueRef name, const void *desc, ValueRef value,
+                     std::string &out, std::string &error);
+// Sets match to whether a and b are equal by the attribute's equality rule,
+// which it must have.
+bool equality_match(ValueRef name, const void *desc, ValueRef a, ValueRef b,
+                    bool &match, std::string &error);
+bool dn_normalize(ValueRef dn, std::string &out, std::string &error);
+// Sets descendant to whether dn is below base, and isn't base itself.
+bool dn_is_descendant(ValueRef dn, ValueRef base, bool &descendant,
+                      std::string &error);
 
 class InstanceInfo {
   public:
@@ -37,11 +266,79 @@ class InstanceInfo {
     virtual ~InstanceInfo() {}
     virtual void set_filename(const std::string &) = 0;
     virtual void set_function_name(const std::string &) = 0;
+    // Registers a function other than the default one which open() should
+    // check for, since update may be asked to call it.
+    virtual void add_function_name(const std::string &) = 0;
+    // Adds another file to the pipeline: its function is called after those
+    // of the files before it, with the same ModificationOp as they left it,
+    // as long as they let the update through.
+    virtual void add_file(const std::string &filename,
+                          const std::string &function_name) = 0;
+    // In zero-copy mode, values are handed to the hook as read-only buffers
+    // over slapd's memory rather than as copies.
+    virtual void set_zero_copy(bool) = 0;
+    // With N > 0, the hook is loaded into N subinterpreters, each with its
+    // own GIL, and concurrent updates run in whichever is idle. Must be set
+    // before the first open(); needs Python 3.12.
+    virtual void set_interpreters(unsigned) = 0;
+    // Keeps the converted attribute values of up to N recently modified
+    // entries, for as long as their version stays the same. 0 disables it.
+    virtual void set_entry_cache_size(size_t) = 0;
+    // Entry attributes with at least N values are handed to the hook as
+    // ValueSets rather than lists. 0 disables it.
+    virtual void set_value_set_threshold(size_t) = 0;
+    // Keeps compiled hook files in this directory, and loads them from it
+    // if they haven't changed since. Empty disables it.
+    virtual void set_bytecode_cache(const std::string &dir) = 0;
+    // Shares the module run from each hook file (and so its globals) with
+    // any other instance which uses the same file in the same interpreter
+    // and also shares it, rather than running it again.
+    virtual void set_share_module(bool) = 0;
+    // Interrupts hook calls which run for longer than this many ms, and
+    // returns status for them instead, leaving the modifications as they
+    // were (so 0 lets the update through unchanged). 0 ms disables it.
+    virtual void set_timeout(unsigned long ms) = 0;
+    virtual void set_timeout_status(int status) = 0;
+    // Samples the Python stacks of hook calls hz times a second, and keeps
+    // path up to date with them, as folded stacks (see FoldedStacks). An
+    // empty path disables it.
+    virtual void set_profile(const std::string &path, unsigned hz) = 0;
     virtual void open() = 0;
+    // Loads the hook files again, once open, and switches to them for
+    // calls which start afterwards. If any of them fails to load, the old
+    // version is kept and false is returned, with error set.
+    virtual bool reload(std::string &error) = 0;
+    // Calls the default function.
     virtual int update(ModificationOp &op, std::string &error) = 0;
+    virtual int update(const std::string &function_name, ModificationOp &op,
+                       std::string &error) = 0;
+    // Runs several updates, filling in each item's result. By default this
+    // just calls update for each of them in turn.
+    virtual void update_batch(std::vector<BatchItem> &items) {
+        for (BatchItem &item : items) {
+            update_item(item);
+        }
+    }
+    // Appends this instance's counters, and those of any instance it wraps.
+    virtual void get_counters(std::vector<NamedCounter> &counters) const {}
 
   protected:
     InstanceInfo() {}
+
+    // Runs one item through update, recording any exception in its result.
+    void update_item(BatchItem &item) {
+        UpdateResult &result = item.result;
+        result = UpdateResult{0, false, ""};
+        try {
+            result.status =
+                item.function_name
+                    ? update(*item.function_name, *item.op, result.error)
+                    : update(*item.op, result.error);
+        } catch (PyError &exc) {
+            result.exception = true;
+            result.error = exc.what();
+        }
+    }
 };
 
 }  // namespace slapo_py_update_hook
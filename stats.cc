@@ -0,0 +1,123 @@
+#include <atomic>
+#include <cstdint>
+
+#include "stats.h"
+
+namespace slapo_py_update_hook {
+namespace {
+
+// Which shard each thread records into, assigned round-robin.
+std::atomic<unsigned> next_shard{0};
+thread_local unsigned thread_shard = next_shard.fetch_add(1);
+
+size_t bucket_for(uint64_t ns) {
+    if (ns < 2) {
+        return 0;
+    }
+    size_t bucket = 63 - __builtin_clzll(ns);  // floor(log2(ns))
+    return bucket < Stats::kNumBuckets ? bucket : Stats::kNumBuckets - 1;
+}
+
+}  // anonymous namespace
+
+thread_local Stats *Stats::current_ = nullptr;
+
+Stats::Stats() : shards_() {}
+
+const char *Stats::phase_name(Phase phase) {
+    switch (phase) {
+    case kTotal:
+        return "total";
+    case kEntryFetch:
+        return "entry_fetch";
+    case kRules:
+        return "rules";
+    case kGilWait:
+        return "gil_wait";
+    case kToPython:
+        return "to_python";
+    case kHook:
+        return "hook";
+    case kExceptionFormat:
+        return "exception_format";
+    case kFromPython:
+        return "from_python";
+    case kToLdap:
+        return "to_ldap";
+    case kNumPhases:
+        break;
+    }
+    return "unknown";
+}
+
+const char *Stats::count_name(Count count) {
+    switch (count) {
+    case kCalls:
+        return "calls";
+    case kRejections:
+        return "rejections";
+    case kExceptions:
+        return "exceptions";
+    case kBytesToPython:
+        return "bytes_to_python";
+    case kBytesFromPython:
+        return "bytes_from_python";
+    case kNumCounts:
+        break;
+    }
+    return "unknown";
+}
+
+uint64_t Stats::PhaseSummary::quantile_ns(double q) const {
+    uint64_t rank = static_cast<uint64_t>(q * count + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            return uint64_t{2} << i;
+        }
+    }
+    return 0;
+}
+
+Stats::Shard &Stats::shard() { return shards_[thread_shard % kNumShards]; }
+
+void Stats::record(Phase phase, uint64_t ns) {
+    Shard &shard = this->shard();
+    shard.sums[phase].fetch_add(ns, std::memory_order_relaxed);
+    shard.buckets[phase][bucket_for(ns)].fetch_add(1,
+                                                   std::memory_order_relaxed);
+}
+
+void Stats::read(PhaseSummary (&phases)[kNumPhases],
+                 uint64_t (&counts)[kNumCounts]) const {
+    for (size_t c = 0; c < kNumCounts; c++) {
+        counts[c] = 0;
+    }
+    for (size_t p = 0; p < kNumPhases; p++) {
+        PhaseSummary &summary = phases[p];
+        summary.count = 0;
+        summary.sum_ns = 0;
+        for (size_t b = 0; b < kNumBuckets; b++) {
+            summary.buckets[b] = 0;
+        }
+    }
+
+    for (const Shard &shard : shards_) {
+        for (size_t c = 0; c < kNumCounts; c++) {
+            counts[c] += shard.counts[c].load(std::memory_order_relaxed);
+        }
+        for (size_t p = 0; p < kNumPhases; p++) {
+            PhaseSummary &summary = phases[p];
+            summary.sum_ns += shard.sums[p].load(std::memory_order_relaxed);
+            for (size_t b = 0; b < kNumBuckets; b++) {
+                uint64_t n =
+                    shard.buckets[p][b].load(std::memory_order_relaxed);
+                summary.buckets[b] += n;
+                summary.count += n;
+            }
+        }
+    }
+}
+
+}  // namespace slapo_py_update_hook
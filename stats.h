@@ -0,0 +1,130 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace slapo_py_update_hook {
+
+// Per-instance counters and latency histograms of each phase of handling a
+// modification. Updates go to one of several shards, picked per thread, so
+// concurrent threads rarely touch the same cache lines and never lock.
+//
+// Code doesn't need to be handed a Stats to record into it: a Scope makes it
+// current for the calling thread, and Timer and add() record into whichever
+// Stats is current, or do nothing if none is.
+class Stats {
+  public:
+    enum Phase {
+        kTotal,            // all of modify_hook
+        kEntryFetch,       // be_entry_get_rw
+        kRules,            // py_rule evaluation
+        kGilWait,          // waiting for the GIL
+        kToPython,         // mod_op_to_python
+        kHook,             // the hook function, including formatting errors
+        kExceptionFormat,  // CCPyObj::maybe_throw formatting a traceback
+        kFromPython,       // mod_op_from_python
+        kToLdap,           // mod_op_to_ldap
+        kNumPhases,
+    };
+    enum Count {
+        kCalls,
+        kRejections,
+        kExceptions,
+        kBytesToPython,
+        kBytesFromPython,
+        kNumCounts,
+    };
+    // Bucket i counts durations of less than 2^(i + 1) ns (and at least 2^i
+    // ns, except for bucket 0); the last also counts anything longer.
+    static const size_t kNumBuckets = 40;
+
+    struct PhaseSummary {
+        uint64_t count;
+        uint64_t sum_ns;
+        uint64_t buckets[kNumBuckets];
+
+        // Returns an upper bound on the q'th quantile (0 < q <= 1), from the
+        // bucket it falls in.
+        uint64_t quantile_ns(double q) const;
+    };
+
+    class Scope {
+      public:
+        explicit Scope(Stats *stats) : prev_{current_} { current_ = stats; }
+        Scope(const Scope &) = delete;
+        ~Scope() { current_ = prev_; }
+        void operator=(const Scope &) = delete;
+
+      private:
+        Stats *prev_;
+    };
+
+    // Times from construction to stop() or destruction, whichever is first.
+    class Timer {
+      public:
+        explicit Timer(Phase phase)
+            : stats_{current_}, phase_{phase}, start_{stats_ ? now_ns() : 0} {}
+        Timer(const Timer &) = delete;
+        ~Timer() { stop(); }
+        void operator=(const Timer &) = delete;
+
+        void stop() {
+            if (stats_) {
+                stats_->record(phase_, now_ns() - start_);
+                stats_ = nullptr;
+            }
+        }
+
+      private:
+        Stats *stats_;
+        Phase phase_;
+        uint64_t start_;
+    };
+
+    Stats();
+    Stats(const Stats &) = delete;
+    void operator=(const Stats &) = delete;
+
+    static bool enabled() { return current_ != nullptr; }
+    static void add(Count count, uint64_t n = 1) {
+        if (current_) {
+            current_->shard().counts[count].fetch_add(
+                n, std::memory_order_relaxed);
+        }
+    }
+
+    static const char *phase_name(Phase phase);
+    static const char *count_name(Count count);
+
+    // Sums the shards. Concurrent updates may or may not be included.
+    void read(PhaseSummary (&phases)[kNumPhases],
+              uint64_t (&counts)[kNumCounts]) const;
+
+  private:
+    static const size_t kNumShards = 16;
+
+    struct Shard {
+        std::atomic<uint64_t> counts[kNumCounts];
+        std::atomic<uint64_t> sums[kNumPhases];
+        std::atomic<uint64_t> buckets[kNumPhases][kNumBuckets];
+    };
+
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    Shard &shard();
+    void record(Phase phase, uint64_t ns);
+
+    static thread_local Stats *current_;
+    Shard shards_[kNumShards];
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // STATS_H_
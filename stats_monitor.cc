@@ -0,0 +1,212 @@
+#include "portable.h"
+
+#include <cstdio>  // snprintf
+#include <string>
+#include <vector>
+
+#include "slap.h"
+#include "back-monitor/back-monitor.h"
+
+#include "stats_monitor.h"
+
+using std::string;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+AttributeDescription *ad_counter = nullptr;
+AttributeDescription *ad_latency = nullptr;
+
+// The OIDs are in OpenLDAP's experimental arc.
+const struct {
+    const char *def;
+    AttributeDescription **ad;
+} schema[] = {
+    {"( 1.3.6.1.4.1.4203.666.11.200.1.1 NAME 'olmPyHookCounter' "
+     "DESC 'py_update_hook counter: name value' "
+     "EQUALITY caseIgnoreMatch "
+     "SYNTAX 1.3.6.1.4.1.1466.115.121.1.15 "
+     "NO-USER-MODIFICATION USAGE dSAOperation )",
+     &ad_counter},
+    {"( 1.3.6.1.4.1.4203.666.11.200.1.2 NAME 'olmPyHookLatency' "
+     "DESC 'py_update_hook phase latency: phase count= sum_ns= p50_ns= "
+     "p99_ns= p999_ns= buckets=' "
+     "EQUALITY caseIgnoreMatch "
+     "SYNTAX 1.3.6.1.4.1.1466.115.121.1.15 "
+     "NO-USER-MODIFICATION USAGE dSAOperation )",
+     &ad_latency},
+};
+
+bool register_schema(string &error) {
+    if (ad_counter) {
+        return true;
+    }
+    for (const auto &at : schema) {
+        if (register_at(at.def, at.ad, 0) != LDAP_SUCCESS) {
+            error = string{"Unable to register monitor schema: "} + at.def;
+            return false;
+        }
+    }
+    return true;
+}
+
+string format_counter(const string &name, uint64_t value) {
+    return name + " " + std::to_string(value);
+}
+
+string format_latency(const char *name, const Stats::PhaseSummary &summary) {
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+             "%s count=%llu sum_ns=%llu p50_ns=%llu p99_ns=%llu "
+             "p999_ns=%llu buckets=",
+             name, static_cast<unsigned long long>(summary.count),
+             static_cast<unsigned long long>(summary.sum_ns),
+             static_cast<unsigned long long>(summary.quantile_ns(0.5)),
+             static_cast<unsigned long long>(summary.quantile_ns(0.99)),
+             static_cast<unsigned long long>(summary.quantile_ns(0.999)));
+    string result{buf};
+    // Trailing empty buckets are left out.
+    size_t num_buckets = Stats::kNumBuckets;
+    while (num_buckets > 0 && summary.buckets[num_buckets - 1] == 0) {
+        num_buckets--;
+    }
+    for (size_t i = 0; i < num_buckets; i++) {
+        if (i > 0) {
+            result += ',';
+        }
+        result += std::to_string(summary.buckets[i]);
+    }
+    return result;
+}
+
+void replace_values(Entry *e, AttributeDescription *ad,
+                    const vector<string> &values) {
+    attr_delete(&e->e_attrs, ad);
+    vector<BerValue> bvs(values.size() + 1);
+    for (size_t i = 0; i < values.size(); i++) {
+        bvs[i].bv_val = const_cast<char *>(values[i].data());
+        bvs[i].bv_len = values[i].size();
+    }
+    BER_BVZERO(&bvs[values.size()]);
+    attr_merge(e, ad, bvs.data(), nullptr);  // copies the values
+}
+
+}  // anonymous namespace
+
+StatsMonitor::StatsMonitor()
+    : stats_{nullptr},
+      info_{nullptr},
+      capture_{nullptr},
+      post_{nullptr},
+      cb_{nullptr} {
+    BER_BVZERO(&ndn_);
+}
+
+bool StatsMonitor::open(BackendDB *be, const Stats *stats,
+                        const InstanceInfo *info,
+                        const CaptureWriter *capture, const PostQueue *post,
+                        string &error) {
+    BackendInfo *mi = backend_info("monitor");
+    if (!mi || !mi->bi_extra) {
+        return true;
+    }
+    auto mbe = static_cast<monitor_extra_t *>(mi->bi_extra);
+    if (!mbe->is_configured()) {
+        return true;
+    }
+    if (!register_schema(error)) {
+        return false;
+    }
+
+    stats_ = stats;
+    info_ = info;
+    capture_ = capture;
+    post_ = post;
+    if (BER_BVISNULL(&ndn_) && mbe->register_database(be, &ndn_) != 0) {
+        error = "Unable to register database with cn=Monitor";
+        return false;
+    }
+
+    // Placeholder values, replaced by update whenever the entry is read.
+    Attribute *attrs = attrs_alloc(2);
+    BerValue none = BER_BVC("none");
+    attrs->a_desc = ad_counter;
+    attr_valadd(attrs, &none, nullptr, 1);
+    attrs->a_next->a_desc = ad_latency;
+    attr_valadd(attrs->a_next, &none, nullptr, 1);
+
+    cb_ = static_cast<monitor_callback_t *>(
+        ch_calloc(1, sizeof(monitor_callback_t)));
+    cb_->mc_update = &StatsMonitor::update;
+    cb_->mc_free = &StatsMonitor::free_attrs;
+    cb_->mc_private = this;
+    int status = mbe->register_entry_attrs(&ndn_, attrs, cb_, nullptr, -1,
+                                           nullptr);
+    attrs_free(attrs);
+    if (status != 0) {
+        // Left to back-monitor, which may still refer to it.
+        cb_ = nullptr;
+        error = "Unable to register cn=Monitor attributes";
+        return false;
+    }
+    return true;
+}
+
+void StatsMonitor::close() {
+    BackendInfo *mi = backend_info("monitor");
+    if (!cb_ || !mi || !mi->bi_extra) {
+        return;
+    }
+    auto mbe = static_cast<monitor_extra_t *>(mi->bi_extra);
+    // This frees cb_, after calling free_attrs.
+    mbe->unregister_entry_callback(&ndn_, cb_, nullptr, 0, nullptr);
+    cb_ = nullptr;
+}
+
+// static
+int StatsMonitor::update(Operation *op, SlapReply *rs, Entry *e,
+                         void *priv) {
+    auto monitor = static_cast<StatsMonitor *>(priv);
+    Stats::PhaseSummary phases[Stats::kNumPhases];
+    uint64_t counts[Stats::kNumCounts];
+    monitor->stats_->read(phases, counts);
+
+    vector<string> values;
+    for (size_t c = 0; c < Stats::kNumCounts; c++) {
+        values.push_back(format_counter(
+            Stats::count_name(static_cast<Stats::Count>(c)), counts[c]));
+    }
+    vector<NamedCounter> counters;
+    monitor->info_->get_counters(counters);
+    if (monitor->capture_->is_open()) {
+        monitor->capture_->get_counters(counters);
+    }
+    if (monitor->post_->is_open()) {
+        monitor->post_->get_counters(counters);
+    }
+    for (const NamedCounter &counter : counters) {
+        values.push_back(format_counter(counter.name, counter.value));
+    }
+    replace_values(e, ad_counter, values);
+
+    values.clear();
+    for (size_t p = 0; p < Stats::kNumPhases; p++) {
+        values.push_back(format_latency(
+            Stats::phase_name(static_cast<Stats::Phase>(p)), phases[p]));
+    }
+    replace_values(e, ad_latency, values);
+    return SLAP_CB_CONTINUE;
+}
+
+// static
+int StatsMonitor::free_attrs(Entry *e, void **priv) {
+    // The StatsMonitor may already be gone during shutdown, so only the
+    // entry is touched.
+    attr_delete(&e->e_attrs, ad_counter);
+    attr_delete(&e->e_attrs, ad_latency);
+    *priv = nullptr;
+    return SLAP_CB_CONTINUE;
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,51 @@
+#ifndef STATS_MONITOR_H_
+#define STATS_MONITOR_H_
+
+#include "portable.h"
+
+#include <string>
+
+#include "slap.h"
+
+#include "slapo_py_update_hook.h"
+#include "capture.h"
+#include "post_queue.h"
+#include "stats.h"
+
+struct monitor_callback_t;
+
+namespace slapo_py_update_hook {
+
+// Publishes an overlay instance's Stats, and the counters of its
+// InstanceInfo, CaptureWriter and PostQueue, as olmPyHookCounter and
+// olmPyHookLatency values on its database's entry under cn=Monitor. They are
+// refreshed whenever the entry is read.
+class StatsMonitor {
+  public:
+    StatsMonitor();
+    StatsMonitor(const StatsMonitor &) = delete;
+    void operator=(const StatsMonitor &) = delete;
+
+    // Does nothing (successfully) if back-monitor isn't configured. Returns
+    // false (and sets error) if registration fails. stats, info, capture
+    // and post must outlive the registration.
+    bool open(BackendDB *be, const Stats *stats, const InstanceInfo *info,
+              const CaptureWriter *capture, const PostQueue *post,
+              std::string &error);
+    void close();
+
+  private:
+    static int update(Operation *op, SlapReply *rs, Entry *e, void *priv);
+    static int free_attrs(Entry *e, void **priv);
+
+    const Stats *stats_;
+    const InstanceInfo *info_;
+    const CaptureWriter *capture_;
+    const PostQueue *post_;
+    BerValue ndn_;
+    monitor_callback_t *cb_;
+};
+
+}  // namespace slapo_py_update_hook
+
+#endif  // STATS_MONITOR_H_
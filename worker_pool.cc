@@ -0,0 +1,670 @@
+#include <dirent.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>  // binary_search, min, set_difference, sort
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>  // back_inserter
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "slapo_py_update_hook.h"
+#include "mod_op_codec.h"
+#include "worker_pool.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace slapo_py_update_hook {
+namespace {
+
+const int kLdapOther = 0x50;  // LDAP_OTHER
+
+// Slot states. The states of a slot a worker has claimed also record
+// which worker it is, so that its request can be failed if the worker dies.
+const uint32_t kFree = 0;
+const uint32_t kFilling = 1;
+const uint32_t kRequest = 2;
+const uint32_t kResponse = 3;
+const uint32_t kBusy = 4;
+const uint32_t kFetch = 5;     // the worker wants some of the entry's values
+const uint32_t kFetching = 6;  // the caller is writing them
+
+uint32_t worker_state(uint32_t state, unsigned worker) {
+    return state | (worker << 8);
+}
+
+static_assert(kMaxWorkers <= (UINT32_MAX >> 8),
+              "worker states must be distinct for every worker");
+
+// Room kept free in each slot after a request, through which the entry's
+// values are fetched.
+const size_t kFetchSpace = 64 << 10;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex words must be plain 32-bit integers");
+
+void futex_wait(std::atomic<uint32_t> &word, uint32_t expected,
+                int timeout_ms) {
+    timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+            expected, timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> &word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, count,
+            nullptr, nullptr, 0);
+}
+
+// Lives at the start of the shared mapping, followed by the slots.
+struct Shared {
+    std::atomic<uint32_t> request_seq;  // bumped for each new request
+    std::atomic<uint32_t> free_seq;     // bumped whenever a slot is freed
+    std::atomic<uint32_t> next_free;    // where callers start looking
+    std::atomic<uint32_t> next_request;  // where workers start looking
+    std::atomic<uint32_t> shutdown;
+};
+
+struct Slot {
+    std::atomic<uint32_t> state;
+    uint32_t size;  // of the encoded request or result in data()
+    // For kFetch, the attribute whose values the worker wants and where in
+    // their encoding to start. The caller sets the size of the whole and
+    // how much of it follows the request in data().
+    uint32_t fetch_attr;
+    uint64_t fetch_offset;
+    uint64_t fetch_total;
+    uint64_t fetch_size;
+
+    char *data() { return reinterpret_cast<char *>(this) + kHeaderSize; }
+
+    static const size_t kHeaderSize = 64;
+};
+
+static_assert(sizeof(Slot) <= Slot::kHeaderSize,
+              "a slot's fields must fit before its data");
+
+size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+// A request's entry as a worker sees it: its attribute names and how many
+// values each has come with the request, and each attribute's values are
+// fetched from the caller the first time they are read, so that hooks only
+// pay for what they look at.
+class FetchingEntryView : public EntryView {
+  public:
+    FetchingEntryView(Slot *slot, unsigned worker, Arena &arena)
+        : slot_{slot}, worker_{worker}, arena_(arena), entry_{arena} {}
+
+    // What decode_request fills in.
+    FlatEntryView &entry() { return entry_; }
+
+    size_t size() const override { return entry_.size(); }
+    ValueRef name(size_t attr) const override { return entry_.name(attr); }
+    size_t find(ValueRef name) const override { return entry_.find(name); }
+    size_t num_values(size_t attr) const override {
+        return entry_.num_values(attr);
+    }
+    ValueRef value(size_t attr, size_t idx) const override {
+        fetch(attr);
+        return entry_.value(attr, idx);
+    }
+
+  private:
+    void fetch(size_t attr) const;
+
+    Slot *slot_;
+    unsigned worker_;
+    Arena &arena_;
+    mutable FlatEntryView entry_;
+    mutable vector<bool> fetched_;
+};
+
+void FetchingEntryView::fetch(size_t attr) const {
+    if (fetched_.empty()) {
+        fetched_.assign(entry_.size(), false);
+    }
+    if (fetched_[attr]) {
+        return;
+    }
+    fetched_[attr] = true;
+
+    // The values are copied into the arena, since the slot's free space is
+    // reused for each piece.
+    const uint32_t busy = worker_state(kBusy, worker_);
+    const char *piece = slot_->data() + slot_->size;
+    char *values = nullptr;
+    size_t total = 0, offset = 0;
+    do {
+        slot_->fetch_attr = attr;
+        slot_->fetch_offset = offset;
+        slot_->state.store(worker_state(kFetch, worker_));
+        futex_wake(slot_->state, 1);
+        uint32_t state;
+        while ((state = slot_->state.load()) != busy) {
+            futex_wait(slot_->state, state, -1);
+        }
+        if (offset == 0) {
+            total = slot_->fetch_total;
+            values = static_cast<char *>(arena_.allocate(total));
+        }
+        size_t size = std::min<size_t>(slot_->fetch_size, total - offset);
+        if (size == 0) {
+            break;
+        }
+        memcpy(values + offset, piece, size);
+        offset += size;
+    } while (offset < total);
+    // If that failed, the attribute is left with no values.
+    decode_values(values, offset, attr, entry_);
+}
+
+// Returns the descriptors open in this process above stderr, in order.
+vector<int> open_fds() {
+    vector<int> fds;
+    if (DIR *dir = opendir("/proc/self/fd")) {
+        while (dirent *ent = readdir(dir)) {
+            int fd = atoi(ent->d_name);
+            if (fd > STDERR_FILENO && fd != dirfd(dir)) {
+                fds.push_back(fd);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(fds.begin(), fds.end());
+    return fds;
+}
+
+// Leaves a forked worker with nothing of slapd's but the shared mapping,
+// and the descriptors in keep (sorted), which the hook opened.
+void detach_from_parent(pid_t parent, const vector<int> &keep) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent) {
+        _exit(0);
+    }
+
+    const int signals[] = {SIGHUP, SIGINT, SIGTERM, SIGUSR1, SIGUSR2};
+    for (int sig : signals) {
+        signal(sig, SIG_DFL);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+
+    // Don't keep slapd's listeners and client connections open.
+    for (int fd : open_fds()) {
+        if (!std::binary_search(keep.begin(), keep.end(), fd)) {
+            close(fd);
+        }
+    }
+}
+
+class WorkerPool : public InstanceInfo {
+  public:
+    WorkerPool(unique_ptr<InstanceInfo> inner, const WorkerPoolConfig &config);
+    WorkerPool(const WorkerPool &) = delete;
+    ~WorkerPool() override;
+    void operator=(const WorkerPool &) = delete;
+
+    void set_filename(const string &name) override {
+        inner_->set_filename(name);
+    }
+    void set_function_name(const string &name) override {
+        inner_->set_function_name(name);
+    }
+    void add_function_name(const string &name) override {
+        inner_->add_function_name(name);
+    }
+    void add_file(const string &filename,
+                  const string &function_name) override {
+        inner_->add_file(filename, function_name);
+    }
+    void set_zero_copy(bool zero_copy) override {
+        inner_->set_zero_copy(zero_copy);
+    }
+    void set_interpreters(unsigned interpreters) override {
+        inner_->set_interpreters(interpreters);
+    }
+    void set_entry_cache_size(size_t size) override {
+        inner_->set_entry_cache_size(size);
+    }
+    void set_value_set_threshold(size_t threshold) override {
+        inner_->set_value_set_threshold(threshold);
+    }
+    void set_bytecode_cache(const string &dir) override {
+        inner_->set_bytecode_cache(dir);
+    }
+    void set_share_module(bool share) override {
+        inner_->set_share_module(share);
+    }
+    // Not passed on, since the watchdog thread they need wouldn't survive
+    // the fork into the workers.
+    void set_timeout(unsigned long) override {}
+    void set_timeout_status(int) override {}
+    void set_profile(const string &, unsigned) override {}
+    void open() override;
+    bool reload(string &error) override {
+        error = "Hook files can't be reloaded in worker processes";
+        return false;
+    }
+    int update(ModificationOp &op, string &error) override {
+        return update(string{}, op, error);
+    }
+    int update(const string &function_name, ModificationOp &op,
+               string &error) override;
+
+  private:
+    Slot *slot(unsigned idx) {
+        return reinterpret_cast<Slot *>(slots_ + idx * slot_stride_);
+    }
+    unsigned acquire_slot();
+    void release_slot(unsigned idx);
+    int claim_request(unsigned worker);
+    void respond(Slot *slot, const UpdateResult &result,
+                 const ModificationOp &op);
+    // Responds with result if worker had claimed s, once no caller is
+    // writing to it.
+    void fail_request(Slot *s, unsigned worker, const UpdateResult &result,
+                      const ModificationOp &op);
+    // Hands a worker which asked for them (in state) some of op's entry's
+    // values.
+    void serve_fetch(Slot *slot, uint32_t state, const ModificationOp &op);
+
+    void spawn(unsigned worker);
+    void serve(unsigned worker);
+    void supervise();
+    // Notes whether any worker is running or may yet start, and if none is,
+    // fails the requests waiting for one.
+    void check_workers();
+
+    unique_ptr<InstanceInfo> inner_;
+    WorkerPoolConfig config_;
+    pid_t parent_;
+
+    char *mapping_;
+    size_t mapping_size_;
+    Shared *shared_;
+    char *slots_;
+    size_t slot_stride_;
+
+    // Descriptors opened while the hook was loaded, sorted.
+    vector<int> hook_fds_;
+    vector<pid_t> pids_;
+    vector<std::chrono::steady_clock::time_point> spawn_times_;
+    // Whether the last attempt to start each worker failed.
+    vector<bool> spawn_failed_;
+    std::atomic<bool> no_workers_{false};
+    std::thread supervisor_;
+};
+
+WorkerPool::WorkerPool(unique_ptr<InstanceInfo> inner,
+                       const WorkerPoolConfig &config)
+    : inner_{std::move(inner)},
+      config_(config),
+      parent_{getpid()},
+      mapping_{nullptr},
+      mapping_size_{0},
+      shared_{nullptr},
+      slots_{nullptr},
+      slot_stride_{0} {
+    if (config_.slots == 0) {
+        config_.slots = 2 * config_.workers;
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    if (!shared_) {
+        return;
+    }
+
+    shared_->shutdown.store(1);
+    futex_wake(shared_->shutdown, INT_MAX);
+    shared_->request_seq.fetch_add(1);
+    futex_wake(shared_->request_seq, INT_MAX);
+    if (supervisor_.joinable()) {
+        supervisor_.join();
+    }
+
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    for (pid_t pid : pids_) {
+        if (pid <= 0) {
+            continue;
+        }
+        while (waitpid(pid, nullptr, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    munmap(mapping_, mapping_size_);
+}
+
+void WorkerPool::open() {
+    if (config_.workers == 0 || config_.workers > kMaxWorkers ||
+        config_.slots > kMaxWorkerSlots) {
+        throw PyError{"py_workers must be between 1 and " +
+                      std::to_string(kMaxWorkers) + ", and py_worker_slots " +
+                      "at most " + std::to_string(kMaxWorkerSlots)};
+    }
+
+    // Load the hook before forking so that errors are reported here and so
+    // that workers share the loaded module's pages. Whatever it opens while
+    // loading (log files, say) is left open in the workers.
+    vector<int> fds_before = open_fds();
+    inner_->open();
+    vector<int> fds_after = open_fds();
+    hook_fds_.clear();
+    std::set_difference(fds_after.begin(), fds_after.end(),
+                        fds_before.begin(), fds_before.end(),
+                        std::back_inserter(hook_fds_));
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t header_size = round_up(sizeof(Shared), page_size);
+    slot_stride_ = round_up(Slot::kHeaderSize + config_.slot_size, page_size);
+    mapping_size_ = header_size + slot_stride_ * config_.slots;
+    // Slot pages are only populated as large requests touch them.
+    void *mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw PyError{string{"Unable to map worker pool memory: "} +
+                      strerror(errno)};
+    }
+    mapping_ = static_cast<char *>(mapping);
+    shared_ = new (mapping_) Shared();
+    slots_ = mapping_ + header_size;
+    for (unsigned i = 0; i < config_.slots; i++) {
+        new (slot(i)) Slot();
+    }
+
+    pids_.assign(config_.workers, -1);
+    spawn_times_.resize(config_.workers);
+    spawn_failed_.assign(config_.workers, false);
+    for (unsigned i = 0; i < config_.workers; i++) {
+        spawn(i);
+    }
+    check_workers();
+    supervisor_ = std::thread{&WorkerPool::supervise, this};
+}
+
+int WorkerPool::update(const string &function_name, ModificationOp &op,
+                       string &error) {
+    if (no_workers_.load()) {
+        throw PyError{"No py workers are running"};
+    }
+    unsigned idx = acquire_slot();
+    Slot *s = slot(idx);
+    size_t limit =
+        config_.slot_size > kFetchSpace ? config_.slot_size - kFetchSpace : 0;
+    s->size = encode_request(function_name, op, false, s->data(), limit);
+    if (s->size == 0) {
+        release_slot(idx);
+        throw PyError{"Modification of " + op.dn.str() +
+                      " is too large for py_worker_slot_size"};
+    }
+    s->state.store(kRequest);
+    shared_->request_seq.fetch_add(1);
+    futex_wake(shared_->request_seq, 1);
+
+    uint32_t state;
+    while ((state = s->state.load()) != kResponse) {
+        if ((state & 0xff) == kFetch) {
+            serve_fetch(s, state, op);
+        } else {
+            futex_wait(s->state, state, -1);
+        }
+    }
+
+    UpdateResult result;
+    bool ok = decode_result(s->data(), s->size, result, op);
+    release_slot(idx);
+    if (!ok) {
+        throw PyError{"Invalid result from py worker for " + op.dn.str()};
+    } else if (result.exception) {
+        throw PyError{result.error};
+    } else if (result.status != 0) {  // LDAP_SUCCESS
+        error = result.error;
+    }
+    return result.status;
+}
+
+unsigned WorkerPool::acquire_slot() {
+    for (;;) {
+        uint32_t seq = shared_->free_seq.load();
+        uint32_t start = shared_->next_free.fetch_add(1);
+        for (unsigned i = 0; i < config_.slots; i++) {
+            unsigned idx = (start + i) % config_.slots;
+            uint32_t expected = kFree;
+            if (slot(idx)->state.compare_exchange_strong(expected, kFilling)) {
+                return idx;
+            }
+        }
+        // Every slot is in use, so wait for one to be released.
+        futex_wait(shared_->free_seq, seq, -1);
+    }
+}
+
+void WorkerPool::release_slot(unsigned idx) {
+    slot(idx)->state.store(kFree);
+    shared_->free_seq.fetch_add(1);
+    futex_wake(shared_->free_seq, 1);
+}
+
+int WorkerPool::claim_request(unsigned worker) {
+    uint32_t start = shared_->next_request.load();
+    for (unsigned i = 0; i < config_.slots; i++) {
+        unsigned idx = (start + i) % config_.slots;
+        uint32_t expected = kRequest;
+        if (slot(idx)->state.compare_exchange_strong(
+                expected, worker_state(kBusy, worker))) {
+            shared_->next_request.store(idx + 1);
+            return idx;
+        }
+    }
+    return -1;
+}
+
+void WorkerPool::respond(Slot *s, const UpdateResult &result,
+                         const ModificationOp &op) {
+    s->size = encode_result(result, op, s->data(), config_.slot_size);
+    if (s->size == 0) {
+        UpdateResult too_large{kLdapOther, true,
+                               "Result is too large for py_worker_slot_size"};
+        s->size = encode_result(too_large, op, s->data(), config_.slot_size);
+    }
+    s->state.store(kResponse);
+    futex_wake(s->state, 1);
+}
+
+void WorkerPool::fail_request(Slot *s, unsigned worker,
+                              const UpdateResult &result,
+                              const ModificationOp &op) {
+    const uint32_t busy = worker_state(kBusy, worker);
+    const uint32_t fetch = worker_state(kFetch, worker);
+    for (;;) {
+        uint32_t state = s->state.load();
+        if (state == worker_state(kFetching, worker)) {
+            // The caller will hand it back as busy shortly.
+            std::this_thread::yield();
+            continue;
+        } else if (state != busy && state != fetch) {
+            return;
+        } else if (s->state.compare_exchange_strong(state, kFilling)) {
+            respond(s, result, op);
+            return;
+        }
+    }
+}
+
+void WorkerPool::serve_fetch(Slot *s, uint32_t state,
+                             const ModificationOp &op) {
+    // The supervisor may have failed the request of a worker which died.
+    uint32_t worker_bits = state & ~0xffu;
+    if (!s->state.compare_exchange_strong(state, kFetching | worker_bits)) {
+        return;
+    }
+    const EntryView *entry = op.entry;
+    size_t attr = s->fetch_attr;
+    s->fetch_total = 0;
+    s->fetch_size = 0;
+    if (entry && attr < entry->size()) {
+        s->fetch_total = values_size(*entry, attr);
+        if (s->fetch_offset < s->fetch_total) {
+            s->fetch_size = std::min<size_t>(s->fetch_total - s->fetch_offset,
+                                             config_.slot_size - s->size);
+            encode_values(*entry, attr, s->fetch_offset, s->data() + s->size,
+                          s->fetch_size);
+        }
+    }
+    s->state.store(kBusy | worker_bits);
+    futex_wake(s->state, 1);
+}
+
+void WorkerPool::spawn(unsigned worker) {
+    spawn_times_[worker] = std::chrono::steady_clock::now();
+    pid_t pid = fork_interpreter();
+    if (pid == 0) {
+        detach_from_parent(parent_, hook_fds_);
+        serve(worker);
+        _exit(0);
+    } else if (pid < 0) {
+        log_error("Unable to start py worker " + std::to_string(worker) +
+                  ": " + strerror(errno));
+    }
+    pids_[worker] = pid;
+    spawn_failed_[worker] = pid < 0;
+}
+
+void WorkerPool::serve(unsigned worker) {
+    string function_name;
+    while (!shared_->shutdown.load()) {
+        uint32_t seq = shared_->request_seq.load();
+        int idx = claim_request(worker);
+        if (idx < 0) {
+            futex_wait(shared_->request_seq, seq, 1000);
+            continue;
+        }
+
+        // Everything for the request is freed with op's arena.
+        ModificationOp op;
+        Slot *s = slot(idx);
+        FetchingEntryView entry{s, worker, op.arena};
+        UpdateResult result{0, false, ""};
+        if (!decode_request(s->data(), s->size, false, function_name, op,
+                            entry.entry())) {
+            result =
+                UpdateResult{kLdapOther, true, "Invalid py worker request"};
+        } else {
+            op.entry = &entry;
+            try {
+                if (function_name.empty()) {
+                    result.status = inner_->update(op, result.error);
+                } else {
+                    result.status =
+                        inner_->update(function_name, op, result.error);
+                }
+            } catch (PyError &exc) {
+                result = UpdateResult{kLdapOther, true, exc.what()};
+            }
+        }
+        // Values borrowed from the request live in the slot, which is about
+        // to be overwritten with the result. Unchanged modifications are only
+        // sent back as their origin.
+        for (Modification &mod : op.mods) {
+            if (mod.origin != Modification::kNew) {
+                continue;
+            }
+            for (Value &value : mod.values) {
+                value.own(op.arena);
+            }
+        }
+        op.entry = nullptr;
+        respond(s, result, op);
+    }
+}
+
+void WorkerPool::supervise() {
+    while (!shared_->shutdown.load()) {
+        for (unsigned worker = 0; worker < pids_.size(); worker++) {
+            pid_t pid = pids_[worker];
+            int status;
+            if (pid > 0 && waitpid(pid, &status, WNOHANG) != pid) {
+                continue;
+            }
+            if (pid > 0) {
+                log_error("py worker " + std::to_string(worker) + " (pid " +
+                          std::to_string(pid) + ") exited with status " +
+                          std::to_string(status) + ", restarting it");
+                pids_[worker] = -1;
+                UpdateResult died{kLdapOther, true,
+                                  "py worker exited during update"};
+                ModificationOp no_op;
+                for (unsigned i = 0; i < config_.slots; i++) {
+                    fail_request(slot(i), worker, died, no_op);
+                }
+            }
+            // Don't spin if the hook kills its worker straight away.
+            if (std::chrono::steady_clock::now() - spawn_times_[worker] >
+                std::chrono::seconds(1)) {
+                spawn(worker);
+            }
+        }
+        check_workers();
+        futex_wait(shared_->shutdown, 0, 100);
+    }
+}
+
+void WorkerPool::check_workers() {
+    // A worker waiting out the restart delay will be back shortly.
+    bool any = false;
+    for (unsigned worker = 0; worker < pids_.size(); worker++) {
+        if (pids_[worker] > 0 || !spawn_failed_[worker]) {
+            any = true;
+        }
+    }
+    no_workers_.store(!any);
+    if (any) {
+        return;
+    }
+    UpdateResult none{kLdapOther, true, "No py workers are running"};
+    ModificationOp no_op;
+    for (unsigned i = 0; i < config_.slots; i++) {
+        uint32_t expected = kRequest;
+        if (slot(i)->state.compare_exchange_strong(expected, kFilling)) {
+            respond(slot(i), none, no_op);
+        }
+    }
+}
+
+}  // anonymous namespace
+
+InstanceInfo *create_worker_pool(unique_ptr<InstanceInfo> inner,
+                                 const WorkerPoolConfig &config) {
+    return new WorkerPool{std::move(inner), config};
+}
+
+}  // namespace slapo_py_update_hook
@@ -0,0 +1,33 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "slapo_py_update_hook.h"
+
+namespace slapo_py_update_hook {
+
+// Largest values accepted for WorkerPoolConfig's workers and slots.
+const unsigned kMaxWorkers = 1024;
+const unsigned kMaxWorkerSlots = 4096;
+
+struct WorkerPoolConfig {
+    unsigned workers = 0;
+    // Number of requests that can be queued or in progress at once; further
+    // callers block until one completes. 0 means twice the worker count.
+    unsigned slots = 0;
+    // Maximum size of an encoded request or result.
+    size_t slot_size = 16 << 20;
+};
+
+// Creates an InstanceInfo which opens inner in the calling process and then
+// runs its updates in a pool of forked worker processes, exchanging
+// ModificationOps with them through a ring of shared-memory slots. Workers
+// which exit are restarted; requests they were handling fail.
+InstanceInfo *create_worker_pool(std::unique_ptr<InstanceInfo> inner,
+                                 const WorkerPoolConfig &config);
+
+}  // namespace slapo_py_update_hook
+
+#endif  // WORKER_POOL_H_